@@ -0,0 +1,126 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "libwclang.h"
+
+extern char **environ;
+
+static char **copystrings(const string_vector &strings)
+{
+    char **result = static_cast<char**>(std::calloc(strings.size()+1, sizeof(char*)));
+
+    if (!result)
+        return nullptr;
+
+    for (size_t i = 0; i < strings.size(); ++i)
+        result[i] = strdup(strings[i].c_str());
+
+    return result;
+}
+
+static void freestrings(char **strings)
+{
+    if (!strings)
+        return;
+
+    for (char **p = strings; *p; ++p)
+        std::free(*p);
+
+    std::free(strings);
+}
+
+int wclang_compute(int argc, const char *const *argv, const char *const *envp,
+                   wclang_result *result)
+{
+    string_vector args(argv, argv + argc);
+    string_vector env;
+    std::vector<char*> cargv;
+    std::ostringstream out;
+    std::ostringstream err;
+    threadcontext context = { &env, &out, &err };
+    commandstate state;
+    int status;
+
+    std::memset(result, 0, sizeof(*result));
+
+    for (const char *const *var = envp ? envp : environ; *var; ++var)
+        env.push_back(*var);
+
+    /* parseargs() may modify the arguments */
+    for (auto &arg : args)
+        cargv.push_back(&arg[0]);
+
+    cargv.push_back(nullptr);
+
+    setthreadcontext(&context);
+    suspendtrace(true);
+
+    try
+    {
+        status = argc > 0 ? computecommand(argc, &cargv[0], state) : 1;
+
+        if (status == COMMAND_READY)
+        {
+            result->argv = copystrings(state.args);
+
+            if (result->argv && state.cmdargs.appendexe)
+                appendexetooutputname(result->argv);
+
+            result->envp = copystrings(env);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        err << "internal error: " << e.what() << std::endl;
+        status = 1;
+    }
+
+    suspendtrace(false);
+    setthreadcontext(nullptr);
+
+    if (status == COMMAND_READY && (!result->argv || !result->envp))
+    {
+        err << "out of memory" << std::endl;
+        status = 1;
+    }
+
+    result->status = status;
+    result->output = strdup(out.str().c_str());
+    result->errors = strdup(err.str().c_str());
+
+    return status;
+}
+
+void wclang_free_result(wclang_result *result)
+{
+    freestrings(result->argv);
+    freestrings(result->envp);
+
+    std::free(result->output);
+    std::free(result->errors);
+
+    std::memset(result, 0, sizeof(*result));
+}
@@ -0,0 +1,47 @@
+/*
+ * libwclang
+ *
+ * Computes the command wclang would execute for an invocation
+ * without running it, so that build generators can precompute
+ * the compiler commands of many translation units in-process.
+ *
+ * wclang_compute() may be called concurrently from several threads.
+ * It uses the discovery cache like wclang, relative paths (sources,
+ * @response files) are resolved against the current directory.
+ */
+
+#ifndef LIBWCLANG_H
+#define LIBWCLANG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* result.status if result.argv holds the compiler command */
+#define WCLANG_COMMAND (-1)
+
+struct wclang_result {
+    int status;    /* WCLANG_COMMAND or the exit status of wclang */
+    char **argv;   /* compiler command, NULL terminated */
+    char **envp;   /* environment for the compiler, NULL terminated */
+    char *output;  /* what wclang would write to stdout (e.g. -wc-target) */
+    char *errors;  /* warnings and error messages */
+};
+
+/*
+ * argv[0] is the invocation name (e.g. x86_64-w64-mingw32-clang++),
+ * envp the environment (NULL: the process environment), it is also
+ * passed to the programs wclang runs (e.g. clang --version).
+ * Returns result->status, 'result' must be released with
+ * wclang_free_result().
+ */
+int wclang_compute(int argc, const char *const *argv, const char *const *envp,
+                   struct wclang_result *result);
+
+void wclang_free_result(struct wclang_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBWCLANG_H */
@@ -24,17 +24,37 @@
 #include <typeinfo>
 #include <tuple>
 #include <cstring>
+#include <cerrno>
 #include <algorithm>
+#include <iterator>
+#include <map>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <climits>
 #include <cstdlib>
 #include <cassert>
 #include "wclang.h"
 #include "wclang_time.h"
+#include "wclang_cache.h"
+#include "wclang_objcache.h"
+#include "wclang_parallel.h"
+#include "wclang_pch.h"
+#include "wclang_rsp.h"
+#include "wclang_export.h"
+#include "wclang_lto.h"
+#include "wclang_hmap.h"
+#include "wclang_vfs.h"
+#include "wclang_process.h"
+#include "wclang_scandeps.h"
+#include "wclang_admission.h"
+
+extern char **environ;
 
 /*
  * Supported targets
@@ -77,6 +97,12 @@ static constexpr const char* ENVVARS[] = {
 
 static constexpr char COMMANDPREFIX[] = "-wc-";
 
+/*
+ * Toolchain queries (<triple>-gcc -print-...) are killed
+ * after this many milliseconds
+ */
+static constexpr int QUERYTIMEOUT = 30000;
+
 #ifndef NO_SYS_PATH
 /*
  * Paths where we should look for mingw C++ headers
@@ -103,50 +129,73 @@ static constexpr const char* STDINCLUDEBASE[] = {
 
 static bool findcxxheaders(const char *target, commandargs &cmdargs)
 {
+    tracescope trace("findcxxheaders");
     std::string root;
     std::string cxxheaders;
     std::string mingwheaders;
     auto &mv = cmdargs.mingwversion;
     auto &cxxpaths = cmdargs.cxxpaths;
     const auto &stdpaths = cmdargs.stdpaths;
-    static const char *_target = target;
 
-    auto checkmingwheaders = [](const char *dir, const char *file)
+    /*
+     * <gccver> directories of a base directory and whether they
+     * contain a <target> subdirectory, each base is scanned once
+     */
+
+    typedef std::vector<std::pair<compilerver, bool>> versiondirs;
+    std::map<std::string, versiondirs> scanned;
+
+    auto latestversion = [&](const std::string &dir, bool mingw) -> compilerver
     {
-        static struct stat st;
-        static std::stringstream d;
+        auto it = scanned.find(dir);
+
+        if (it == scanned.end())
+        {
+            versiondirs &versions = scanned[dir];
+
+            listfiles(dir.c_str(), nullptr, [&](int dirfd, const char *, const char *file)
+            {
+                struct stat st;
+                std::string mingwdir = std::string(file) + "/" + target;
+
+                recordprobe((dir + mingwdir).c_str());
+
+                versions.push_back(std::make_pair(parsecompilerversion(file),
+                                                  !fstatat(dirfd, mingwdir.c_str(), &st, 0)));
+                return false;
+            });
+
+            it = scanned.find(dir);
+        }
+
+        compilerver latest;
+        bool found = false;
+
+        for (const auto &version : it->second)
+        {
+            if (mingw && !version.second)
+                continue;
 
-        clear(d);
-        d << dir << file << "/" << _target;
+            if (!found || latest < version.first)
+                latest = version.first;
 
-        return !stat(d.str().c_str(), &st);
+            found = true;
+        }
+
+        return latest;
     };
 
     auto checkheaderdir = [](const std::string &cxxheaderdir)
     {
-        static std::string file;
-        static struct stat st;
-
-        file = cxxheaderdir;
-        file += "/";
-        file += "iostream";
-
-        return !stat(file.c_str(), &st);
+        return fileexists((cxxheaderdir + "/iostream").c_str());
     };
 
     auto addheaderdir = [&](const std::string &cxxheaderdir, bool mingw)
     {
-        static std::string mingwheaderdir;
         cxxpaths.push_back(cxxheaderdir);
 
         if (mingw)
-        {
-            mingwheaderdir = cxxheaderdir;
-            mingwheaderdir += "/";
-            mingwheaderdir += target;
-
-            cxxpaths.push_back(mingwheaderdir);
-        }
+            cxxpaths.push_back(cxxheaderdir + "/" + target);
     };
 
     auto findheaders = [&]()
@@ -199,8 +248,7 @@ static bool findcxxheaders(const char *target, commandargs &cmdargs)
             cxxheaders += cxxinclude;
             cxxheaders += "/";
 
-            mv = findlatestcompilerversion(cxxheaders.c_str(),
-                                           checkmingwheaders);
+            mv = latestversion(cxxheaders, true);
 
             if (!mv.num())
                 continue;
@@ -227,8 +275,7 @@ static bool findcxxheaders(const char *target, commandargs &cmdargs)
             cxxheaders += target;
             cxxheaders += "/";
 
-            mv = findlatestcompilerversion(cxxheaders.c_str(),
-                                           checkmingwheaders);
+            mv = latestversion(cxxheaders, true);
 
             if (!mv.num())
                 continue;
@@ -259,7 +306,7 @@ static bool findcxxheaders(const char *target, commandargs &cmdargs)
             cxxheaders += target;
             cxxheaders += "/";
 
-            mv = findlatestcompilerversion(cxxheaders.c_str());
+            mv = latestversion(cxxheaders, false);
 
             if (!mv.num())
                 continue;
@@ -267,7 +314,7 @@ static bool findcxxheaders(const char *target, commandargs &cmdargs)
             cxxheaders += mv.s;
             cxxheaders += "/include/c++";
 
-            if (!checkmingwheaders(cxxheaders.c_str(), ""))
+            if (!fileexists((cxxheaders + "/" + target).c_str()))
                 continue;
 
             if (checkheaderdir(cxxheaders))
@@ -290,65 +337,52 @@ static bool findcxxheaders(const char *target, commandargs &cmdargs)
 
 static bool findintrinheaders(commandargs &cmdargs, const std::string &clangbindir)
 {
-    static std::stringstream dir;
-    static compilerver *clangversion;
-    static std::string pathtmp;
+    tracescope trace("findintrinheaders");
+    std::stringstream dir;
+    compilerver &clangversion = cmdargs.clangversion;
+    std::string pathtmp;
 
-    clangversion = &cmdargs.clangversion;
     string_vector &intrinpaths = cmdargs.intrinpaths;
 
-    clear(dir);
-    *clangversion = compilerver();
-    pathtmp.clear();
+    clangversion = compilerver();
 
     auto trydir = [&]() -> bool
     {
-        listfiles(dir.str().c_str(), nullptr, [](const char *, const char *file)
+        listfiles(dir.str().c_str(), nullptr, [&](int dirfd, const char *dir, const char *file)
         {
-            if (file[0] != '.' && isdirectory(file, dir.str().c_str()))
-            {
-                compilerver cv = parsecompilerversion(file);
+            struct stat st;
 
-                if (cv != compilerver())
-                {
-                    static std::stringstream tmp;
-                    clear(tmp);
+            recordprobe((std::string(dir) + "/" + file).c_str());
 
-                    auto checkdir = [&](std::stringstream &dir)
-                    {
-                        static std::string intrindir;
-                        auto &file = dir;
+            if (fstatat(dirfd, file, &st, 0) || !S_ISDIR(st.st_mode))
+                return true;
 
-                        intrindir = dir.str();
-                        file << "/xmmintrin.h";
+            compilerver cv = parsecompilerversion(file);
 
-                        if (fileexists(file.str().c_str()))
-                        {
-                            if (cv > *clangversion)
-                            {
-                                *clangversion = cv;
-                                pathtmp.swap(intrindir);
-                            }
-                            return true;
-                        }
+            if (cv == compilerver())
+                return true;
 
-                        return false;
-                    };
+            for (const char *subdir : { "/include", "" })
+            {
+                std::string intrindir = std::string(file) + subdir;
+                std::string header = intrindir + "/xmmintrin.h";
 
-                    tmp << dir.str() << "/" << file << "/include";
+                recordprobe((std::string(dir) + "/" + header).c_str());
 
-                    if (!checkdir(tmp))
+                if (!fstatat(dirfd, header.c_str(), &st, 0))
+                {
+                    if (cv > clangversion)
                     {
-                        clear(tmp);
-                        tmp << dir.str() << "/" << file;
-                        checkdir(tmp);
+                        clangversion = cv;
+                        pathtmp = std::string(dir) + "/" + intrindir;
                     }
+                    break;
                 }
-                return true;
             }
+
             return true;
         });
-        return *clangversion != compilerver();
+        return clangversion != compilerver();
     };
 
 #define TRYDIR(basedir, subdir)               \
@@ -404,66 +438,83 @@ do                                            \
 #undef TRYDIR3
 }
 
-static bool findstdheader(const char *target, commandargs &cmdargs)
-{
-    std::string dir;
-    struct stat st;
-    auto &stdpaths = cmdargs.stdpaths;
-    const char *mingwpath = getenv("MINGW_PATH");
+/*
+ * Looks for the C headers of the first of the given targets that is
+ * installed below one of the base directories ($MINGW_PATH, MINGW_PATH
+ * or STDINCLUDEBASE).
+ *
+ * Each base directory (and its usr/ subdirectory for MXE) is opened
+ * and enumerated once for all targets, the layouts of matching entries
+ * are probed relative to the directory descriptor. A target listed
+ * earlier wins, otherwise the first base directory does.
+ */
 
-    auto checkdir = [&](const char *stdinclude) -> bool
+static const char *findstdheader(const char *const *targets, const char *const *targetsend,
+                                 commandargs &cmdargs)
+{
+    tracescope trace("findstdheader");
+    /* MXE only uses the first one */
+    static constexpr const char* LAYOUTS[] = { "/include", "/sys-root/mingw/include" };
+    const char *const *best = targetsend;
+    std::string result;
+    const char *mingwpath = getenvvar("MINGW_PATH");
+
+    auto scandir = [&](int dirfd, const std::string &dir, bool mxe)
     {
-        auto trydir = [&](const std::string &dir) -> bool
+        recordprobe(dir.c_str());
+
+        if (dirfd == -1)
+            return;
+
+        scandirectory(dirfd, [&](const char *name)
         {
-            if (!stat(dir.c_str(), &st) && S_ISDIR(st.st_mode))
+            auto target = std::find_if(targets, best, [&](const char *target)
             {
-                std::string filecheck = dir + "/stdlib.h";
+                return !std::strcmp(name, target);
+            });
 
-                if (stat(filecheck.c_str(), &st))
-                    return false;
+            if (target == best)
+                return;
 
-                stdpaths.push_back(dir);
+            for (size_t i = 0; i < (mxe ? 1 : std::extent<decltype(LAYOUTS)>::value); ++i)
+            {
+                const char *layout = LAYOUTS[i];
+                struct stat st;
+                std::string file = std::string(name) + layout + "/stdlib.h";
 
-#ifdef _DEBUG
-                for (const auto &dir : stdpaths)
-                    std::cout << "found C include dir: " << dir << std::endl;
-#endif
+                recordprobe((dir + "/" + file).c_str());
 
-                return true;
+                if (!fstatat(dirfd, file.c_str(), &st, 0))
+                {
+                    best = target;
+                    result = dir + "/" + name + layout;
+                    break;
+                }
             }
+        });
+    };
 
-            return false;
-        };
-
-        dir = stdinclude;
-        dir += "/";
-        dir += target;
-        dir += "/include";
-
-        if (trydir(dir))
-            return true;
-
-        dir = stdinclude;
-        dir += "/";
-        dir += target;
-        dir += "/sys-root/mingw/include";
+    auto checkdir = [&](const std::string &base) -> bool
+    {
+        int dirfd = opendirectory(base.c_str());
 
-        if (trydir(dir))
-            return true;
+        scandir(dirfd, base, false);
 
         // MXE
-        dir = stdinclude;
-        dir += "/usr/";
-        dir += target;
-        dir += "/include";
+        if (best != targets)
+        {
+            int usrfd = dirfd != -1 ? opendirectory("usr", dirfd) : -1;
+            scandir(usrfd, base + "/usr", true);
+            if (usrfd != -1) close(usrfd);
+        }
 
-        if (trydir(dir))
-            return true;
+        if (dirfd != -1)
+            close(dirfd);
 
-        return false;
+        return best == targets;
     };
 
-    auto checkpath = [&](const char *p) -> bool
+    auto checkpath = [&](const char *p)
     {
         std::string path;
 
@@ -477,50 +528,57 @@ static bool findstdheader(const char *target, commandargs &cmdargs)
             if (path.find_last_of("/bin") != std::string::npos)
                 path.resize(path.size()-STRLEN("/bin"));
 
-            if (checkdir(path.c_str()))
-                return true;
+            if (checkdir(path))
+                break;
 
             path.clear();
         } while (*p);
-
-        return false;
     };
 
     if (mingwpath && *mingwpath)
-        return checkpath(mingwpath);
-
+    {
+        checkpath(mingwpath);
+    }
+    else
+    {
 #ifdef MINGW_PATH
-    if (*MINGW_PATH && checkpath(MINGW_PATH))
-        return true;
+        if (*MINGW_PATH)
+            checkpath(MINGW_PATH);
 #endif
 
 #ifndef NO_SYS_PATH
-    for (const char *stdinclude : STDINCLUDEBASE)
-        if (checkdir(stdinclude)) return true;
+        /* MINGW_PATH may already have found the preferred target */
+        for (const char *stdinclude : STDINCLUDEBASE)
+            if (best == targets || checkdir(stdinclude)) break;
 #endif
+    }
 
-    return false;
+    if (best == targetsend)
+        return nullptr;
+
+    cmdargs.stdpaths.push_back(result);
+
+#ifdef _DEBUG
+    std::cout << "found C include dir: " << result << std::endl;
+#endif
+
+    return *best;
 }
 
 static const char *findtarget32(commandargs &cmdargs)
 {
-    for (const char *target : TARGET32)
-        if (findstdheader(target, cmdargs)) return target;
-
-    return nullptr;
+    return findstdheader(std::begin(TARGET32), std::end(TARGET32), cmdargs);
 }
 
 static const char *findtarget64(commandargs &cmdargs)
 {
-    for (const char *target : TARGET64)
-        if (findstdheader(target, cmdargs)) return target;
-
-    return nullptr;
+    return findstdheader(std::begin(TARGET64), std::end(TARGET64), cmdargs);
 }
 
 static bool findheaders(commandargs &cmdargs, const std::string &target)
 {
-    return findstdheader(target.c_str(), cmdargs);
+    const char *t = target.c_str();
+    return findstdheader(&t, &t + 1, cmdargs) != nullptr;
 }
 
 static const char *findtriple(const char *name, int &targettype)
@@ -586,21 +644,22 @@ void appendexetooutputname(char **cargs)
                     return;
             }
 
-            std::cerr << R"(wclang: appending ".exe" to output filename ")"
-                      << filename << R"(")" << std::endl;
+            errstream() << R"(wclang: appending ".exe" to output filename ")"
+                        << filename << R"(")" << std::endl;
 
             filename = nullptr;
             suffix = nullptr;
 
             const size_t len = std::strlen(*arg)+STRLEN(".exe")+1;
-            *arg = static_cast<char*>(std::realloc(*arg, len));
+            char *newarg = static_cast<char*>(std::realloc(*arg, len));
 
-            if (!*arg)
+            if (!newarg)
             {
-                std::cerr << "out of memory" << std::endl;
-                std::exit(EXIT_FAILURE);
+                errstream() << "out of memory" << std::endl;
+                return;
             }
 
+            *arg = newarg;
             std::strcat(*arg, ".exe");
             break;
         }
@@ -614,18 +673,104 @@ void appendexetooutputname(char **cargs)
  * Tools
  */
 
+static thread_local threadcontext *context = nullptr;
+
 bool isterminal()
 {
-    static bool first = false;
-    static bool val;
+    /* captured by the library */
+    if (context && context->err)
+        return false;
+
+    static const bool val = !!isatty(fileno(stderr));
+    return val;
+}
+
+void setthreadcontext(threadcontext *ctx)
+{
+    context = ctx;
+}
+
+static string_vector::iterator findenvvar(string_vector &env, const char *name)
+{
+    size_t len = std::strlen(name);
+
+    return std::find_if(env.begin(), env.end(), [&](const std::string &var)
+    {
+        return !var.compare(0, len, name) && var.size() > len && var[len] == '=';
+    });
+}
+
+const char *getenvvar(const char *name)
+{
+    if (!context || !context->env)
+        return getenv(name);
+
+    auto it = findenvvar(*context->env, name);
+    return it != context->env->end() ? it->c_str() + std::strlen(name) + 1 : nullptr;
+}
+
+/*
+ * NULL terminated environment for child processes,
+ * 'storage' holds the array of a context
+ */
+char *const *getenvironment(std::vector<char*> &storage)
+{
+    if (!context || !context->env)
+        return environ;
+
+    storage.clear();
+
+    for (auto &var : *context->env)
+        storage.push_back(&var[0]);
 
-    if (!first)
+    storage.push_back(nullptr);
+    return storage.data();
+}
+
+void setenvvar(const char *name, const char *value)
+{
+    if (!context || !context->env)
     {
-        val = !!isatty(fileno(stderr));
-        first = true;
+        setenv(name, value, 1);
+        return;
     }
 
-    return val;
+    std::string var = std::string(name) + "=" + value;
+    auto it = findenvvar(*context->env, name);
+
+    if (it != context->env->end())
+        *it = var;
+    else
+        context->env->push_back(var);
+}
+
+bool unsetenvvar(const char *name)
+{
+    if (!context || !context->env)
+    {
+#ifdef HAVE_UNSETENV
+        return !unsetenv(name);
+#else
+        return false;
+#endif
+    }
+
+    auto it = findenvvar(*context->env, name);
+
+    if (it != context->env->end())
+        context->env->erase(it);
+
+    return true;
+}
+
+std::ostream &outstream()
+{
+    return context && context->out ? *context->out : std::cout;
+}
+
+std::ostream &errstream()
+{
+    return context && context->err ? *context->err : std::cerr;
 }
 
 void concatenvvariable(const char *var, const std::string val, std::string *nval)
@@ -634,13 +779,13 @@ void concatenvvariable(const char *var, const std::string val, std::string *nval
     if (!nval) nval = &tmp;
     *nval = val;
 
-    if (char *oldval = getenv(var))
+    if (const char *oldval = getenvvar(var))
     {
         *nval += ":";
         *nval += oldval;
     }
 
-    setenv(var, nval->c_str(), 1);
+    setenvvar(var, nval->c_str());
 }
 
 compilerver parsecompilerversion(const char *compilerversion)
@@ -674,10 +819,8 @@ compilerver parsecompilerversion(const char *compilerversion)
 
 compilerver findlatestcompilerversion(const char *dir, listfilescallback cmp)
 {
-    static std::vector<compilerver> v;
-    static std::vector<std::string> dirs;
-
-    dirs.clear();
+    std::vector<compilerver> v;
+    std::vector<std::string> dirs;
 
     if (!listfiles(dir, &dirs, cmp))
         return compilerver();
@@ -685,8 +828,6 @@ compilerver findlatestcompilerversion(const char *dir, listfilescallback cmp)
     if (dirs.empty())
         return compilerver();
 
-    v.clear();
-
     for (auto &d : dirs)
         v.push_back(parsecompilerversion(d.c_str()));
 
@@ -697,6 +838,7 @@ compilerver findlatestcompilerversion(const char *dir, listfilescallback cmp)
 bool fileexists(const char *file)
 {
     struct stat st;
+    recordprobe(file);
     return !stat(file, &st);
 }
 
@@ -709,35 +851,103 @@ bool isdirectory(const char *file, const char *prefix)
         std::string tmp = prefix;
         tmp += "/";
         tmp += file;
+        recordprobe(tmp.c_str());
         return !stat(tmp.c_str(), &st) && S_ISDIR(st.st_mode);
     }
 
+    recordprobe(file);
     return !stat(file, &st) && S_ISDIR(st.st_mode);
 }
 
-bool listfiles(const char *dir, std::vector<std::string> *files,
-               listfilescallback cmp)
+int opendirectory(const char *dir, int dirfd)
+{
+    return openat(dirfd == -1 ? AT_FDCWD : dirfd, *dir ? dir : "/",
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Calls 'callback' for every entry of 'dirfd' except . and ..,
+ * the descriptor is rewound first and left open
+ */
+
+bool scandirectory(int dirfd, const std::function<void (const char *name)> &callback)
 {
-    DIR *d = opendir(dir);
+    auto entry = [&](const char *name)
+    {
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            return;
+
+        callback(name);
+    };
+
+#if defined(__linux__) && defined(SYS_getdents64)
+    /*
+     * Read the entries directly, this saves the dup()
+     * and the allocation of fdopendir()/readdir()
+     */
+
+    alignas(dirent64) char buf[32768];
+    long len;
+
+    if (lseek(dirfd, 0, SEEK_SET) == -1)
+        return false;
+
+    while ((len = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+    {
+        for (long pos = 0; pos < len;)
+        {
+            const dirent64 *de = reinterpret_cast<const dirent64*>(buf + pos);
+            entry(de->d_name);
+            pos += de->d_reclen;
+        }
+    }
+
+    return len == 0;
+#else
+    int fd = dup(dirfd);
+    DIR *d = fd != -1 ? fdopendir(fd) : nullptr;
     dirent *de;
 
     if (!d)
+    {
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    rewinddir(d);
+
+    while ((de = readdir(d)))
+        entry(de->d_name);
+
+    closedir(d);
+    return true;
+#endif
+}
+
+bool listfiles(const char *dir, std::vector<std::string> *files,
+               listfilescallback cmp)
+{
+    int dirfd = opendirectory(dir);
+
+    recordprobe(dir);
+
+    if (dirfd == -1)
         return false;
 
     if (files)
         files->clear();
 
-    while ((de = readdir(d)))
+    bool ok = scandirectory(dirfd, [&](const char *file)
     {
-        if (de->d_name[0] == '.' || !std::strcmp(de->d_name, ".."))
-            continue;
+        if (file[0] == '.')
+            return;
 
-        if ((!cmp || cmp(dir, de->d_name)) && files)
-            files->push_back(de->d_name);
-    }
+        if ((!cmp || cmp(dirfd, dir, file)) && files)
+            files->push_back(file);
+    });
 
-    closedir(d);
-    return true;
+    close(dirfd);
+    return ok;
 }
 
 const char *getfileName(const char *file)
@@ -759,7 +969,7 @@ bool wcrealpath(const char *file, std::string &result,
                 realpathcmp cmp1, realpathcmp cmp2,
                 const size_t maxSymbolicLinkDepth)
 {
-    char *PATH = getenv("PATH");
+    const char *PATH = getenvvar("PATH");
     const char *p = PATH ? PATH : "";
     struct stat st;
 
@@ -773,6 +983,8 @@ bool wcrealpath(const char *file, std::string &result,
         result += "/";
         result += file;
 
+        recordprobe(result.c_str());
+
         if (!stat(result.c_str(), &st))
         {
             if (maxSymbolicLinkDepth == 0)
@@ -833,10 +1045,14 @@ bool wcrealpath(const char *file, std::string &result,
 
 bool getpathofcommand(const char *command, std::string &result)
 {
+    tracescope trace("getpathofcommand");
     wcrealpath(command, result, [](const char *f, const struct stat&){
         return !access(f, F_OK|X_OK);
     }, ignoreccache);
 
+    if (!result.empty())
+        recordbinary(result.c_str());
+
     size_t pos = result.find_last_of("/");
 
     if (pos != std::string::npos)
@@ -845,22 +1061,98 @@ bool getpathofcommand(const char *command, std::string &result)
     return !result.empty();
 }
 
-int runcommand(const char *command, char *buf, size_t len)
+bool findllvmtool(const std::string &bindir, int version, const char *name, std::string &tool)
+{
+    std::string dir;
+
+    /* next to clang, Debian and Ubuntu suffix the major version */
+    for (std::string file : { std::string(name), name + ("-" + std::to_string(version)) })
+    {
+        tool = bindir + PATHDIV + file;
+
+        if (!bindir.empty() && fileexists(tool.c_str()))
+            return true;
+
+        if (!version)
+            break;
+    }
+
+    if (!getpathofcommand(name, dir))
+        return false;
+
+    tool = dir + PATHDIV + name;
+    return true;
+}
+
+/*
+ * Options whose value is passed as separate argument
+ */
+
+static constexpr const char* OPTIONSWITHVALUE[] = {
+    "-o", "-x", "-I", "-D", "-U", "-include", "-imacros", "-include-pch",
+    "-isystem", "-isystem-after", "-cxx-isystem", "-iquote", "-idirafter",
+    "-iprefix", "-iwithprefix", "-iwithprefixbefore", "-isysroot",
+    "-imultilib", "-ivfsoverlay", "-MF", "-MT", "-MQ", "-MJ", "-Xclang",
+    "-Xlinker", "-Xassembler", "-Xpreprocessor", "-target",
+    "-ccc-host-triple", "-arch", "-L", "-l", "-u", "-z", "-T", "-e",
+    "--param", "-B", "-F", "--sysroot", "-gcc-toolchain", "-working-directory"
+};
+
+bool optionhasvalue(const char *opt)
 {
-    if (!len)
-        return RUNCOMMAND_ERROR;
+    for (const char *o : OPTIONSWITHVALUE)
+        if (!std::strcmp(opt, o)) return true;
 
-    FILE *p;
-    size_t outputlen;
+    return false;
+}
+
+void findinputfiles(char **args, std::vector<int> &inputs)
+{
+    inputs.clear();
 
-    if (!(p = popen(command, "r")) || !(outputlen = fread(buf, sizeof(char), len - 1, p)))
+    for (int i = 1; args[i]; ++i)
     {
-        if (p) pclose(p);
-        return RUNCOMMAND_ERROR;
+        const char *arg = args[i];
+
+        if (*arg != '-' || !arg[1])
+        {
+            inputs.push_back(i);
+            continue;
+        }
+
+        if (optionhasvalue(arg) && args[i+1])
+            ++i;
+    }
+}
+
+std::string jsonstring(const std::string &str)
+{
+    std::string result = "\"";
+
+    for (unsigned char c : str)
+    {
+        switch (c)
+        {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\t': result += "\\t"; break;
+            default:
+            {
+                if (c < 0x20)
+                {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    result += buf;
+                    continue;
+                }
+
+                result += c;
+            }
+        }
     }
 
-    buf[outputlen] = '\0';
-    return pclose(p);
+    return result + "\"";
 }
 
 void stripfilename(char *path)
@@ -883,81 +1175,127 @@ static void envvar(string_vector &env, const char *varname,
     env.push_back(var);
 }
 
-static void fmtstring(std::ostringstream &sbuf, const char *s)
+/*
+ * Returns LINKER_* for lld, bfd or auto, or -1
+ */
+static int parselinker(const char *linker)
 {
-    while (*s)
-    {
-        if (*s == '%')
-        {
-            if (s[1] == '%') ++s;
-            else ERROR("fmtstring() error");
-        }
+    if (!std::strcmp(linker, "lld") || !std::strcmp(linker, "ld.lld"))
+        return LINKER_LLD;
 
-        sbuf << *s++;
-    }
-}
-
-template<typename T, typename... Args>
-static std::string fmtstring(std::ostringstream &buf, const char *str,
-                             T value, Args... args)
-{
-    while (*str)
-    {
-        if (*str == '%')
-        {
-            if (str[1] != '%')
-            {
-                buf << value;
-                fmtstring(buf, str + 1, args...);
-                return buf.str();
-            }
-            else {
-                ++str;
-            }
-        }
+    if (!std::strcmp(linker, "bfd") || !std::strcmp(linker, "ld"))
+        return LINKER_BFD;
 
-        buf << *str++;
-    }
+    if (!std::strcmp(linker, "auto"))
+        return LINKER_AUTO;
 
-    ERROR("fmtstring() error");
+    return -1;
 }
 
-template<typename T = const char*, typename... Args>
-static void verbosemsg(const char *str, T value, Args... args)
+/*
+ * Returns TOOLS_* for gnu, llvm or llvm-thin, or -1
+ */
+static int parsetools(const char *tools)
 {
-    std::ostringstream buf;
-    std::string msg = fmtstring(buf, str, value, std::forward<Args>(args)...);
-    std::cerr << PACKAGE_NAME << ": verbose: " << msg << std::endl;
+    if (!std::strcmp(tools, "gnu")) return TOOLS_GNU;
+    if (!std::strcmp(tools, "llvm")) return TOOLS_LLVM;
+    if (!std::strcmp(tools, "llvm-thin")) return TOOLS_LLVM_THIN;
+    return -1;
 }
 
-template<typename T = const char*, typename... Args>
-static void warn(const char *str, T value, Args... args)
+/*
+ * Points the ENVVARS tools to the LLVM binutils next to clang,
+ * tools without an LLVM counterpart keep the mingw ones
+ */
+static void setllvmtools(string_vector &env, const commandargs &cmdargs,
+                         const std::string &bindir, int version, const char *invocation)
 {
-    std::ostringstream buf;
-    std::string warnmsg = fmtstring(buf, str, value, std::forward<Args>(args)...);
-    if (isterminal())
+    static constexpr const char* LLVMTOOLS[][2] = {
+        { "AR", "llvm-ar" }, { "RANLIB", "llvm-ranlib" }, { "NM", "llvm-nm" },
+        { "STRIP", "llvm-strip" }, { "OBJCOPY", "llvm-objcopy" },
+        { "OBJDUMP", "llvm-objdump" }, { "READELF", "llvm-readelf" },
+        { "SIZE", "llvm-size" }, { "STRINGS", "llvm-strings" },
+        { "DLLTOOL", "llvm-dlltool" }, { "LD", "ld.lld" }, { "WINDRES", "llvm-rc" }
+    };
+
+    const std::string &target = cmdargs.target;
+    const char *dllmachine = "i386";
+    const char *ldemulation = "i386pe";
+
+    if (!target.compare(0, STRLEN("x86_64"), "x86_64"))
     {
-        std::cerr << KBLD PACKAGE_NAME ": warning: " KNRM << warnmsg << std::endl;
-        return;
+        dllmachine = "i386:x86-64";
+        ldemulation = "i386pep";
+    }
+    else if (!target.compare(0, STRLEN("aarch64"), "aarch64"))
+    {
+        dllmachine = "arm64";
+        ldemulation = "arm64pe";
+    }
+    else if (!target.compare(0, STRLEN("arm"), "arm"))
+    {
+        dllmachine = "arm";
+        ldemulation = "thumb2pe";
     }
-    std::cerr << "warning: " << warnmsg << std::endl;
-}
 
-static void warn(const char *str)
-{
-    warn("%", str);
+    for (const auto &tool : LLVMTOOLS)
+    {
+        std::string path;
+        std::string var = std::string(tool[0]) + "=";
+
+        auto it = std::find_if(env.begin(), env.end(), [&](const std::string &val)
+        {
+            return !val.compare(0, var.size(), var);
+        });
+
+        if (it == env.end() || !findllvmtool(bindir, version, tool[1], path))
+        {
+            if (cmdargs.verbose)
+                verbosemsg("% not found, % stays at the mingw tool", tool[1], tool[0]);
+
+            continue;
+        }
+
+        std::string &val = *it;
+
+        val = var + path;
+
+        if (!std::strcmp(tool[0], "AR") && cmdargs.tools == TOOLS_LLVM_THIN)
+        {
+            /* members are referenced by path, llvm-ar>=15 */
+            if (version && version < 15)
+                warn("thin archives require llvm-ar>=15");
+            else
+                val += " --thin";
+        }
+        else if (!std::strcmp(tool[0], "DLLTOOL"))
+        {
+            val += " -m ";
+            val += dllmachine;
+        }
+        else if (!std::strcmp(tool[0], "LD"))
+        {
+            val += " -m ";
+            val += ldemulation;
+        }
+        else if (!std::strcmp(tool[0], "WINDRES"))
+        {
+            /* the llvm-rc based front end */
+            val = var + invocation + " -wc-windres";
+        }
+    }
 }
 
-static time_vector times;
-static time_point start = getticks();
+static thread_local time_vector times;
+static thread_local time_point start = getticks();
 
-static void timepoint(const char *description)
+void timepoint(const char *description)
 {
     time_point now = getticks();
     times.push_back(time_tuple(description, now));
 }
 
-static void printtimes()
+void printtimes()
 {
     for (const auto &tp : times)
     {
@@ -966,8 +1304,12 @@ static void printtimes()
     }
 }
 
-static void parseargs(int argc, char **argv, const char *target,
-                      commandargs &cmdargs, const string_vector &env)
+/*
+ * Returns false if the invocation is complete (e.g. -wc-target),
+ * 'status' is the exit status then
+ */
+static bool parseargs(int argc, char **argv, const char *target,
+                      commandargs &cmdargs, const string_vector &env, int &status)
 {
     typedef void (*dcfun)(commandargs &cmdargs, char *arg);
     typedef std::tuple<dcfun, char*> dc_tuple;
@@ -975,7 +1317,7 @@ static void parseargs(int argc, char **argv, const char *target,
 
     auto printheader = []()
     {
-        std::cout << PACKAGE_NAME << ", Version: " << PACKAGE_VERSION << std::endl;
+        outstream() << PACKAGE_NAME << ", Version: " << PACKAGE_VERSION << std::endl;
     };
 
     for (int i = 0; i < argc; ++i)
@@ -1011,6 +1353,14 @@ static void parseargs(int argc, char **argv, const char *target,
                         continue;
                     }
                 }
+
+                if (!std::strncmp(arg, "-fuse-ld=", STRLEN("-fuse-ld=")))
+                {
+                    /* respect the linker chosen by the user */
+                    int linker = parselinker(arg + STRLEN("-fuse-ld="));
+                    cmdargs.linker = linker == LINKER_LLD ? LINKER_LLD : LINKER_BFD;
+                    continue;
+                }
                 break;
             }
             case 'm':
@@ -1064,7 +1414,11 @@ static void parseargs(int argc, char **argv, const char *target,
                         p = argv[++i];
 
                         if (i >= argc)
-                            ERROR("missing argument for '-x'");
+                        {
+                            errstream() << "missing argument for '-x'" << std::endl;
+                            status = EXIT_FAILURE;
+                            return false;
+                        }
                     }
 
                     auto checkcxx = [&]()
@@ -1072,7 +1426,9 @@ static void parseargs(int argc, char **argv, const char *target,
                         if (!cmdargs.iscxx)
                         {
                             cmdargs.iscxx = true;
-                            findcxxheaders(target, cmdargs);
+
+                            if (cmdargs.cxxpaths.empty())
+                                findcxxheaders(target, cmdargs);
                         }
                     };
 
@@ -1080,7 +1436,12 @@ static void parseargs(int argc, char **argv, const char *target,
                     else if (!std::strcmp(p, "c-header")) cmdargs.iscxx = false;
                     else if (!std::strcmp(p, "c++")) checkcxx();
                     else if (!std::strcmp(p, "c++-header")) checkcxx();
-                    else ERROR("given language not supported");
+                    else
+                    {
+                        errstream() << "given language not supported: " << p << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
                     continue;
                 }
                 break;
@@ -1132,23 +1493,68 @@ static void parseargs(int argc, char **argv, const char *target,
 
                     if (!end)
                     {
-                        std::cerr << "internal error (could not determine arch)"
-                                  << std::endl;
-                        std::exit(EXIT_FAILURE);
+                        errstream() << "internal error (could not determine arch)"
+                                    << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
                     }
 
                     std::string arch(target, end-target);
-                    std::cout << arch << std::endl;
-                    std::exit(EXIT_SUCCESS);
+                    outstream() << arch << std::endl;
+                    status = EXIT_SUCCESS;
+                    return false;
                 }
                 else if (!std::strcmp(arg, "append-exe")) {
                     cmdargs.appendexe = true;
+                }
+                else if (!std::strcmp(arg, "auto-pch")) {
+                    cmdargs.autopch = true;
+                } INVALID_ARGUMENT;
+                break;
+            }
+            case 'c':
+            {
+                if (!std::strcmp(arg, "cache-stats"))
+                {
+                    printcachestats();
+                    printobjectcachestats();
+                    status = EXIT_SUCCESS;
+                    return false;
+                }
+                else if (!std::strcmp(arg, "cache-clear"))
+                {
+                    size_t n = clearobjectcache() + clearprobecache() + clearautopch() + clearltocache() +
+                               clearheadermaps() + clearvfsoverlays() + clearmemoryhistory() +
+                               clearcache();
+                    outstream() << "removed " << n << " cache entries" << std::endl;
+                    status = EXIT_SUCCESS;
+                    return false;
+                }
+                else if (!std::strcmp(arg, "case-insensitive"))
+                {
+                    cmdargs.caseinsensitive = true;
+                    continue;
                 } INVALID_ARGUMENT;
                 break;
             }
             case 'e':
             {
-                if (!std::strncmp(arg, "env-", STRLEN("env-")) ||
+                if (!std::strncmp(arg, "export-toolchain=", STRLEN("export-toolchain=")))
+                {
+                    const char *format = arg + STRLEN("export-toolchain=");
+
+                    if (!istoolchainformat(format))
+                    {
+                        errstream() << "invalid toolchain format: " << format
+                                    << " (cmake, meson or json)" << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
+
+                    cmdargs.exportformat = format;
+                    continue;
+                }
+                else if (!std::strncmp(arg, "env-", STRLEN("env-")) ||
                     !std::strncmp(arg, "e-", STRLEN("e-")))
                 {
                     bool found = false;
@@ -1166,7 +1572,7 @@ static void parseargs(int argc, char **argv, const char *target,
                             const char *val = env[i].c_str();
                             val += std::strlen(var) + 1; /* skip variable name */
 
-                            std::cout << val << std::endl;
+                            outstream() << val << std::endl;
                             found = true;
 
                             break;
@@ -1179,23 +1585,27 @@ static void parseargs(int argc, char **argv, const char *target,
 
                     if (!found)
                     {
-                        std::cerr << "environment variable " << arg << " not found"
-                                  << std::endl
-                                  << "available environment variables: "
-                                  << std::endl;
+                        errstream() << "environment variable " << arg << " not found"
+                                    << std::endl
+                                    << "available environment variables: "
+                                    << std::endl;
 
                         for (const char *var : ENVVARS)
-                            std::cerr << " " << var << std::endl;
+                            errstream() << " " << var << std::endl;
+
+                        status = EXIT_FAILURE;
 
-                        std::exit(EXIT_FAILURE);
+                        return false;
                     }
-                    std::exit(EXIT_SUCCESS);
+                    status = EXIT_SUCCESS;
+                    return false;
                 }
                 else if (!std::strcmp(arg, "env") || !std::strcmp(arg, "e"))
                 {
-                    for (const auto &v : env) std::cout << v << " ";
-                    std::cout << std::endl;
-                    std::exit(EXIT_SUCCESS);
+                    for (const auto &v : env) outstream() << v << " ";
+                    outstream() << std::endl;
+                    status = EXIT_SUCCESS;
+                    return false;
                 } INVALID_ARGUMENT;
                 break;
             }
@@ -1207,7 +1617,7 @@ static void parseargs(int argc, char **argv, const char *target,
 
                     auto printcmdhelp = [&](const char *cmd, const std::string &text)
                     {
-                        std::cout << " " << COMMANDPREFIX << cmd << ": " << text << std::endl;
+                        outstream() << " " << COMMANDPREFIX << cmd << ": " << text << std::endl;
                     };
 
                     printcmdhelp("version", "show version");
@@ -1218,13 +1628,82 @@ static void parseargs(int argc, char **argv, const char *target,
 
                     printcmdhelp("env", "show all environment variables at once");
                     printcmdhelp("arch", "show target architecture");
+                    printcmdhelp("targets=<i686,x86_64>", "build for several targets, -o obj/%a/file.o");
+                    printcmdhelp("tools=<gnu|llvm|llvm-thin>", "map AR, NM, STRIP, ... to the mingw or LLVM tools");
                     printcmdhelp("static-runtime", "link runtime statically");
                     printcmdhelp("append-exe", "append .exe automatically to output filenames");
                     printcmdhelp("use-mingw-linker", "link with mingw");
+                    printcmdhelp("linker=<lld|bfd|auto>", "link with lld, the mingw linker (default) or lld if found");
+                    printcmdhelp("lto=<thin|full|off>", "link time optimization, with a ThinLTO cache");
                     printcmdhelp("no-intrin", "do not use clang intrinsics");
                     printcmdhelp("verbose", "enable verbose messages");
+                    printcmdhelp("auto-pch", "precompile leading system header includes");
+                    printcmdhelp("header-map", "look up system headers through a header map");
+                    printcmdhelp("case-insensitive", "resolve mingw and C++ headers case-insensitively");
+                    printcmdhelp("jobs[=N]", "compile multiple source files in parallel");
+                    printcmdhelp("object-cache", "cache object files of compile steps");
+                    printcmdhelp("probe-cache", "cache configure and try_compile probes");
+                    printcmdhelp("cache-stats", "show cache statistics");
+                    printcmdhelp("cache-clear", "clear the discovery and object cache");
+                    printcmdhelp("export-toolchain=<fmt>", "write a cmake, meson or json toolchain for clang");
+                    printcmdhelp("scan-deps=<db.json>", "scan the dependencies of a compilation database");
+                    printcmdhelp("scan-deps-format=<fmt>", "make or p1689 dependencies (default: make)");
+                    printcmdhelp("windres", "windres compatible resource compiler (llvm-rc)");
+
+                    status = EXIT_SUCCESS;
+
+                    return false;
+                }
+                else if (!std::strcmp(arg, "header-map"))
+                {
+                    cmdargs.headermap = true;
+                    continue;
+                } INVALID_ARGUMENT;
+                break;
+            }
+            case 'j':
+            {
+                if (!std::strcmp(arg, "jobs") || !std::strncmp(arg, "jobs=", STRLEN("jobs=")))
+                {
+                    const char *p = std::strchr(arg, '=');
+
+                    if ((cmdargs.jobs = getjobcount(p ? p+1 : nullptr)) == -1)
+                    {
+                        errstream() << "invalid job count: " << p+1 << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
+                    continue;
+                } INVALID_ARGUMENT;
+                break;
+            }
+            case 'l':
+            {
+                if (!std::strncmp(arg, "linker=", STRLEN("linker=")))
+                {
+                    const char *linker = arg + STRLEN("linker=");
+
+                    if ((cmdargs.linker = parselinker(linker)) == -1)
+                    {
+                        errstream() << "invalid linker: " << linker
+                                    << " (lld, bfd or auto)" << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
+                    continue;
+                }
+                else if (!std::strncmp(arg, "lto=", STRLEN("lto=")))
+                {
+                    const char *mode = arg + STRLEN("lto=");
 
-                    std::exit(EXIT_SUCCESS);
+                    if ((cmdargs.lto = parseltomode(mode)) == -1)
+                    {
+                        errstream() << "invalid LTO mode: " << mode
+                                    << " (thin, full or off)" << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
+                    continue;
                 } INVALID_ARGUMENT;
                 break;
             }
@@ -1237,6 +1716,24 @@ static void parseargs(int argc, char **argv, const char *target,
                 } INVALID_ARGUMENT;
                 break;
             }
+            case 'o':
+            {
+                if (!std::strcmp(arg, "object-cache"))
+                {
+                    cmdargs.objectcache = true;
+                    continue;
+                } INVALID_ARGUMENT;
+                break;
+            }
+            case 'p':
+            {
+                if (!std::strcmp(arg, "probe-cache"))
+                {
+                    cmdargs.probecache = true;
+                    continue;
+                } INVALID_ARGUMENT;
+                break;
+            }
             case 's':
             {
                 if (!std::strcmp(arg, "static-runtime"))
@@ -1271,6 +1768,26 @@ static void parseargs(int argc, char **argv, const char *target,
                     };
 
                     delayedcommands.push_back(dc_tuple(staticruntime, arg-STRLEN(COMMANDPREFIX)));
+                }
+                else if (!std::strncmp(arg, "scan-deps=", STRLEN("scan-deps=")))
+                {
+                    cmdargs.scandeps = arg + STRLEN("scan-deps=");
+                    continue;
+                }
+                else if (!std::strncmp(arg, "scan-deps-format=", STRLEN("scan-deps-format=")))
+                {
+                    const char *format = arg + STRLEN("scan-deps-format=");
+
+                    if (!isscandepsformat(format))
+                    {
+                        errstream() << "invalid dependency format: " << format
+                                    << " (make or p1689)" << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
+
+                    cmdargs.scandepsformat = format;
+                    continue;
                 } INVALID_ARGUMENT;
                 break;
             }
@@ -1278,8 +1795,21 @@ static void parseargs(int argc, char **argv, const char *target,
             {
                 if (!std::strcmp(arg, "target") || !std::strcmp(arg, "t"))
                 {
-                    std::cout << target << std::endl;
-                    std::exit(EXIT_SUCCESS);
+                    outstream() << target << std::endl;
+                    status = EXIT_SUCCESS;
+                    return false;
+                }
+                else if (!std::strncmp(arg, "tools=", STRLEN("tools=")))
+                {
+                    /* applied before the environment is set up */
+                    if (parsetools(arg + STRLEN("tools=")) == -1)
+                    {
+                        errstream() << "invalid tool profile: " << arg + STRLEN("tools=")
+                                    << " (gnu, llvm or llvm-thin)" << std::endl;
+                        status = EXIT_FAILURE;
+                        return false;
+                    }
+                    continue;
                 } INVALID_ARGUMENT;
                 break;
             }
@@ -1309,10 +1839,11 @@ static void parseargs(int argc, char **argv, const char *target,
                 if (!std::strcmp(arg, "version") || !std::strcmp(arg, "v"))
                 {
                     printheader();
-                    std::cout << "Copyright (C) 2013-2017 Thomas Poechtrager" << std::endl;
-                    std::cout << "License: GPL v2" << std::endl;
-                    std::cout << "Bugs / Wishes: " << PACKAGE_BUGREPORT << std::endl;
-                    std::exit(EXIT_SUCCESS);
+                    outstream() << "Copyright (C) 2013-2017 Thomas Poechtrager" << std::endl;
+                    outstream() << "License: GPL v2" << std::endl;
+                    outstream() << "Bugs / Wishes: " << PACKAGE_BUGREPORT << std::endl;
+                    status = EXIT_SUCCESS;
+                    return false;
                 }
                 else if (!std::strcmp(arg, "verbose")) {
                     cmdargs.verbose = true;
@@ -1323,8 +1854,9 @@ static void parseargs(int argc, char **argv, const char *target,
             {
                 invalid_argument:;
                 printheader();
-                std::cerr << "invalid argument: " << COMMANDPREFIX << arg << std::endl;
-                std::exit(EXIT_FAILURE);
+                errstream() << "invalid argument: " << COMMANDPREFIX << arg << std::endl;
+                status = EXIT_FAILURE;
+                return false;
             }
         }
 
@@ -1342,40 +1874,93 @@ static void parseargs(int argc, char **argv, const char *target,
         cmdargs.islinkstep = true;
     }
 
+    if (cmdargs.exportformat)
+    {
+        /*
+         * The toolchain always links with clang
+         */
+        cmdargs.usemingwlinker = 0;
+    }
+
+    if (cmdargs.scandeps)
+    {
+        /* the database entries are compile steps */
+        cmdargs.islinkstep = false;
+    }
+
     for (auto dc : delayedcommands)
     {
         auto fun = std::get<0>(dc);
         fun(cmdargs, std::get<1>(dc));
     }
+
+    return true;
 }
 
-int main(int argc, char **argv)
+int computecommand(int argc, char **argv, commandstate &state)
 {
-    std::string target;
+    std::string &target = state.target;
     int targettype = -1;
     const char *e = std::strrchr(argv[0], '/');
     const char *p = nullptr;
+    int status;
+
+    bool &iscxx = state.iscxx;
+    string_vector &intrinpaths = state.intrinpaths;
+    string_vector &stdpaths = state.stdpaths;
+    string_vector &cxxpaths = state.cxxpaths;
+    string_vector &linkerflags = state.linkerflags;
+    std::string &compiler = state.compiler;
+    std::string &compilerbinpath = state.compilerbinpath;
+    std::string gccpath;
+    string_vector &env = state.env;
+    string_vector &args = state.args;
+    string_vector &cflags = state.cflags;
+    string_vector &cxxflags = state.cxxflags;
+    commandargs &cmdargs = state.cmdargs;
+    responsefileargs rspargs;
+
+    /*
+     * Options may be hidden in response files (@file)
+     */
+
+    expandresponsefiles(argc, argv, rspargs);
+
+    bool usecache = usediscoverycache();
+    bool cachehit = false;
+    bool cachedirty = false;
+    std::string cachekey;
+    discoveryentry cacheentry;
+
+    cmdargs.objectcache = useobjectcache();
+    cmdargs.probecache = useprobecache();
+    cmdargs.autopch = useautopch();
+    cmdargs.headermap = useheadermap();
+    cmdargs.caseinsensitive = usecaseinsensitive();
+
+    if ((p = getenvvar("WCLANG_LINKER")) && *p &&
+        (cmdargs.linker = parselinker(p)) == -1)
+    {
+        warn("ignoring invalid WCLANG_LINKER value: %", p);
+        cmdargs.linker = LINKER_DEFAULT;
+    }
+
+    if ((p = getenvvar("WCLANG_TOOLS")) && *p &&
+        (cmdargs.tools = parsetools(p)) == -1)
+    {
+        warn("ignoring invalid WCLANG_TOOLS value: %", p);
+        cmdargs.tools = TOOLS_GNU;
+    }
 
-    bool iscxx = false;
-    string_vector intrinpaths;
-    string_vector stdpaths;
-    string_vector cxxpaths;
-    string_vector linkerflags;
-    std::string compiler;
-    std::string compilerpath;
-    std::string compilerbinpath;
-    string_vector env;
-    string_vector args;
-    char **cargs = nullptr;
-    int cargsi = 0;
-    string_vector cflags;
-    string_vector cxxflags;
-
-    commandargs cmdargs(intrinpaths, stdpaths, cxxpaths, cflags,
-                        cxxflags, linkerflags, target,
-                        compiler, compilerpath, compilerbinpath, env,
-                        args, iscxx);
+    if ((p = getenvvar("WCLANG_LTO")) && *p &&
+        (cmdargs.lto = parseltomode(p)) == -1)
+    {
+        warn("ignoring invalid WCLANG_LTO value: %", p);
+        cmdargs.lto = LTO_OFF;
+    }
 
+    times.clear();
+    start = getticks();
     timepoint("start");
 
     if (!e) e = argv[0];
@@ -1384,8 +1969,8 @@ int main(int argc, char **argv)
     p = std::strrchr(e, '-');
     if (!p++ || std::strncmp(p, "clang", STRLEN("clang")))
     {
-        std::cerr << "invalid invocation name: clang should be followed "
-                     "after target (e.g.: w32-clang)" << std::endl;
+        errstream() << "invalid invocation name: clang should be followed "
+                       "after target (e.g.: w32-clang)" << std::endl;
         return 1;
     }
 
@@ -1396,17 +1981,44 @@ int main(int argc, char **argv)
     p += STRLEN("clang");
     if (!std::strcmp(p, "++")) iscxx = true;
     else if (*p) {
-        std::cerr << "invalid invocation name: ++ (or nothing) should be "
-                     "followed after clang (e.g.: w32-clang++)" << std::endl;
+        errstream() << "invalid invocation name: ++ (or nothing) should be "
+                       "followed after clang (e.g.: w32-clang++)" << std::endl;
         return 1;
     }
 
+    /*
+     * Try to restore the target, the header paths and the tool
+     * paths from the discovery cache, before probing the file system
+     */
+
+    if (usecache)
+    {
+        tracebegin("discovery cache");
+        cachekey = discoverykey(e);
+        cachehit = loaddiscovery(cachekey, cacheentry);
+        traceend();
+
+        if (cachehit)
+        {
+            target = cacheentry.target;
+            targettype = cacheentry.targettype;
+            stdpaths = cacheentry.stdpaths;
+            cxxpaths = cacheentry.cxxpaths;
+            cmdargs.mingwversion = parsecompilerversion(cacheentry.mingwversion.c_str());
+            goto setup_compiler_command;
+        }
+
+        startrecording();
+    }
+
     /*
      * Check if we should target win32 or win64...
      */
 
     find_target_and_headers:;
 
+    tracebegin("target detection");
+
     if (const char *triple = findtriple(e, targettype))
     {
         target = triple;
@@ -1428,9 +2040,11 @@ int main(int argc, char **argv)
         }
     }
 
+    traceend();
+
     if (targettype == -1)
     {
-        std::cerr << "invalid target: " << e << std::endl;
+        errstream() << "invalid target: " << e << std::endl;
         return 1;
     }
     else if (target.empty())
@@ -1438,16 +2052,16 @@ int main(int argc, char **argv)
         const char *type;
         std::string desc;
 
-        if (getenv("MINGW_PATH"))
+        if (getenvvar("MINGW_PATH"))
         {
             warn("MINGW_PATH env variable does not point to any "
                  "valid mingw installation for the current target!");
 
-#ifdef HAVE_UNSETENV
-            unsetenv("MINGW_PATH");
-#else
-            std::exit(EXIT_FAILURE);
-#endif
+            /* the cache key no longer matches the environment */
+            usecache = false;
+
+            if (!unsetenvvar("MINGW_PATH"))
+                return 1;
 
             goto find_target_and_headers;
         }
@@ -1461,12 +2075,12 @@ int main(int argc, char **argv)
 
         desc = std::string("mingw-w64 (") + std::string(type) + std::string(")");
 
-        std::cerr << "cannot find " << desc << " installation" << std::endl;
-        std::cerr << "make sure " << desc << " is installed on your system"
-                  << std::endl;
+        errstream() << "cannot find " << desc << " installation" << std::endl;
+        errstream() << "make sure " << desc << " is installed on your system"
+                    << std::endl;
 
-        std::cerr << "if you have moved your mingw installation, "
-                     "then re-run the installation process" << std::endl;
+        errstream() << "if you have moved your mingw installation, "
+                       "then re-run the installation process" << std::endl;
         return 1;
     }
 
@@ -1476,22 +2090,22 @@ int main(int argc, char **argv)
 
     if (stdpaths.empty())
     {
-        std::cerr << "cannot find " << target
-                  << " C headers" << std::endl;
+        errstream() << "cannot find " << target
+                    << " C headers" << std::endl;
 
-        std::cerr << "make sure " << target
-                  << " C headers are installed on your system " << std::endl;
+        errstream() << "make sure " << target
+                    << " C headers are installed on your system " << std::endl;
         return 1;
     }
 
     if (!findcxxheaders(target.c_str(), cmdargs) && iscxx)
     {
-        std::cerr << "cannot find " << target
-                  << " C++ headers" << std::endl;
+        errstream() << "cannot find " << target
+                    << " C++ headers" << std::endl;
 
-        std::cerr << "make sure " << target
-                  << " C++ headers are installed on your system "
-                  << std::endl;
+        errstream() << "make sure " << target
+                    << " C++ headers are installed on your system "
+                    << std::endl;
         return 1;
     }
 
@@ -1499,6 +2113,8 @@ int main(int argc, char **argv)
      * Setup compiler command
      */
 
+    setup_compiler_command:;
+
     if (iscxx)
     {
         compiler = "clang++";
@@ -1533,12 +2149,101 @@ int main(int argc, char **argv)
         delete[] buf;
     }
 
+    /*
+     * -wc-tools= must be known before -wc-env is answered
+     */
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+
+        if (!std::strncmp(arg, "--", STRLEN("--")))
+            ++arg;
+
+        if (!std::strncmp(arg, "-wc-tools=", STRLEN("-wc-tools=")))
+        {
+            int tools = parsetools(arg + STRLEN("-wc-tools="));
+
+            if (tools != -1)
+                cmdargs.tools = tools;
+        }
+    }
+
+    if (cmdargs.tools != TOOLS_GNU)
+    {
+        std::string bindir;
+        int version = 0;
+
+        if (cachehit && !cacheentry.compilerbinpath.empty())
+        {
+            bindir = cacheentry.compilerbinpath;
+            version = parsecompilerversion(cacheentry.clangversion.c_str()).major;
+        }
+        else
+        {
+            getpathofcommand(compiler.c_str(), bindir);
+        }
+
+        setllvmtools(env, cmdargs, bindir, version, argv[0]);
+    }
+
     /*
      * Parse command arguments late,
      * when we know our environment already
      */
 
-    parseargs(argc, argv, target.c_str(), cmdargs, env); /* may not return */
+    tracebegin("parseargs");
+    bool parsed = parseargs(argc, argv, target.c_str(), cmdargs, env, status);
+    traceend();
+
+    if (!parsed)
+        return status;
+
+    if (cmdargs.lto != LTO_OFF && cmdargs.islinkstep)
+    {
+        /*
+         * The mingw linker cannot read bitcode
+         */
+        if (cmdargs.linker == LINKER_BFD || cmdargs.usemingwlinker == 1)
+        {
+            errstream() << "-wc-lto requires lld, it cannot be combined with "
+                        << "-wc-linker=bfd, -fuse-ld= or -wc-use-mingw-linker" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        cmdargs.linker = LINKER_LLD;
+    }
+
+    /*
+     * Link with lld if requested, or with auto if it is installed next
+     * to clang. This also replaces the mingw linker fallback for
+     * -mwindows and friends, which clang's mingw driver passes on to lld.
+     * The default stays with the mingw linker.
+     */
+
+    if (cmdargs.islinkstep && (cmdargs.linker == LINKER_LLD || cmdargs.linker == LINKER_AUTO) &&
+        cmdargs.usemingwlinker != 1)
+    {
+        if (cachehit && !cacheentry.compilerbinpath.empty())
+            compilerbinpath = cacheentry.compilerbinpath;
+        else
+            getpathofcommand(compiler.c_str(), compilerbinpath);
+
+        if (cmdargs.linker == LINKER_LLD ||
+            (!compilerbinpath.empty() && fileexists((compilerbinpath + "/ld.lld").c_str())))
+        {
+            cmdargs.uselld = true;
+            cmdargs.usemingwlinker = 0;
+            linkerflags.push_back("-fuse-ld=lld");
+
+            if (cmdargs.verbose)
+                verbosemsg("linking with %", compilerbinpath + "/ld.lld");
+        }
+        else
+        {
+            compilerbinpath.clear();
+        }
+    }
 
     /*
      * Setup compiler Arguments
@@ -1566,8 +2271,8 @@ int main(int argc, char **argv)
          * defining __CRT__NO_INLINE, because there is
          * something wrong with their inline definition.
          */
-        char *p;
-        if (!(p = getenv("WCLANG_NO_CRT_INLINE_WORKAROUND")) || *p == '0')
+        const char *p;
+        if (!(p = getenvvar("WCLANG_NO_CRT_INLINE_WORKAROUND")) || *p == '0')
         {
             // warn("defining __CRT__NO_INLINE to work around bugs in"
             //      "the mingw math.h header");
@@ -1579,10 +2284,15 @@ int main(int argc, char **argv)
     {
         std::string tmp;
 
-        if (!getpathofcommand(compiler.c_str(), compilerbinpath))
+        if (cachehit && !(cmdargs.islinkstep && cmdargs.usemingwlinker) &&
+            !cacheentry.compilerbinpath.empty())
+        {
+            compilerbinpath = cacheentry.compilerbinpath;
+        }
+        else if (compilerbinpath.empty() && !getpathofcommand(compiler.c_str(), compilerbinpath))
         {
-            std::cerr << "cannot find '" << compiler << "' executable"
-                      << std::endl;
+            errstream() << "cannot find '" << compiler << "' executable"
+                        << std::endl;
             return 1;
         }
 
@@ -1593,6 +2303,9 @@ int main(int argc, char **argv)
         compiler += tmp;
     }
 
+    size_t injectedbegin = 0;
+    size_t injectedend;
+
     {
         /*
          * Find MinGW binaries (required for linking)
@@ -1600,7 +2313,7 @@ int main(int argc, char **argv)
         std::string gcc = target + (iscxx ? "-g++" : "-gcc");
         std::string path;
 
-        const char *mingwpath = getenv("MINGW_PATH");
+        const char *mingwpath = getenvvar("MINGW_PATH");
 
         if (!mingwpath)
         {
@@ -1612,12 +2325,18 @@ int main(int argc, char **argv)
         if (mingwpath && *mingwpath)
             concatenvvariable("PATH", mingwpath);
 
-        if (!getpathofcommand(gcc.c_str(), path))
+        if (cachehit && !cacheentry.gccpath.empty())
+        {
+            path = cacheentry.gccpath;
+        }
+        else if (!getpathofcommand(gcc.c_str(), path))
         {
-            std::cerr << "cannot find " << gcc << " executable" << std::endl;
+            errstream() << "cannot find " << gcc << " executable" << std::endl;
             return 1;
         }
 
+        gccpath = path;
+
 #if 0
         /*
          * COMPILER_PATH would be a perfect solution to get rid of the
@@ -1632,13 +2351,29 @@ int main(int argc, char **argv)
         {
             /* https://github.com/tpoechtrager/wclang/issues/22 */
 
-            std::string command = cmdargs.target + "-gcc -print-libgcc-file-name";
-            char output[4096];
-
-            if (runcommand(command.c_str(), output, sizeof(output)) == 0)
+            if (cachehit && cacheentry.haslibgcc)
+            {
+                if (!cacheentry.libgccdir.empty())
+                    linkerflags.push_back(std::string("-L") + cacheentry.libgccdir);
+            }
+            else
             {
-                stripfilename(output);
-                linkerflags.push_back(std::string("-L") + output);
+                std::string gcc = gccpath + "/" + cmdargs.target + "-gcc";
+                char *command[] = { &gcc[0], const_cast<char*>("-print-libgcc-file-name"), nullptr };
+                std::string output;
+                tracescope trace("libgcc query");
+
+                /* no shell and no $PATH lookup, $PATH may be our own */
+                if (runprocess(command, &output, nullptr, QUERYTIMEOUT) == 0 && !output.empty())
+                {
+                    stripfilename(&output[0]);
+                    output.resize(std::strlen(output.c_str()));
+                    linkerflags.push_back(std::string("-L") + output);
+                    cacheentry.libgccdir = output;
+                }
+
+                cacheentry.haslibgcc = true;
+                cachedirty = cachehit;
             }
         }
 
@@ -1653,10 +2388,11 @@ int main(int argc, char **argv)
 
         pushcompilerflags(iscxx ? cxxflags : cflags);
         pushcompilerflags(linkerflags);
+        injectedbegin = args.size();
 
         if (!cmdargs.islinkstep || !cmdargs.usemingwlinker)
         {
-            char *p;
+            const char *p;
 
             args.push_back(CLANG_TARGET_OPT);
             args.push_back(target);
@@ -1678,7 +2414,13 @@ int main(int argc, char **argv)
                 }
             };
 
-            if (!findintrinheaders(cmdargs, compilerbinpath))
+            if (cachehit)
+            {
+                intrinpaths = cacheentry.intrinpaths;
+                cmdargs.clangversion = parsecompilerversion(cacheentry.clangversion.c_str());
+            }
+
+            if (cachehit ? intrinpaths.empty() : !findintrinheaders(cmdargs, compilerbinpath))
             {
                 if (!cmdargs.nointrinsics)
                     warn("cannot find clang intrinsics directory");
@@ -1695,19 +2437,29 @@ int main(int argc, char **argv)
             if (cmdargs.verbose)
                 verbosemsg("detected clang version: %", cmdargs.clangversion.str());
 
+            /*
+             * lld takes a thread count since version 11, -wc-jobs=N
+             * takes precedence over the make jobserver
+             */
+            if (cmdargs.uselld && cmdargs.jobs > 1 &&
+                cmdargs.clangversion >= compilerver(11, 0, 0))
+            {
+                args.push_back("-Wl,--threads=" + std::to_string(cmdargs.jobs));
+            }
+
             if (cmdargs.exceptions != 0 && (cmdargs.clangversion < compilerver(3, 7, 0) ||
                 (targettype == TARGET_WIN32 && cmdargs.clangversion < compilerver(6, 0, 0))))
             {
-                char *p;
-                if (!(p = getenv("WCLANG_FORCE_CXX_EXCEPTIONS")) || *p == '0')
+                const char *p;
+                if (!(p = getenvvar("WCLANG_FORCE_CXX_EXCEPTIONS")) || *p == '0')
                 {
                     if (cmdargs.exceptions == 1)
                     {
                         warn("-fexceptions will be replaced with -fno-exceptions: "
                              "exceptions are not supported (yet)");
 
-                        std::cerr << "set WCLANG_FORCE_CXX_EXCEPTIONS to 1 "
-                                  << "(env. variable) to force C++ exceptions" << std::endl;
+                        errstream() << "set WCLANG_FORCE_CXX_EXCEPTIONS to 1 "
+                                    << "(env. variable) to force C++ exceptions" << std::endl;
                     }
 
                     args.push_back("-fno-exceptions");
@@ -1722,9 +2474,47 @@ int main(int argc, char **argv)
               args.push_back("-fsjlj-exceptions");
             }
 
-            if ((p = getenv("WCLANG_NO_INTEGRATED_AS")) && *p == '1')
+            if ((p = getenvvar("WCLANG_NO_INTEGRATED_AS")) && *p == '1')
                 args.push_back("-no-integrated-as");
 
+            if (cmdargs.lto != LTO_OFF)
+                addltoflags(cmdargs, args);
+
+            /*
+             * The header map goes first, it only holds headers
+             * found in exactly one of the directories
+             */
+            if (cmdargs.headermap)
+            {
+                string_vector dirs;
+                std::string hmap;
+
+                dirs.insert(dirs.end(), intrinpaths.begin(), intrinpaths.end());
+                dirs.insert(dirs.end(), cxxpaths.begin(), cxxpaths.end());
+                dirs.insert(dirs.end(), stdpaths.begin(), stdpaths.end());
+
+                if (!(hmap = getheadermap(dirs, cmdargs.verbose)).empty())
+                {
+                    args.push_back("-isystem");
+                    args.push_back(hmap);
+                }
+            }
+
+            if (cmdargs.caseinsensitive)
+            {
+                string_vector dirs;
+                std::string overlay;
+
+                dirs.insert(dirs.end(), cxxpaths.begin(), cxxpaths.end());
+                dirs.insert(dirs.end(), stdpaths.begin(), stdpaths.end());
+
+                if (!(overlay = getvfsoverlay(dirs, cmdargs.verbose)).empty())
+                {
+                    args.push_back("-ivfsoverlay");
+                    args.push_back(overlay);
+                }
+            }
+
             /*
              * For libstdc++ 6, the C++ includes must appear before the standard
              * includes.
@@ -1743,6 +2533,8 @@ int main(int argc, char **argv)
         }
     }
 
+    injectedend = args.size();
+
     for (int i = 1; i < argc; ++i)
     {
         const char *arg = argv[i];
@@ -1770,44 +2562,92 @@ int main(int argc, char **argv)
         args.push_back(argv[i]);
     }
 
-    cargs = new char* [args.size()+2];
-    cargs[args.size()] = nullptr;
+    /*
+     * Store the discovery results, the mingw linker path
+     * does not look for clang and its intrinsics
+     */
 
-    for (const auto &opt : args)
-        cargs[cargsi++] = strdup(opt.c_str());
+    if (usecache && !cachehit && !(cmdargs.islinkstep && cmdargs.usemingwlinker))
+    {
+        stoprecording();
+
+        cacheentry.target = target;
+        cacheentry.targettype = targettype;
+        cacheentry.stdpaths = stdpaths;
+        cacheentry.cxxpaths = cxxpaths;
+        cacheentry.mingwversion = cmdargs.mingwversion.s;
+        cacheentry.intrinpaths = intrinpaths;
+        cacheentry.clangversion = cmdargs.clangversion.s;
+        cacheentry.compilerbinpath = compilerbinpath;
+        cacheentry.gccpath = gccpath;
+
+        if (builddeps(cacheentry.deps))
+            storediscovery(cachekey, cacheentry);
+    }
+    else if (cachedirty)
+    {
+        /*
+         * The libgcc directory was not cached yet,
+         * it only depends on the mingw gcc binary
+         */
 
-    if (cmdargs.appendexe)
-        appendexetooutputname(cargs);
+        cachedep_vector deps;
+        std::string tmp;
 
-    /*
-     * Execute command
-     */
+        startrecording();
+        getpathofcommand((target + (iscxx ? "-g++" : "-gcc")).c_str(), tmp);
+        stoprecording();
+
+        if (builddeps(deps))
+        {
+            cacheentry.deps.insert(cacheentry.deps.end(), deps.begin(), deps.end());
+            storediscovery(cachekey, cacheentry);
+        }
+    }
 
-    if (cmdargs.verbose)
+    if (cmdargs.exportformat)
     {
-        std::string commandin, commandout;
+        toolchaininfo info;
+        string_vector injected(args.begin() + injectedbegin, args.begin() + injectedend);
+        const char *p;
+
+        info.format = cmdargs.exportformat;
+        info.target = target;
+        info.cc = compilerbinpath + PATHDIV + "clang";
+        info.cxx = compilerbinpath + PATHDIV + "clang++";
+
+        if (STRLEN(CFLAGS) > 0)
+            info.cflags.push_back(CFLAGS);
 
-        for (int i = 0; i < argc; ++i)
+        if (STRLEN(CXXFLAGS) > 0)
+            info.cxxflags.push_back(CXXFLAGS);
+
+        info.cflags.insert(info.cflags.end(), injected.begin(), injected.end());
+        info.cxxflags.insert(info.cxxflags.end(), injected.begin(), injected.end());
+
+        if (targettype == TARGET_WIN64 &&
+            (!(p = getenvvar("WCLANG_NO_CRT_INLINE_WORKAROUND")) || *p == '0'))
         {
-            if (i) commandin += " ";
-            commandin += argv[i];
+            info.cxxoptflags.push_back("-D__CRT__NO_INLINE");
         }
 
-        for (char **arg = cargs; *arg; ++arg)
+        info.linkerflags = linkerflags;
+        info.env = env;
+        info.toolpath = gccpath;
+
+        if (!stdpaths.empty())
         {
-            if (arg != cargs) commandout += " ";
-            commandout += *arg;
+            const std::string &dir = stdpaths.front();
+
+            if (dir.size() > STRLEN("/include") &&
+                !dir.compare(dir.size()-STRLEN("/include"), std::string::npos, "/include"))
+            {
+                info.sysroot = dir.substr(0, dir.size()-STRLEN("/include"));
+            }
         }
 
-        timepoint("end");
-        verbosemsg("command in: %", commandin);
-        verbosemsg("command out: %", commandout);
-        printtimes();
+        return exporttoolchain(info);
     }
 
-    execvp(compiler.c_str(), cargs);
-
-    std::cerr << "invoking compiler failed" << std::endl;
-    std::cerr << compiler << " not installed?" << std::endl;
-    return 1;
+    return COMMAND_READY;
 }
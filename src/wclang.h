@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <functional>
 #include "config.h"
 
 static inline void ERRORMSG(const char *msg, const char *file,
@@ -46,11 +47,39 @@ typedef std::vector<std::string> string_vector;
 #define KBLD "\x1B[1m"
 #define PATHDIV '/'
 
+/*
+ * Per-thread environment and output streams
+ *
+ * The library (wclang_compute()) computes commands for a given
+ * environment and captures the messages; without a context the
+ * process environment, std::cout and std::cerr are used.
+ */
+
+struct threadcontext {
+    string_vector *env;
+    std::ostream *out;
+    std::ostream *err;
+};
+
+void setthreadcontext(threadcontext *context);
+const char *getenvvar(const char *name);
+char *const *getenvironment(std::vector<char*> &storage);
+void setenvvar(const char *name, const char *value);
+bool unsetenvvar(const char *name);
+std::ostream &outstream();
+std::ostream &errstream();
+
 void concatenvvariable(const char *var, const std::string val, std::string *nval = nullptr);
 
-typedef bool (*listfilescallback)(const char *dir, const char *file);
+/*
+ * 'dirfd' refers to 'dir' and may be used to
+ * probe 'file' without another path lookup
+ */
+typedef std::function<bool (int dirfd, const char *dir, const char *file)> listfilescallback;
 bool fileexists(const char *file);
 bool isdirectory(const char *file, const char *prefix);
+int opendirectory(const char *dir, int dirfd = -1);
+bool scandirectory(int dirfd, const std::function<void (const char *name)> &callback);
 bool listfiles(const char *dir, std::vector<std::string> *files, listfilescallback cmp = nullptr);
 const char *getfileName(const char *file);
 
@@ -60,10 +89,13 @@ bool wcrealpath(const char *file, std::string &result, realpathcmp cmp1 = nullpt
                 realpathcmp cmp2 = nullptr, const size_t maxSymobolicLinkDepth = 1000);
 bool getpathofcommand(const char *bin, std::string &result);
 
-constexpr int RUNCOMMAND_ERROR = -100000;
-int runcommand(const char *command, char *buf, size_t len);
+bool optionhasvalue(const char *opt);
+void findinputfiles(char **args, std::vector<int> &inputs);
+bool isterminal();
+std::string jsonstring(const std::string &str);
 
 void stripfilename(char *path);
+void appendexetooutputname(char **cargs);
 
 struct compilerversion;
 typedef compilerversion compilerver;
@@ -156,6 +188,19 @@ struct compilerversion {
     char s[12];
 };
 
+enum linker {
+    LINKER_DEFAULT,
+    LINKER_AUTO,
+    LINKER_BFD,
+    LINKER_LLD
+};
+
+enum tools {
+    TOOLS_GNU,
+    TOOLS_LLVM,
+    TOOLS_LLVM_THIN
+};
+
 enum optimize {
     LEVEL_0,
     LEVEL_1,
@@ -186,9 +231,22 @@ struct commandargs {
     bool iscompilestep;
     bool islinkstep;
     bool nointrinsics;
+    bool objectcache;
+    bool probecache;
+    bool autopch;
+    bool headermap;
+    bool caseinsensitive;
+    int jobs;
     int exceptions;
     int optimizationlevel;
     int usemingwlinker;
+    int linker;
+    bool uselld;
+    int lto;
+    int tools;
+    const char *exportformat;
+    const char *scandeps;
+    const char *scandepsformat;
 
     commandargs(string_vector &intrinpaths, string_vector &stdpaths, string_vector &cxxpaths,
                 string_vector &cflags, string_vector &cxxflags,
@@ -201,5 +259,126 @@ struct commandargs {
                 linkerflags(linkerflags), target(target), compiler(compiler), compilerpath(compilerpath),
                 compilerbinpath(compilerbinpath), env(env), args(args), iscxx(iscxx),
                 appendexe(false), iscompilestep(false), islinkstep(false), nointrinsics(false),
-                exceptions(-1), optimizationlevel(0), usemingwlinker(0) {}
+                objectcache(false), probecache(false), autopch(false), headermap(false),
+                caseinsensitive(false), jobs(1), exceptions(-1), optimizationlevel(0), usemingwlinker(0),
+                linker(LINKER_DEFAULT), uselld(false), lto(0), tools(TOOLS_GNU),
+                exportformat(nullptr), scandeps(nullptr), scandepsformat(nullptr) {}
 } __attribute__ ((aligned (8)));
+
+/*
+ * Looks up an LLVM tool (llvm-rc, ...) in 'bindir' (clang's directory),
+ * with the clang major version as suffix (if known) or in $PATH
+ */
+bool findllvmtool(const std::string &bindir, int version, const char *name, std::string &tool);
+
+/*
+ * Messages
+ */
+
+static void fmtstring(std::ostringstream &sbuf, const char *s)
+{
+    while (*s)
+    {
+        if (*s == '%')
+        {
+            if (s[1] == '%') ++s;
+            else ERROR("fmtstring() error");
+        }
+
+        sbuf << *s++;
+    }
+}
+
+template<typename T, typename... Args>
+static std::string fmtstring(std::ostringstream &buf, const char *str,
+                             T value, Args... args)
+{
+    while (*str)
+    {
+        if (*str == '%')
+        {
+            if (str[1] != '%')
+            {
+                buf << value;
+                fmtstring(buf, str + 1, args...);
+                return buf.str();
+            }
+            else {
+                ++str;
+            }
+        }
+
+        buf << *str++;
+    }
+
+    ERROR("fmtstring() error");
+}
+
+template<typename T = const char*, typename... Args>
+static void verbosemsg(const char *str, T value, Args... args)
+{
+    std::ostringstream buf;
+    std::string msg = fmtstring(buf, str, value, std::forward<Args>(args)...);
+    errstream() << PACKAGE_NAME << ": verbose: " << msg << std::endl;
+}
+
+template<typename T = const char*, typename... Args>
+static void warn(const char *str, T value, Args... args)
+{
+    std::ostringstream buf;
+    std::string warnmsg = fmtstring(buf, str, value, std::forward<Args>(args)...);
+    if (isterminal() && &errstream() == &std::cerr)
+    {
+        std::cerr << KBLD PACKAGE_NAME ": warning: " KNRM << warnmsg << std::endl;
+        return;
+    }
+    errstream() << "warning: " << warnmsg << std::endl;
+}
+
+static inline void warn(const char *str)
+{
+    warn("%", str);
+}
+
+void timepoint(const char *description);
+void printtimes();
+
+/*
+ * Command computation
+ *
+ * computecommand() resolves the target, the header and tool paths and
+ * rewrites the arguments of one invocation into 'state'. It returns
+ * COMMAND_READY if state.args holds the compiler command, otherwise the
+ * invocation is complete (queries such as -wc-target, errors) and the
+ * exit status is returned. It does not exit and keeps no state between
+ * calls, except the caches on disk.
+ */
+
+constexpr int COMMAND_READY = -1;
+
+struct commandstate {
+    string_vector intrinpaths;
+    string_vector stdpaths;
+    string_vector cxxpaths;
+    string_vector cflags;
+    string_vector cxxflags;
+    string_vector linkerflags;
+    std::string target;
+    std::string compiler;
+    std::string compilerpath;
+    std::string compilerbinpath;
+    string_vector env;
+    string_vector args;
+    bool iscxx;
+    commandargs cmdargs;
+
+    commandstate()
+        : iscxx(false), cmdargs(intrinpaths, stdpaths, cxxpaths, cflags, cxxflags,
+                                linkerflags, target, compiler, compilerpath,
+                                compilerbinpath, env, args, iscxx) {}
+
+    commandstate(const commandstate&) = delete;
+    commandstate &operator=(const commandstate&) = delete;
+};
+
+int computecommand(int argc, char **argv, commandstate &state);
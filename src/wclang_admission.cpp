@@ -0,0 +1,554 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <climits>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_cache.h"
+#include "wclang_hash.h"
+#include "wclang_process.h"
+#include "wclang_admission.h"
+
+static constexpr char LOCKFILE[] = "/lock";
+static constexpr char MEMORYDIR[] = "/memory";
+
+/* weights (KiB) of commands that have not completed before */
+static constexpr ullong DEFAULTCOMPILEWEIGHT = 512 * 1024;
+static constexpr ullong DEFAULTLINKWEIGHT = 2 * 1024 * 1024;
+
+static constexpr int MINPOLLMS = 20;
+static constexpr int MAXPOLLMS = 500;
+
+struct slotentry {
+    bool waiting;
+    ullong seq;
+    ullong weight;
+    bool link;
+};
+
+/*
+ * Budget in KiB, <size> or <percent>% of the physical memory
+ */
+static ullong getmemorybudget()
+{
+    const char *value = getenvvar("WCLANG_MEMORY_BUDGET");
+
+    if (!value || !*value)
+        return 0;
+
+    if (value[std::strlen(value)-1] == '%')
+    {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long pagesize = sysconf(_SC_PAGESIZE);
+        double percent = std::strtod(value, nullptr);
+
+        if (pages <= 0 || pagesize <= 0 || percent <= 0 || percent > 100)
+            return 0;
+
+        return (ullong)((double)pages * pagesize / 1024 * percent / 100);
+    }
+
+    return parsesize(value, 0) / 1024;
+}
+
+static int getlinkslots()
+{
+    const char *value = getenvvar("WCLANG_LINK_SLOTS");
+    return value && *value ? std::max(std::atoi(value), 0) : 0;
+}
+
+bool useadmission()
+{
+    return getmemorybudget() || getlinkslots();
+}
+
+static bool getadmissiondir(std::string &dir)
+{
+    const char *p;
+
+    if ((p = getenvvar("WCLANG_ADMISSION_DIR")) && *p)
+    {
+        dir = p;
+    }
+    else if ((p = getenvvar("XDG_RUNTIME_DIR")) && *p)
+    {
+        dir = p;
+        dir += "/wclang-admission";
+    }
+    else
+    {
+        dir = "/tmp/wclang-admission-";
+        dir += std::to_string(getuid());
+    }
+
+    return makedirectories(dir);
+}
+
+/*
+ * Peak memory history, one file per output
+ */
+
+static std::string getmemoryfile(const std::string &dir, const std::string &key)
+{
+    return dir + MEMORYDIR + PATHDIV + sha256string(key).substr(0, 32);
+}
+
+static ullong loadweight(const std::string &key)
+{
+    std::string dir;
+    std::string data;
+
+    if (key.empty() || !getcachedir(dir) || !readfile(getmemoryfile(dir, key).c_str(), data))
+        return 0;
+
+    return std::strtoull(data.c_str(), nullptr, 10);
+}
+
+static void storeweight(const std::string &key, ullong weight)
+{
+    std::string dir;
+
+    if (key.empty() || !weight || !getcachedir(dir) || !makedirectories(dir + MEMORYDIR))
+        return;
+
+    writefileatomic(getmemoryfile(dir, key), std::to_string(weight) + "\n");
+}
+
+size_t clearmemoryhistory()
+{
+    std::string dir;
+    string_vector files;
+
+    if (!getcachedir(dir))
+        return 0;
+
+    dir += MEMORYDIR;
+
+    if (!listfiles(dir.c_str(), &files))
+        return 0;
+
+    for (const auto &file : files)
+        unlink((dir + PATHDIV + file).c_str());
+
+    return files.size();
+}
+
+/*
+ * The output (or the first input) identifies the command
+ */
+static std::string getweightkey(char **cargs)
+{
+    const char *file = nullptr;
+    std::vector<int> inputs;
+    char cwd[PATH_MAX];
+
+    for (char **arg = cargs; *arg; ++arg)
+    {
+        if (!std::strcmp(*arg, "-o") && arg[1])
+            file = arg[1];
+    }
+
+    if (!file)
+    {
+        findinputfiles(cargs, inputs);
+
+        if (inputs.empty())
+            return std::string();
+
+        file = cargs[inputs[0]];
+    }
+
+    if (*file == PATHDIV || !getcwd(cwd, sizeof(cwd)))
+        return file;
+
+    return std::string(cwd) + PATHDIV + file;
+}
+
+/*
+ * Slots
+ *
+ * Every admitted or waiting command owns <dir>/<pid>-<n>, which holds
+ * "<R|W> <sequence> <weight> <link>" and is flock()ed as long as the
+ * invocation lives. Entries which can be locked belong to dead
+ * processes and are removed.
+ */
+
+static bool lockfile(int fd, int operation)
+{
+    while (flock(fd, operation) == -1)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+
+    return true;
+}
+
+static bool writeentry(int fd, const slotentry &entry)
+{
+    std::string data;
+
+    data += entry.waiting ? "W " : "R ";
+    data += std::to_string(entry.seq) + " ";
+    data += std::to_string(entry.weight) + " ";
+    data += entry.link ? "1\n" : "0\n";
+
+    return ftruncate(fd, 0) == 0 &&
+           pwrite(fd, data.c_str(), data.size(), 0) == (ssize_t)data.size();
+}
+
+static bool readentry(int fd, slotentry &entry)
+{
+    char buf[128];
+    char state;
+    int link;
+    ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+
+    if (n <= 0)
+        return false;
+
+    buf[n] = '\0';
+
+    if (sscanf(buf, "%c %llu %llu %d", &state, &entry.seq, &entry.weight, &link) != 4)
+        return false;
+
+    entry.waiting = state == 'W';
+    entry.link = link != 0;
+
+    return true;
+}
+
+static void readentries(const std::string &dir, const std::string &self,
+                        std::vector<slotentry> &entries)
+{
+    int dirfd = opendirectory(dir.c_str());
+
+    if (dirfd == -1)
+        return;
+
+    scandirectory(dirfd, [&](const char *name)
+    {
+        if (*name == '.' || !std::strcmp(name, LOCKFILE + 1) || self == name)
+            return;
+
+        int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+        slotentry entry;
+
+        if (fd == -1)
+            return;
+
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0)
+            unlinkat(dirfd, name, 0);
+        else if (readentry(fd, entry))
+            entries.push_back(entry);
+
+        close(fd);
+    });
+
+    close(dirfd);
+}
+
+static ullong nextsequence(int lockfd)
+{
+    char buf[32] = {};
+    ullong seq = 0;
+
+    if (pread(lockfd, buf, sizeof(buf)-1, 0) > 0)
+        seq = std::strtoull(buf, nullptr, 10);
+
+    std::string data = std::to_string(++seq) + "\n";
+    ssize_t n = pwrite(lockfd, data.c_str(), data.size(), 0);
+    (void)n;
+
+    return seq;
+}
+
+/*
+ * cgroup v2
+ *
+ * Each admitted command gets <WCLANG_CGROUP>/wclang-<pid>-<n>, the
+ * compiler is moved into it right after it started and its children
+ * (cc1, lld) inherit it. We stay outside, so that we can report an
+ * OOM kill. Cgroups left behind by killed invocations are removed by
+ * the next one.
+ */
+
+static bool writecgroupfile(const std::string &file, const std::string &value)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return false;
+
+    bool ok = write(fd, value.c_str(), value.size()) == (ssize_t)value.size();
+    close(fd);
+
+    return ok;
+}
+
+static void createcgroup(admission &adm, ullong budget)
+{
+    const char *parent = getenvvar("WCLANG_CGROUP");
+    ullong limit = parsesize(getenvvar("WCLANG_CGROUP_MEMORY_MAX"), budget * 1024);
+
+    if (!parent || !*parent)
+        return;
+
+    int dirfd = opendirectory(parent);
+
+    if (dirfd == -1)
+    {
+        warn("cannot open cgroup %", parent);
+        return;
+    }
+
+    /* cgroups of dead invocations, empty ones of live ones are about to be used */
+    scandirectory(dirfd, [&](const char *name)
+    {
+        if (std::strncmp(name, "wclang-", STRLEN("wclang-")))
+            return;
+
+        pid_t pid = (pid_t)std::atoi(name + STRLEN("wclang-"));
+
+        if (pid > 0 && kill(pid, 0) == -1 && errno == ESRCH)
+            unlinkat(dirfd, name, AT_REMOVEDIR);
+    });
+
+    close(dirfd);
+
+    std::string cgroup = std::string(parent) + "/wclang-" + adm.name;
+
+    if (mkdir(cgroup.c_str(), 0755) == -1 && errno != EEXIST)
+    {
+        warn("cannot create cgroup % (%)", cgroup, strerror(errno));
+        return;
+    }
+
+    if (limit && !writecgroupfile(cgroup + "/memory.max", std::to_string(limit)))
+        warn("cannot set memory.max of % (memory controller not enabled?)", cgroup);
+
+    /* the OOM killer takes the driver and cc1 or lld together */
+    writecgroupfile(cgroup + "/memory.oom.group", "1");
+
+    adm.cgroup = cgroup;
+}
+
+void addtocgroup(admission &adm, pid_t pid)
+{
+    if (adm.cgroup.empty())
+        return;
+
+    if (!writecgroupfile(adm.cgroup + "/cgroup.procs", std::to_string(pid)))
+    {
+        warn("cannot move % into cgroup % (%)", pid, adm.cgroup, strerror(errno));
+        rmdir(adm.cgroup.c_str());
+        adm.cgroup.clear();
+    }
+}
+
+static bool isoomkilled(const std::string &cgroup)
+{
+    std::string data;
+    size_t pos;
+
+    if (!readfile((cgroup + "/memory.events").c_str(), data) ||
+        (pos = data.find("oom_kill ")) == std::string::npos)
+    {
+        return false;
+    }
+
+    return std::strtoull(data.c_str() + pos + STRLEN("oom_kill "), nullptr, 10) > 0;
+}
+
+bool queueadmission(char **cargs, bool link, admission &adm)
+{
+    static int entries = 0;
+    std::string dir;
+
+    if (!getadmissiondir(dir))
+        return false;
+
+    adm.lockfd = open((dir + LOCKFILE).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (adm.lockfd == -1)
+        return false;
+
+    /* -wc-jobs queues one entry per job */
+    adm.name = std::to_string(getpid()) + "-" + std::to_string(entries++);
+    adm.dir = dir;
+    adm.key = getweightkey(cargs);
+    adm.link = link;
+    adm.weight = loadweight(adm.key);
+    adm.admitted = false;
+
+    if (!adm.weight)
+        adm.weight = link ? DEFAULTLINKWEIGHT : DEFAULTCOMPILEWEIGHT;
+
+    if (!lockfile(adm.lockfd, LOCK_EX) ||
+        (adm.fd = open((dir + PATHDIV + adm.name).c_str(),
+                       O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+    {
+        close(adm.lockfd);
+        adm.lockfd = -1;
+        return false;
+    }
+
+    slotentry self = { true, nextsequence(adm.lockfd), adm.weight, link };
+    adm.seq = self.seq;
+
+    if (!lockfile(adm.fd, LOCK_EX) || !writeentry(adm.fd, self))
+    {
+        lockfile(adm.lockfd, LOCK_UN);
+        releaseadmission(adm, RUNCOMMAND_ERROR);
+        return false;
+    }
+
+    lockfile(adm.lockfd, LOCK_UN);
+    return true;
+}
+
+bool tryadmission(admission &adm)
+{
+    ullong budget = getmemorybudget();
+    int linkslots = getlinkslots();
+    std::vector<slotentry> entries;
+    ullong used = 0;
+    int links = 0;
+    bool running = false;
+    bool queued = false;
+
+    if (!adm.held() || adm.admitted)
+        return true;
+
+    lockfile(adm.lockfd, LOCK_EX);
+    readentries(adm.dir, adm.name, entries);
+
+    for (const auto &entry : entries)
+    {
+        if (entry.waiting)
+            continue;
+
+        running = true;
+        used += entry.weight;
+        links += entry.link;
+    }
+
+    /*
+     * First come, first served, except for links which
+     * only wait for a link slot
+     */
+
+    for (const auto &entry : entries)
+    {
+        if (entry.waiting && entry.seq < adm.seq &&
+            (!entry.link || !linkslots || links < linkslots))
+        {
+            queued = true;
+        }
+    }
+
+    /* a command larger than the budget runs alone */
+    bool fits = !budget || !running || used + adm.weight <= budget;
+    bool slot = !adm.link || !linkslots || links < linkslots;
+
+    if (fits && slot && !queued)
+    {
+        slotentry self = { false, adm.seq, adm.weight, adm.link };
+
+        writeentry(adm.fd, self);
+        adm.admitted = true;
+    }
+
+    lockfile(adm.lockfd, LOCK_UN);
+
+    if (adm.admitted)
+    {
+        close(adm.lockfd);
+        adm.lockfd = -1;
+        createcgroup(adm, budget);
+    }
+
+    return adm.admitted;
+}
+
+bool acquireadmission(char **cargs, const commandargs &cmdargs, admission &adm)
+{
+    if (!queueadmission(cargs, cmdargs.islinkstep && !cmdargs.iscompilestep, adm))
+        return false;
+
+    time_point start = getticks();
+    int pollms = MINPOLLMS;
+
+    while (!tryadmission(adm))
+    {
+        usleep(pollms * 1000);
+        pollms = std::min(pollms * 2, MAXPOLLMS);
+    }
+
+    if (cmdargs.verbose)
+    {
+        verbosemsg("admission: % KiB (%), waited % ms", adm.weight,
+                   adm.key.empty() ? "<unknown>" : adm.key,
+                   getmicrodiff(start, getticks()) / 1000);
+    }
+
+    return true;
+}
+
+void releaseadmission(admission &adm, int status, const struct rusage *usage)
+{
+    if (!adm.held())
+        return;
+
+    unlink((adm.dir + PATHDIV + adm.name).c_str());
+    close(adm.fd);
+    adm.fd = -1;
+
+    if (adm.lockfd != -1)
+    {
+        close(adm.lockfd);
+        adm.lockfd = -1;
+    }
+
+    if (!adm.cgroup.empty())
+    {
+        if (status == 128 + SIGKILL && isoomkilled(adm.cgroup))
+            warn("% was killed for exceeding memory.max of %", adm.key, adm.cgroup);
+
+        rmdir(adm.cgroup.c_str());
+        adm.cgroup.clear();
+    }
+
+    /* cache hits compiled nothing, their usage is zero */
+    if (usage && status == 0 && usage->ru_maxrss > 0)
+        storeweight(adm.key, (ullong)usage->ru_maxrss);
+}
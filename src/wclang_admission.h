@@ -0,0 +1,62 @@
+/*
+ * Memory admission control
+ *
+ * Invocations on the same machine share the directory
+ * $WCLANG_ADMISSION_DIR (default: $XDG_RUNTIME_DIR/wclang-admission
+ * or /tmp/wclang-admission-<uid>), a semaphore in the file system.
+ * A compile or link step is admitted once
+ *  - the peak RSS it had on its last run (<cachedir>/memory) plus the
+ *    one of all running steps fits into $WCLANG_MEMORY_BUDGET
+ *    (<size> or <percent>%), and
+ *  - fewer than $WCLANG_LINK_SLOTS link steps are running (links).
+ * Steps are admitted in the order they arrived.
+ *
+ * With $WCLANG_CGROUP (a cgroup v2 directory with the memory controller
+ * enabled for its children), each compiler runs in its own cgroup with
+ * memory.max set to $WCLANG_CGROUP_MEMORY_MAX (default: the budget).
+ */
+
+struct rusage;
+
+struct admission {
+    int fd;
+    int lockfd;
+    std::string dir;
+    std::string name;
+    std::string key;
+    std::string cgroup;
+    ullong seq;
+    ullong weight;
+    bool link;
+    bool admitted;
+
+    admission() : fd(-1), lockfd(-1), seq(), weight(), link(), admitted() {}
+    bool held() const { return fd != -1; }
+};
+
+bool useadmission();
+
+/*
+ * Blocks until the command may run, returns
+ * false if the slot directory is unusable
+ */
+bool acquireadmission(char **cargs, const commandargs &cmdargs, admission &adm);
+
+/*
+ * Non-blocking variant (-wc-jobs): queueadmission() enqueues the
+ * command, tryadmission() returns true once it may run
+ */
+bool queueadmission(char **cargs, bool link, admission &adm);
+bool tryadmission(admission &adm);
+
+/*
+ * Moves a started compiler into the command's cgroup
+ */
+void addtocgroup(admission &adm, pid_t pid);
+
+/*
+ * Frees the slot and records the peak RSS in 'usage'
+ */
+void releaseadmission(admission &adm, int status, const struct rusage *usage = nullptr);
+
+size_t clearmemoryhistory();
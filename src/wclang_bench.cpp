@@ -0,0 +1,648 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+/*
+ * wclang-bench
+ *
+ * Measures the overhead of wclang itself (Linux only): synthetic mingw
+ * and clang trees are generated in a temporary directory, "clang" and
+ * the mingw gcc are copies of this binary, which exit immediately.
+ *
+ * For each scenario and invocation we measure
+ *  - the time from wclang's execve() to the execve() of the compiler
+ *    (or to its exit for queries), using ptrace exec events,
+ *  - the number of system calls wclang made until then,
+ *  - the number of allocations (via the LD_PRELOAD counter library).
+ *
+ * Results are written as JSON.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <climits>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifndef WCLANG_BINARY
+#define WCLANG_BINARY "wclang"
+#endif
+
+#ifndef MALLOC_COUNTER
+#define MALLOC_COUNTER ""
+#endif
+
+typedef unsigned long long ullong;
+typedef std::vector<std::string> string_vector;
+
+static constexpr const char* TRIPLE = "x86_64-w64-mingw32";
+
+struct scenario {
+    const char *name;
+    int gccversions;
+    int clangversions;
+    int pathdirs;
+    int mingwpaths;
+};
+
+static constexpr scenario SCENARIOS[] = {
+    { "baseline",        1,  1,   0,  1 },
+    { "gcc-versions",   25,  1,   0,  1 },
+    { "clang-versions",  1, 25,   0,  1 },
+    { "long-path",       1,  1, 250,  1 },
+    { "mingw-path-list", 1,  1,   0, 25 },
+    { "everything",     25, 25, 250, 25 }
+};
+
+struct invocation {
+    const char *name;
+    const char *driver;
+    bool exec; /* must reach the execve() of the compiler */
+    const char *args[6];
+};
+
+static constexpr invocation INVOCATIONS[] = {
+    { "compile", "-clang", true, { "-c", "bench.c", "-o", "bench.o", nullptr } },
+    { "compile-cxx", "-clang++", true, { "-c", "bench.cpp", "-o", "bench.o", nullptr } },
+    { "link", "-clang", true, { "bench.o", "-o", "bench.exe", nullptr } },
+    { "query", "-clang", false, { "-wc-target", nullptr } }
+};
+
+struct measurement {
+    std::vector<ullong> latencies;
+    ullong syscalls;
+    ullong allocations;
+    ullong allocatedbytes;
+    bool execd;
+    int status;
+
+    measurement() : syscalls(), allocations(), allocatedbytes(), execd(), status() {}
+};
+
+static ullong getmicrotime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static std::string jsonstring(const std::string &str)
+{
+    std::string result = "\"";
+
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\') result += '\\';
+        result += c;
+    }
+
+    return result + "\"";
+}
+
+/*
+ * Synthetic trees
+ */
+
+static bool makedirs(const std::string &dir)
+{
+    std::string path;
+    std::stringstream ss(dir);
+    std::string component;
+
+    while (std::getline(ss, component, '/'))
+    {
+        path += component + "/";
+
+        if (mkdir(path.c_str(), 0755) && errno != EEXIST)
+            return false;
+    }
+
+    return true;
+}
+
+static bool writefile(const std::string &file, const std::string &data)
+{
+    std::ofstream f(file.c_str());
+    f << data;
+    return f.good();
+}
+
+static bool copyfile(const std::string &from, const std::string &to)
+{
+    std::ifstream in(from.c_str(), std::ios::binary);
+    std::ofstream out(to.c_str(), std::ios::binary);
+
+    out << in.rdbuf();
+
+    if (!out.good())
+        return false;
+
+    out.close();
+    return !chmod(to.c_str(), 0755);
+}
+
+static int backdatefile(const char *path, const struct stat *, int, struct FTW *)
+{
+    /* the discovery cache ignores recently modified directories */
+    struct timespec times[2] = { { 1577836800, 0 }, { 1577836800, 0 } };
+    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+static int removefile(const char *path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+static bool createtree(const std::string &root, const scenario &s,
+                       const std::string &self, const std::string &wclang)
+{
+    std::string sys = root + "/sys";
+    std::string llvm = root + "/llvm";
+    std::string gcc = root + "/usr/lib/gcc/" + TRIPLE;
+
+    if (!makedirs(sys + "/bin") || !makedirs(sys + "/" + TRIPLE + "/include") ||
+        !makedirs(llvm + "/bin") || !makedirs(root + "/work") || !makedirs(root + "/cache"))
+    {
+        return false;
+    }
+
+    for (const char *h : { "stdio.h", "stdlib.h", "windows.h", "string.h" })
+        writefile(sys + "/" + TRIPLE + "/include/" + h, "");
+
+    for (int i = 0; i < s.gccversions; ++i)
+    {
+        std::string dir = gcc + "/" + std::to_string(i + 4) + ".0.0/include/c++";
+
+        if (!makedirs(dir + "/" + TRIPLE + "/bits"))
+            return false;
+
+        /* iostream is what the C++ header discovery looks for */
+        for (const char *h : { "iostream", "vector", "string" })
+            writefile(dir + "/" + h, "");
+
+        writefile(dir + "/" + TRIPLE + "/bits/c++config.h", "");
+    }
+
+    for (int i = 0; i < s.clangversions; ++i)
+    {
+        std::string dir = llvm + "/lib/clang/" + std::to_string(i + 3) + ".0.0/include";
+
+        if (!makedirs(dir))
+            return false;
+
+        writefile(dir + "/xmmintrin.h", "");
+    }
+
+    for (int i = 0; i < s.pathdirs; ++i)
+        makedirs(root + "/path/" + std::to_string(i));
+
+    for (const char *name : { "clang", "clang++" })
+    {
+        if (!copyfile(self, llvm + "/bin/" + name))
+            return false;
+    }
+
+    for (const char *suffix : { "-gcc", "-g++" })
+    {
+        if (!copyfile(self, sys + "/bin/" + TRIPLE + suffix))
+            return false;
+    }
+
+    for (const char *suffix : { "-clang", "-clang++" })
+    {
+        if (symlink(wclang.c_str(), (llvm + "/bin/" + TRIPLE + suffix).c_str()))
+            return false;
+    }
+
+    writefile(root + "/work/bench.c", "int main() { return 0; }\n");
+    writefile(root + "/work/bench.cpp", "int main() { return 0; }\n");
+    writefile(root + "/work/bench.o", "");
+
+    nftw(root.c_str(), backdatefile, 64, FTW_PHYS);
+    return true;
+}
+
+static string_vector buildenv(const std::string &root, const scenario &s, bool cache)
+{
+    string_vector env;
+    std::string path;
+    std::string mingwpath;
+
+    for (int i = 0; i < s.pathdirs; ++i)
+        path += root + "/path/" + std::to_string(i) + ":";
+
+    path += root + "/llvm/bin:/usr/bin:/bin";
+
+    for (int i = 1; i < s.mingwpaths; ++i)
+        mingwpath += root + "/mingw" + std::to_string(i) + "/bin:";
+
+    mingwpath += root + "/sys/bin";
+
+    env.push_back("PATH=" + path);
+    env.push_back("MINGW_PATH=" + mingwpath);
+    env.push_back("HOME=" + root);
+    env.push_back("WCLANG_CACHE_DIR=" + root + "/cache");
+    env.push_back("WCLANG_NO_DAEMON=1");
+    env.push_back("WCLANG_BENCH_LIBGCC=" + root + "/usr/lib/gcc/" + TRIPLE + "/4.0.0/libgcc.a");
+
+    if (!cache)
+        env.push_back("WCLANG_NO_DISCOVERY_CACHE=1");
+
+    return env;
+}
+
+/*
+ * Running wclang
+ */
+
+enum runmode {
+    RUN_TIME,
+    RUN_SYSCALLS,
+    RUN_ALLOCATIONS
+};
+
+static std::vector<char*> tocstrings(string_vector &strings)
+{
+    std::vector<char*> result;
+
+    for (auto &str : strings)
+        result.push_back(&str[0]);
+
+    result.push_back(nullptr);
+    return result;
+}
+
+static bool runwclang(const std::string &root, const invocation &inv, string_vector env,
+                      runmode mode, const std::string &malloccounter, measurement &m)
+{
+    string_vector args;
+    int pipefd[2] = { -1, -1 };
+    int status;
+    pid_t pid;
+
+    args.push_back(root + "/llvm/bin/" + TRIPLE + inv.driver);
+
+    for (const char *const *arg = inv.args; *arg; ++arg)
+        args.push_back(*arg);
+
+    if (mode == RUN_ALLOCATIONS)
+    {
+        if (malloccounter.empty() || pipe(pipefd))
+            return false;
+
+        env.push_back("LD_PRELOAD=" + malloccounter);
+        env.push_back("WCLANG_BENCH_FD=" + std::to_string(pipefd[1]));
+    }
+
+    if ((pid = fork()) == -1)
+        return false;
+
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+
+        if (chdir((root + "/work").c_str()))
+            _exit(127);
+
+        env.push_back("WCLANG_BENCH_PID=" + std::to_string(getpid()));
+
+        if (mode != RUN_ALLOCATIONS)
+            ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+
+        auto argv = tocstrings(args);
+        auto envp = tocstrings(env);
+
+        execve(argv[0], &argv[0], &envp[0]);
+        _exit(127);
+    }
+
+    if (mode == RUN_ALLOCATIONS)
+    {
+        std::string data;
+        char buf[128];
+        ssize_t n;
+
+        close(pipefd[1]);
+
+        while ((n = read(pipefd[0], buf, sizeof(buf))) > 0 ||
+               (n == -1 && errno == EINTR))
+        {
+            if (n > 0) data.append(buf, n);
+        }
+
+        close(pipefd[0]);
+        waitpid(pid, &status, 0);
+
+        return sscanf(data.c_str(), "%llu %llu", &m.allocations, &m.allocatedbytes) == 2;
+    }
+
+    /*
+     * Stopped right after execve() of wclang
+     */
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+        return false;
+
+    ullong start = getmicrotime();
+    ullong syscalls = 0;
+    bool insyscall = false;
+    int sig = 0;
+
+    ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+           PTRACE_O_TRACEEXEC | PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+    while (true)
+    {
+        ptrace(mode == RUN_SYSCALLS ? PTRACE_SYSCALL : PTRACE_CONT, pid, nullptr, sig);
+        sig = 0;
+
+        if (waitpid(pid, &status, 0) == -1)
+            return false;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            m.execd = false;
+            m.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            break;
+        }
+
+        if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXEC << 8)))
+        {
+            /* the compiler has been executed */
+            m.execd = true;
+            break;
+        }
+
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+        {
+            if (!insyscall) ++syscalls;
+            insyscall = !insyscall;
+            continue;
+        }
+
+        sig = WSTOPSIG(status);
+    }
+
+    ullong end = getmicrotime();
+
+    if (m.execd)
+    {
+        ptrace(PTRACE_DETACH, pid, nullptr, nullptr);
+        waitpid(pid, &status, 0);
+        m.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    if (mode == RUN_TIME)
+        m.latencies.push_back(end - start);
+    else
+        m.syscalls = syscalls;
+
+    return true;
+}
+
+/*
+ * Stub compiler mode
+ */
+
+static int stubmain(const char *name, int argc, char **argv)
+{
+    size_t len = std::strlen(name);
+
+    if (len > 4 && (!std::strcmp(name + len - 4, "-gcc") || !std::strcmp(name + len - 4, "-g++")))
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            if (!std::strcmp(argv[i], "-print-libgcc-file-name"))
+            {
+                const char *libgcc = getenv("WCLANG_BENCH_LIBGCC");
+                std::cout << (libgcc ? libgcc : "libgcc.a") << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void usage()
+{
+    std::cerr << "usage: wclang-bench [--wclang=<path>] [--malloc-counter=<path>]\n"
+                 "                    [--iterations=N] [--output=<file>] [--keep]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = std::strrchr(argv[0], '/');
+    name = name ? name + 1 : argv[0];
+
+    if (std::strcmp(name, "wclang-bench"))
+        return stubmain(name, argc, argv);
+
+    std::string wclang = WCLANG_BINARY;
+    std::string malloccounter = MALLOC_COUNTER;
+    std::string output;
+    int iterations = 20;
+    bool keep = false;
+    char self[PATH_MAX];
+    char path[PATH_MAX];
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+
+        if (!std::strncmp(arg, "--wclang=", 9)) wclang = arg + 9;
+        else if (!std::strncmp(arg, "--malloc-counter=", 17)) malloccounter = arg + 17;
+        else if (!std::strncmp(arg, "--iterations=", 13)) iterations = std::atoi(arg + 13);
+        else if (!std::strncmp(arg, "--output=", 9)) output = arg + 9;
+        else if (!std::strcmp(arg, "--keep")) keep = true;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+
+    if (len <= 0 || iterations < 1 || !realpath(wclang.c_str(), path))
+    {
+        std::cerr << "cannot find wclang binary (" << wclang << ")" << std::endl;
+        return 1;
+    }
+
+    self[len] = '\0';
+    wclang = path;
+
+    if (!malloccounter.empty() && realpath(malloccounter.c_str(), path))
+        malloccounter = path;
+    else
+        malloccounter.clear();
+
+    const char *tmpdir = getenv("TMPDIR");
+    std::string tmpl = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/wclang-bench-XXXXXX";
+
+    if (!mkdtemp(&tmpl[0]))
+    {
+        std::cerr << "cannot create temporary directory" << std::endl;
+        return 1;
+    }
+
+    std::stringstream json;
+    bool first = true;
+
+    json << "{\n  \"wclang\": " << jsonstring(wclang) << ",\n";
+    json << "  \"iterations\": " << iterations << ",\n";
+    json << "  \"results\": [";
+
+    for (const auto &s : SCENARIOS)
+    {
+        std::string root = tmpl + "/" + s.name;
+
+        if (!createtree(root, s, self, wclang))
+        {
+            std::cerr << "cannot create synthetic tree in " << root << std::endl;
+            return 1;
+        }
+
+        for (const auto &inv : INVOCATIONS)
+        {
+            for (bool cache : { false, true })
+            {
+                string_vector env = buildenv(root, s, cache);
+                measurement m;
+
+                bool ok = true;
+
+                /*
+                 * Every run must take the real path, a failing
+                 * invocation would measure the error path instead
+                 */
+                auto run = [&](runmode mode)
+                {
+                    if (!ok)
+                        return;
+
+                    if (!runwclang(root, inv, env, mode, malloccounter, m))
+                        ok = false;
+                    else if (m.status != 0 || m.execd != inv.exec)
+                        ok = false;
+                };
+
+                /* populate the discovery cache */
+                if (cache)
+                    run(RUN_TIME);
+
+                m.latencies.clear();
+
+                for (int i = 0; i < iterations; ++i)
+                    run(RUN_TIME);
+
+                run(RUN_SYSCALLS);
+
+                bool allocs = runwclang(root, inv, env, RUN_ALLOCATIONS, malloccounter, m);
+
+                if (!ok || m.latencies.empty())
+                {
+                    std::cerr << "running wclang failed (" << s.name << ", " << inv.name
+                              << (cache ? ", discovery cache" : "") << "): ";
+
+                    if (m.status != 0)
+                        std::cerr << "exit status " << m.status << std::endl;
+                    else if (m.execd != inv.exec)
+                        std::cerr << (inv.exec ? "compiler not executed" : "unexpected exec") << std::endl;
+                    else
+                        std::cerr << "cannot trace wclang" << std::endl;
+
+                    if (!keep)
+                        nftw(tmpl.c_str(), removefile, 64, FTW_DEPTH | FTW_PHYS);
+
+                    return 1;
+                }
+
+                std::sort(m.latencies.begin(), m.latencies.end());
+
+                ullong sum = 0;
+
+                for (ullong l : m.latencies)
+                    sum += l;
+
+                json << (first ? "\n" : ",\n");
+                json << "    { \"scenario\": " << jsonstring(s.name)
+                     << ", \"invocation\": " << jsonstring(inv.name)
+                     << ", \"discovery_cache\": " << (cache ? "true" : "false")
+                     << ", \"exec\": " << (m.execd ? "true" : "false")
+                     << ",\n      \"latency_us\": { \"min\": " << m.latencies.front()
+                     << ", \"median\": " << m.latencies[m.latencies.size() / 2]
+                     << ", \"mean\": " << sum / m.latencies.size()
+                     << ", \"max\": " << m.latencies.back() << " }"
+                     << ", \"syscalls\": " << m.syscalls;
+
+                if (allocs)
+                {
+                    json << ", \"allocations\": " << m.allocations
+                         << ", \"allocated_bytes\": " << m.allocatedbytes;
+                }
+
+                json << " }";
+                first = false;
+            }
+        }
+    }
+
+    json << "\n  ]\n}\n";
+
+    if (!keep)
+        nftw(tmpl.c_str(), removefile, 64, FTW_DEPTH | FTW_PHYS);
+    else
+        std::cerr << "synthetic trees kept in " << tmpl << std::endl;
+
+    if (output.empty())
+    {
+        std::cout << json.str();
+        return 0;
+    }
+
+    if (!writefile(output, json.str()))
+    {
+        std::cerr << "cannot write " << output << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
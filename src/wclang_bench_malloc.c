@@ -0,0 +1,98 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+/*
+ * Allocation counter for wclang-bench (LD_PRELOAD, glibc only)
+ *
+ * Counts malloc/calloc/realloc calls of the process whose pid is
+ * $WCLANG_BENCH_PID and writes "<calls> <bytes>\n" to the descriptor
+ * $WCLANG_BENCH_FD right before it executes another program or exits.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static unsigned long long calls;
+static unsigned long long bytes;
+static int reported;
+
+void *malloc(size_t size)
+{
+    ++calls;
+    bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ++calls;
+    bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    ++calls;
+    bytes += size;
+    return __libc_realloc(p, size);
+}
+
+static void report(void)
+{
+    const char *fd = getenv("WCLANG_BENCH_FD");
+    const char *pid = getenv("WCLANG_BENCH_PID");
+    char buf[64];
+    int len;
+
+    if (reported || !fd || !pid || atoi(pid) != (int)getpid())
+        return;
+
+    reported = 1;
+    len = snprintf(buf, sizeof(buf), "%llu %llu\n", calls, bytes);
+
+    if (write(atoi(fd), buf, len) != len)
+        return;
+}
+
+__attribute__((destructor))
+static void reportatexit(void)
+{
+    report();
+}
+
+/*
+ * wclang replaces itself with the compiler
+ */
+
+int execvp(const char *file, char *const argv[])
+{
+    extern char **environ;
+
+    report();
+    return execvpe(file, argv, environ);
+}
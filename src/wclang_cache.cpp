@@ -0,0 +1,799 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <cerrno>
+#include <set>
+#include <utility>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include "wclang.h"
+#include "wclang_cache.h"
+
+static constexpr char DISCOVERYDIR[] = "/discovery";
+static constexpr char STATSFILE[] = "/counters";
+static constexpr char OLDSTATSFILE[] = "/stats";
+
+/* one 64-bit counter per event, in this order */
+static constexpr char STATEVENTS[] = "hmiHMUREPQ";
+static constexpr char DISCOVERYMAGIC[] = "wclang-discovery 1";
+
+/*
+ * Ignore entries whose dependencies changed less than
+ * two seconds ago, they may still be in the middle of
+ * being modified (package upgrades, ...)
+ */
+static constexpr ullong RACYNS = 2000000000ULL;
+
+/*
+ * Helpers
+ */
+
+bool getcachedir(std::string &dir)
+{
+    const char *p;
+
+    if ((p = getenvvar("WCLANG_CACHE_DIR")) && *p)
+    {
+        dir = p;
+    }
+    else if ((p = getenvvar("XDG_CACHE_HOME")) && *p)
+    {
+        dir = p;
+        dir += "/wclang";
+    }
+    else if ((p = getenvvar("HOME")) && *p)
+    {
+        dir = p;
+        dir += "/.cache/wclang";
+    }
+    else
+    {
+        dir.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool makedirectories(const std::string &dir)
+{
+    std::string path;
+    size_t pos = 0;
+
+    do
+    {
+        pos = dir.find(PATHDIV, pos+1);
+        path.assign(dir, 0, pos);
+
+        if (mkdir(path.c_str(), 0755) && errno != EEXIST)
+            return false;
+    } while (pos != std::string::npos);
+
+    return isdirectory(dir.c_str(), nullptr);
+}
+
+bool readfile(const char *file, std::string &data)
+{
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    ssize_t n;
+
+    data.clear();
+
+    if (fd == -1)
+        return false;
+
+    if (!fstat(fd, &st) && st.st_size > 0)
+        data.reserve(st.st_size);
+
+    char buf[16384];
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            close(fd);
+            return false;
+        }
+
+        data.append(buf, n);
+    }
+
+    close(fd);
+    return true;
+}
+
+bool writefileatomic(const std::string &file, const std::string &data)
+{
+    /*
+     * Write to a temporary file and rename() it afterwards,
+     * concurrent readers either see the old or the new file
+     */
+
+    std::string tmp = file;
+    const char *p = data.c_str();
+    size_t left = data.size();
+
+    tmp += ".tmp.";
+    tmp += std::to_string(getpid());
+
+    int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0644);
+
+    if (fd == -1)
+        return false;
+
+    while (left)
+    {
+        ssize_t n = write(fd, p, left);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    if (close(fd) || rename(tmp.c_str(), file.c_str()))
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+ullong parsesize(const char *str, ullong defaultsize)
+{
+    char *end;
+    ullong size;
+
+    if (!str || !*str)
+        return defaultsize;
+
+    size = std::strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+        case 'T': case 't': size *= 1024; /* fallthrough */
+        case 'G': case 'g': size *= 1024; /* fallthrough */
+        case 'M': case 'm': size *= 1024; /* fallthrough */
+        case 'K': case 'k': size *= 1024; break;
+        case '\0': break;
+        default: return defaultsize;
+    }
+
+    return size ? size : defaultsize;
+}
+
+ullong fnv1a64(const void *data, size_t len, ullong hash)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+
+    while (len--)
+    {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+ullong fnv1a64(const std::string &str, ullong hash)
+{
+    return fnv1a64(str.c_str(), str.size(), hash);
+}
+
+std::string hashtostring(ullong hash)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", hash);
+    return buf;
+}
+
+ullong getmtime(const struct stat &st)
+{
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+}
+
+void countcachestat(char type)
+{
+    std::string file;
+    const char *event = std::strchr(STATEVENTS, type);
+    ullong count = 0;
+
+    if (!type || !event || !getcachedir(file))
+        return;
+
+    file += STATSFILE;
+
+    /*
+     * Fixed-size counters, updated in place
+     */
+
+    int fd = open(file.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        return;
+
+    off_t offset = (event - STATEVENTS) * sizeof(count);
+
+    while (flock(fd, LOCK_EX) == -1 && errno == EINTR);
+
+    if (pread(fd, &count, sizeof(count), offset) != sizeof(count))
+        count = 0;
+
+    ++count;
+
+    ssize_t n = pwrite(fd, &count, sizeof(count), offset);
+    (void)n;
+
+    close(fd);
+}
+
+/*
+ * Dependency recording
+ */
+
+static thread_local bool recording = false;
+static thread_local std::vector<std::pair<std::string, bool>> probes;
+
+void startrecording()
+{
+    probes.clear();
+    recording = true;
+}
+
+void stoprecording()
+{
+    recording = false;
+}
+
+void recordprobe(const char *path)
+{
+    if (recording)
+        probes.push_back(std::make_pair(std::string(path), false));
+}
+
+void recordbinary(const char *path)
+{
+    if (recording)
+        probes.push_back(std::make_pair(std::string(path), true));
+}
+
+bool builddeps(cachedep_vector &deps)
+{
+    std::set<std::pair<ullong, ullong>> seen;
+    struct stat st;
+    std::string path;
+
+    ullong now = time(nullptr) * 1000000000ULL;
+
+    auto adddep = [&](const std::string &path, const struct stat &st) -> bool
+    {
+        if (getmtime(st) + RACYNS > now)
+            return false;
+
+        if (!seen.insert(std::make_pair((ullong)st.st_dev, (ullong)st.st_ino)).second)
+            return true;
+
+        cachedep dep;
+        dep.path = path;
+        dep.ino = st.st_ino;
+        dep.size = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+        dep.mtime = getmtime(st);
+        deps.push_back(dep);
+
+        return true;
+    };
+
+    deps.clear();
+
+    for (const auto &probe : probes)
+    {
+        path = probe.first;
+
+        if (probe.second)
+        {
+            /* binaries are recorded themselves */
+            if (!stat(path.c_str(), &st) && !adddep(path, st))
+                return false;
+        }
+
+        while (!path.empty())
+        {
+            if (!stat(path.c_str(), &st) && S_ISDIR(st.st_mode))
+            {
+                if (!adddep(path, st))
+                    return false;
+                break;
+            }
+
+            size_t pos = path.find_last_of(PATHDIV);
+
+            if (pos == std::string::npos)
+                break;
+
+            path.resize(pos ? pos : 1);
+
+            if (pos == 0 && stat(path.c_str(), &st))
+                break;
+        }
+    }
+
+    return true;
+}
+
+bool checkdeps(const cachedep_vector &deps)
+{
+    struct stat st;
+
+    for (const auto &dep : deps)
+    {
+        if (stat(dep.path.c_str(), &st))
+            return false;
+
+        if ((ullong)st.st_ino != dep.ino || getmtime(st) != dep.mtime)
+            return false;
+
+        if (!S_ISDIR(st.st_mode) && (ullong)st.st_size != dep.size)
+            return false;
+    }
+
+    return true;
+}
+
+bool adddirectorydep(int dirfd, const std::string &path, cachedep_vector &deps)
+{
+    struct stat st;
+    ullong now = time(nullptr) * 1000000000ULL;
+
+    if (fstat(dirfd, &st) || getmtime(st) + RACYNS > now)
+        return false;
+
+    cachedep dep;
+    dep.path = path;
+    dep.ino = st.st_ino;
+    dep.size = 0;
+    dep.mtime = getmtime(st);
+    deps.push_back(dep);
+
+    return true;
+}
+
+bool loaddeps(const std::string &file, const char *magic, cachedep_vector &deps)
+{
+    std::string data;
+    size_t pos = 0;
+    bool hasmagic = false;
+
+    deps.clear();
+
+    if (!readfile(file.c_str(), data))
+        return false;
+
+    while (pos < data.size())
+    {
+        size_t eol = data.find('\n', pos);
+        if (eol == std::string::npos) break;
+
+        std::string line(data, pos, eol-pos);
+        pos = eol+1;
+
+        if (!hasmagic)
+        {
+            if (line != magic) return false;
+            hasmagic = true;
+            continue;
+        }
+
+        if (line == "end")
+            return true;
+
+        cachedep dep;
+        char *p;
+
+        dep.ino = std::strtoull(line.c_str(), &p, 10);
+        dep.size = std::strtoull(p, &p, 10);
+        dep.mtime = std::strtoull(p, &p, 10);
+
+        if (*p++ != ' ')
+            return false;
+
+        dep.path = p;
+        deps.push_back(dep);
+    }
+
+    return false;
+}
+
+bool storedeps(const std::string &file, const char *magic, const cachedep_vector &deps)
+{
+    std::string data = magic;
+    data += '\n';
+
+    for (const auto &dep : deps)
+    {
+        data += std::to_string(dep.ino);
+        data += ' ';
+        data += std::to_string(dep.size);
+        data += ' ';
+        data += std::to_string(dep.mtime);
+        data += ' ';
+        data += dep.path;
+        data += '\n';
+    }
+
+    data += "end\n";
+
+    return writefileatomic(file, data);
+}
+
+/*
+ * Discovery cache
+ */
+
+bool usediscoverycache()
+{
+    const char *p;
+    return !(p = getenvvar("WCLANG_NO_DISCOVERY_CACHE")) || *p == '0';
+}
+
+std::string discoverykey(const char *invocationname)
+{
+    std::string key = PACKAGE_VERSION;
+    const char *path = getenvvar("PATH");
+    bool relativepath = false;
+
+    auto append = [&](const char *val)
+    {
+        key += '\x1f';
+        if (val) key += val;
+    };
+
+    append(invocationname);
+    append(getenvvar("MINGW_PATH"));
+    append(path);
+
+#ifdef MINGW_PATH
+    append(MINGW_PATH);
+#endif
+
+#ifdef NO_SYS_PATH
+    append("nosyspath");
+#endif
+
+    /*
+     * Relative PATH entries resolve differently
+     * depending on the working directory
+     */
+
+    for (const char *p = path; p && *p; ++p)
+    {
+        if ((p == path || p[-1] == ':') && *p != PATHDIV)
+            relativepath = true;
+    }
+
+    if (relativepath)
+    {
+        char cwd[PATH_MAX];
+        append(getcwd(cwd, sizeof(cwd)));
+    }
+
+    return key;
+}
+
+static std::string discoveryfile(const std::string &dir, const std::string &key)
+{
+    return dir + DISCOVERYDIR + "/" + hashtostring(fnv1a64(key));
+}
+
+/* set by the thread serving a daemon request */
+static thread_local const discoverymap *memorycache = nullptr;
+static thread_local publishcallback publishentry = nullptr;
+
+void setdiscoverymemory(const discoverymap *entries, publishcallback publish)
+{
+    memorycache = entries;
+    publishentry = publish;
+}
+
+bool parsediscovery(const std::string &data, std::string &key, discoveryentry &entry)
+{
+    bool magic = false;
+    bool end = false;
+
+    entry = discoveryentry();
+    key.clear();
+
+    size_t pos = 0;
+
+    while (pos < data.size())
+    {
+        size_t eol = data.find('\n', pos);
+        if (eol == std::string::npos) break;
+
+        std::string line(data, pos, eol-pos);
+        pos = eol+1;
+
+        if (!magic)
+        {
+            if (line != DISCOVERYMAGIC) break;
+            magic = true;
+            continue;
+        }
+
+        if (line == "end")
+        {
+            end = true;
+            break;
+        }
+
+        size_t sep = line.find(' ');
+        if (sep == std::string::npos) continue;
+
+        std::string tag(line, 0, sep);
+        std::string val(line, sep+1);
+
+        if (tag == "key") key = val;
+        else if (tag == "target") entry.target = val;
+        else if (tag == "targettype") entry.targettype = std::atoi(val.c_str());
+        else if (tag == "stdpath") entry.stdpaths.push_back(val);
+        else if (tag == "cxxpath") entry.cxxpaths.push_back(val);
+        else if (tag == "mingwversion") entry.mingwversion = val;
+        else if (tag == "intrinpath") entry.intrinpaths.push_back(val);
+        else if (tag == "clangversion") entry.clangversion = val;
+        else if (tag == "compilerbinpath") entry.compilerbinpath = val;
+        else if (tag == "gccpath") entry.gccpath = val;
+        else if (tag == "libgccdir")
+        {
+            entry.libgccdir = val;
+            entry.haslibgcc = true;
+        }
+        else if (tag == "dep")
+        {
+            cachedep dep;
+            char *p;
+
+            dep.ino = std::strtoull(val.c_str(), &p, 10);
+            dep.size = std::strtoull(p, &p, 10);
+            dep.mtime = std::strtoull(p, &p, 10);
+
+            if (*p++ != ' ')
+                break;
+
+            dep.path = p;
+            entry.deps.push_back(dep);
+        }
+    }
+
+    return magic && end && !key.empty() && !entry.target.empty() && !entry.stdpaths.empty();
+}
+
+bool loaddiscovery(const std::string &key, discoveryentry &entry)
+{
+    std::string dir;
+    std::string data;
+    std::string entrykey;
+
+    if (memorycache)
+    {
+        /*
+         * Entries held in memory are kept up to date
+         * by their owner, no need to check them here
+         */
+
+        auto it = memorycache->find(key);
+
+        if (it != memorycache->end() &&
+            parsediscovery(it->second, entrykey, entry) && entrykey == key)
+        {
+            countcachestat('h');
+            return true;
+        }
+    }
+
+    if (!getcachedir(dir))
+        return false;
+
+    if (!readfile(discoveryfile(dir, key).c_str(), data) ||
+        !parsediscovery(data, entrykey, entry) || entrykey != key)
+    {
+        countcachestat('m');
+        return false;
+    }
+
+    if (!checkdeps(entry.deps))
+    {
+        countcachestat('i');
+        return false;
+    }
+
+    if (publishentry)
+        publishentry(data);
+
+    countcachestat('h');
+    return true;
+}
+
+bool storediscovery(const std::string &key, discoveryentry &entry)
+{
+    std::string dir;
+    std::string data;
+
+    if (!getcachedir(dir))
+        return false;
+
+    if (!makedirectories(dir + DISCOVERYDIR))
+        return false;
+
+    auto add = [&](const char *tag, const std::string &val)
+    {
+        data += tag;
+        data += ' ';
+        data += val;
+        data += '\n';
+    };
+
+    auto addpaths = [&](const char *tag, const string_vector &paths)
+    {
+        for (const auto &path : paths)
+            add(tag, path);
+    };
+
+    data = DISCOVERYMAGIC;
+    data += '\n';
+
+    add("key", key);
+    add("target", entry.target);
+    add("targettype", std::to_string(entry.targettype));
+    addpaths("stdpath", entry.stdpaths);
+    addpaths("cxxpath", entry.cxxpaths);
+    add("mingwversion", entry.mingwversion);
+    addpaths("intrinpath", entry.intrinpaths);
+    add("clangversion", entry.clangversion);
+    add("compilerbinpath", entry.compilerbinpath);
+    add("gccpath", entry.gccpath);
+
+    if (entry.haslibgcc)
+        add("libgccdir", entry.libgccdir);
+
+    for (const auto &dep : entry.deps)
+    {
+        std::string val;
+        val += std::to_string(dep.ino);
+        val += ' ';
+        val += std::to_string(dep.size);
+        val += ' ';
+        val += std::to_string(dep.mtime);
+        val += ' ';
+        val += dep.path;
+        add("dep", val);
+    }
+
+    data += "end\n";
+
+    if (publishentry)
+        publishentry(data);
+
+    return writefileatomic(discoveryfile(dir, key), data);
+}
+
+/*
+ * -wc-cache-stats / -wc-cache-clear
+ */
+
+bool readcachestats(cachestats &stats)
+{
+    std::string dir;
+    std::string data;
+
+    if (!getcachedir(dir) || !readfile((dir + STATSFILE).c_str(), data))
+        return false;
+
+    for (size_t i = 0; i < STRLEN(STATEVENTS); ++i)
+    {
+        ullong count = 0;
+
+        if ((i + 1) * sizeof(count) <= data.size())
+            std::memcpy(&count, &data[i * sizeof(count)], sizeof(count));
+
+        stats[STATEVENTS[i]] = count;
+    }
+
+    return true;
+}
+
+void printcachestats()
+{
+    std::string dir;
+    cachestats stats;
+    string_vector entries;
+
+    if (!getcachedir(dir))
+    {
+        std::cout << "no cache directory (set WCLANG_CACHE_DIR or HOME)" << std::endl;
+        return;
+    }
+
+    listfiles((dir + DISCOVERYDIR).c_str(), &entries);
+    readcachestats(stats);
+
+    ullong hits = stats['h'], misses = stats['m'], invalidated = stats['i'];
+    ullong total = hits + misses + invalidated;
+
+    std::cout << "cache directory: " << dir << std::endl;
+    std::cout << "discovery entries: " << entries.size() << std::endl;
+    std::cout << "discovery hits: " << hits << std::endl;
+    std::cout << "discovery misses: " << misses << std::endl;
+    std::cout << "discovery invalidations: " << invalidated << std::endl;
+
+    if (total)
+    {
+        std::cout << "discovery hit rate: " << (hits * 100.0 / total)
+                  << "%" << std::endl;
+    }
+}
+
+size_t clearcache()
+{
+    std::string dir;
+    string_vector entries;
+    size_t n = 0;
+
+    if (!getcachedir(dir))
+        return 0;
+
+    std::string discoverydir = dir + DISCOVERYDIR;
+
+    if (listfiles(discoverydir.c_str(), &entries))
+    {
+        for (const auto &entry : entries)
+        {
+            if (!unlink((discoverydir + "/" + entry).c_str()))
+                ++n;
+        }
+    }
+
+    unlink((dir + STATSFILE).c_str());
+    unlink((dir + OLDSTATSFILE).c_str());
+    return n;
+}
@@ -0,0 +1,122 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/stat.h>
+
+/*
+ * Persistent on-disk cache
+ *
+ * Everything lives below getcachedir(), which is
+ * $WCLANG_CACHE_DIR, $XDG_CACHE_HOME/wclang or ~/.cache/wclang.
+ */
+
+bool getcachedir(std::string &dir);
+bool makedirectories(const std::string &dir);
+bool readfile(const char *file, std::string &data);
+bool writefileatomic(const std::string &file, const std::string &data);
+
+/*
+ * Parses a size in bytes with an optional K, M, G or T suffix
+ */
+ullong parsesize(const char *str, ullong defaultsize);
+
+constexpr ullong FNV1A64_OFFSET = 0xcbf29ce484222325ULL;
+ullong fnv1a64(const void *data, size_t len, ullong hash = FNV1A64_OFFSET);
+ullong fnv1a64(const std::string &str, ullong hash = FNV1A64_OFFSET);
+std::string hashtostring(ullong hash);
+
+ullong getmtime(const struct stat &st);
+
+/*
+ * Counts an event in the statistics file:
+ * discovery cache: h(it), m(iss), i(nvalidated)
+ * object cache: H(it), M(iss), U(ncacheable), R(emote hit), E (remote error)
+ * probe cache: P (hit), Q (miss)
+ */
+typedef std::map<char, ullong> cachestats;
+
+void countcachestat(char type);
+bool readcachestats(cachestats &stats);
+
+/*
+ * Cache dependencies
+ *
+ * A dependency is a directory or binary whose identity (inode, size,
+ * mtime) is recorded when a cache entry is written. An entry is valid
+ * as long as all of its dependencies are unchanged.
+ *
+ * While recording, every path probed by the discovery code is passed
+ * to recordprobe(). Existing directories are recorded themselves,
+ * existing files via their parent directory and missing paths via
+ * their deepest existing ancestor, so that creating or removing any
+ * probed path changes the mtime of a recorded directory.
+ */
+
+struct cachedep {
+    std::string path;
+    ullong ino;
+    ullong size;
+    ullong mtime;
+};
+
+typedef std::vector<cachedep> cachedep_vector;
+
+void startrecording();
+void stoprecording();
+void recordprobe(const char *path);
+void recordbinary(const char *path);
+bool builddeps(cachedep_vector &deps);
+bool checkdeps(const cachedep_vector &deps);
+
+/*
+ * Records the directory 'dirfd' refers to, returns false
+ * if it changed too recently to be trusted
+ */
+bool adddirectorydep(int dirfd, const std::string &path, cachedep_vector &deps);
+
+/*
+ * Dependencies of generated files (header maps, ...)
+ * stored next to them, 'magic' identifies the file type
+ */
+bool loaddeps(const std::string &file, const char *magic, cachedep_vector &deps);
+bool storedeps(const std::string &file, const char *magic, const cachedep_vector &deps);
+
+/*
+ * Discovery cache
+ */
+
+struct discoveryentry {
+    std::string target;
+    int targettype;
+    string_vector stdpaths;
+    string_vector cxxpaths;
+    std::string mingwversion;
+    string_vector intrinpaths;
+    std::string clangversion;
+    std::string compilerbinpath;
+    std::string gccpath;
+    std::string libgccdir;
+    bool haslibgcc;
+    cachedep_vector deps;
+
+    discoveryentry() : targettype(-1), haslibgcc(false) {}
+};
+
+typedef std::map<std::string, std::string> discoverymap;
+typedef void (*publishcallback)(const std::string &data);
+
+bool usediscoverycache();
+std::string discoverykey(const char *invocationname);
+bool loaddiscovery(const std::string &key, discoveryentry &entry);
+bool storediscovery(const std::string &key, discoveryentry &entry);
+bool parsediscovery(const std::string &data, std::string &key, discoveryentry &entry);
+
+/*
+ * Serve lookups from serialized entries held in memory (key -> data)
+ * and hand every entry that is loaded from or written to disk to
+ * publish(), used by wclangd
+ */
+void setdiscoverymemory(const discoverymap *entries, publishcallback publish);
+
+void printcachestats();
+size_t clearcache();
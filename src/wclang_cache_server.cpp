@@ -0,0 +1,229 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+/*
+ * wclang-cache-server
+ *
+ * Reference server for the remote object cache ($WCLANG_REMOTE_CACHE):
+ * GET <prefix>/<key> returns an entry, PUT <prefix>/<key> stores one.
+ * Entries live in <dir>/<key[0:2]>/<key[2:]> and are written atomically.
+ * Meant for tests and small setups: no eviction, no authentication.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_http.h"
+
+static constexpr size_t MAXENTRYSIZE = 1024 * 1024 * 1024;
+static constexpr int REQUESTTIMEOUT = 60000;
+
+static bool iscachekey(const std::string &key)
+{
+    return key.size() == 64 && key.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+static void handlerequest(int fd, const std::string &dir, bool verbose)
+{
+    httpmessage request;
+    std::string body;
+    int status;
+
+    if (!readhttprequest(fd, request, MAXENTRYSIZE, REQUESTTIMEOUT))
+    {
+        writehttpresponse(fd, 400, std::string(), REQUESTTIMEOUT);
+        return;
+    }
+
+    std::string key = request.path.substr(request.path.rfind('/') + 1);
+    std::string subdir = dir + "/" + key.substr(0, 2);
+    std::string entry = subdir + "/" + key.substr(std::min<size_t>(key.size(), 2));
+
+    if (!iscachekey(key))
+    {
+        status = 400;
+    }
+    else if (request.method == "GET")
+    {
+        status = readfile(entry.c_str(), body) ? 200 : 404;
+    }
+    else if (request.method == "PUT")
+    {
+        status = makedirectories(subdir) && writefileatomic(entry, request.body) ? 201 : 500;
+    }
+    else
+    {
+        status = 405;
+    }
+
+    if (verbose)
+        std::cerr << request.method << " " << request.path << " " << status << std::endl;
+
+    writehttpresponse(fd, status, body, REQUESTTIMEOUT);
+}
+
+static void usage()
+{
+    std::cerr << "usage: wclang-cache-server [--listen=[<host>:]<port>] [--dir=<dir>] [--verbose]"
+              << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    std::string dir;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+
+        if (!std::strncmp(arg, "--listen=", 9))
+        {
+            const char *colon = std::strrchr(arg + 9, ':');
+
+            if (colon)
+            {
+                host.assign(arg + 9, colon);
+                port = colon + 1;
+            }
+            else
+            {
+                port = arg + 9;
+            }
+        }
+        else if (!std::strncmp(arg, "--dir=", 6))
+        {
+            dir = arg + 6;
+        }
+        else if (!std::strcmp(arg, "--verbose"))
+        {
+            verbose = true;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (dir.empty())
+    {
+        if (!getcachedir(dir))
+        {
+            std::cerr << "cannot determine the cache directory, use --dir" << std::endl;
+            return 1;
+        }
+
+        dir += "/remote";
+    }
+
+    if (!makedirectories(dir))
+    {
+        std::cerr << "cannot create " << dir << std::endl;
+        return 1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *result;
+    int listenfd = -1;
+    int one = 1;
+
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result))
+    {
+        std::cerr << "invalid address " << host << ":" << port << std::endl;
+        return 1;
+    }
+
+    for (struct addrinfo *ai = result; ai && listenfd == -1; ai = ai->ai_next)
+    {
+        listenfd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+        if (listenfd == -1)
+            continue;
+
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(listenfd, ai->ai_addr, ai->ai_addrlen) || listen(listenfd, 128))
+        {
+            close(listenfd);
+            listenfd = -1;
+        }
+    }
+
+    freeaddrinfo(result);
+
+    if (listenfd == -1)
+    {
+        std::cerr << "cannot listen on " << host << ":" << port << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    if (verbose)
+        std::cerr << "serving " << dir << " on " << host << ":" << port << std::endl;
+
+    /* one process per connection, reaped automatically */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true)
+    {
+        int clientfd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (clientfd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            std::cerr << "accept() failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+
+        pid_t pid = fork();
+
+        if (pid == 0)
+        {
+            close(listenfd);
+            handlerequest(clientfd, dir, verbose);
+            close(clientfd);
+            _exit(0);
+        }
+
+        if (pid == -1)
+            writehttpresponse(clientfd, 500, std::string(), REQUESTTIMEOUT);
+
+        close(clientfd);
+    }
+}
@@ -0,0 +1,313 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+/*
+ * wclang-client
+ *
+ * Minimal front end for wclangd, deliberately written in C so that
+ * starting it does not pull in libstdc++. It forwards argv, the
+ * working directory, the environment and its stdio descriptors to the
+ * daemon and executes the command the daemon sends back.
+ *
+ * If the daemon is not running (or asks for it), the regular wclang
+ * binary is executed instead, with the same argv.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifndef WCLANG_FALLBACK
+#define WCLANG_FALLBACK "wclang"
+#endif
+
+#define DAEMON_MAGIC 0x31444357u /* "WCD1" */
+
+enum {
+    DAEMON_REPLY_EXEC = 1,
+    DAEMON_REPLY_EXIT,
+    DAEMON_REPLY_FALLBACK
+};
+
+extern char **environ;
+
+static void fallback(char **argv)
+{
+    char path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - sizeof("wclang"));
+
+    if (len > 0)
+    {
+        char *p;
+
+        path[len] = '\0';
+
+        if ((p = strrchr(path, '/')))
+        {
+            strcpy(p + 1, "wclang");
+            execv(path, argv);
+        }
+    }
+
+    execvp(WCLANG_FALLBACK, argv);
+
+    fprintf(stderr, "wclang-client: cannot execute %s: %s\n",
+            WCLANG_FALLBACK, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int getsocketpath(struct sockaddr_un *addr)
+{
+    const char *p;
+    int n;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if ((p = getenv("WCLANG_DAEMON_SOCKET")) && *p)
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", p);
+    else if ((p = getenv("XDG_RUNTIME_DIR")) && *p)
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/wclangd.sock", p);
+    else
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/wclangd-%u.sock",
+                     (unsigned int)getuid());
+
+    return n > 0 && (size_t)n < sizeof(addr->sun_path);
+}
+
+static int writeall(int fd, const char *p, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+static int readall(int fd, char *p, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = read(fd, p, len);
+
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR) continue;
+            return 0;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+static size_t countstrings(char **strings, size_t *size)
+{
+    size_t n = 0;
+
+    for (; strings[n]; ++n)
+        *size += strlen(strings[n]) + 1;
+
+    return n;
+}
+
+static char *putstrings(char *p, char **strings)
+{
+    for (; *strings; ++strings)
+    {
+        size_t len = strlen(*strings) + 1;
+        memcpy(p, *strings, len);
+        p += len;
+    }
+
+    return p;
+}
+
+/*
+ * Splits 'count' NUL terminated strings into a NULL terminated vector
+ */
+static char **getstrings(char **p, char *end, unsigned int count)
+{
+    char **strings = malloc((count + 1) * sizeof(char*));
+    unsigned int i;
+
+    if (!strings)
+        return NULL;
+
+    for (i = 0; i < count; ++i)
+    {
+        char *s = *p;
+
+        while (*p < end && **p) ++*p;
+
+        if (*p >= end)
+            return NULL;
+
+        strings[i] = s;
+        ++*p;
+    }
+
+    strings[count] = NULL;
+    return strings;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    unsigned int header[4];
+    unsigned int reply[5];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    int fds[3] = { 0, 1, 2 };
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    size_t size = 0;
+    char *payload, *p;
+    const char *nodaemon;
+    int fd;
+
+    (void)argc;
+
+    if (((nodaemon = getenv("WCLANG_NO_DAEMON")) && *nodaemon != '0') ||
+        !getcwd(cwd, sizeof(cwd)) || !getsocketpath(&addr))
+    {
+        fallback(argv);
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        fallback(argv);
+    }
+
+    /*
+     * Request: magic, argc, envc, payload size,
+     * payload: cwd, argv and environ as NUL terminated strings
+     */
+
+    size = strlen(cwd) + 1;
+
+    header[0] = DAEMON_MAGIC;
+    header[1] = countstrings(argv, &size);
+    header[2] = countstrings(environ, &size);
+    header[3] = size;
+
+    if (!(payload = malloc(size)))
+        fallback(argv);
+
+    p = payload;
+    memcpy(p, cwd, strlen(cwd) + 1);
+    p = putstrings(p + strlen(cwd) + 1, argv);
+    putstrings(p, environ);
+
+    /*
+     * Pass our stdin, stdout and stderr along with the header,
+     * so messages printed by the daemon show up where expected
+     */
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header) || !writeall(fd, payload, size))
+        fallback(argv);
+
+    free(payload);
+
+    /*
+     * Reply: type, exit status, argc, envc, payload size,
+     * payload: argv and environ as NUL terminated strings
+     */
+
+    if (!readall(fd, (char*)reply, sizeof(reply)))
+        fallback(argv);
+
+    switch (reply[0])
+    {
+        case DAEMON_REPLY_EXEC:
+        {
+            char **args, **env;
+            char *end;
+
+            if (!reply[2] || !(payload = malloc(reply[4] + 1)) ||
+                !readall(fd, payload, reply[4]))
+            {
+                fallback(argv);
+            }
+
+            p = payload;
+            end = payload + reply[4];
+
+            if (!(args = getstrings(&p, end, reply[2])) ||
+                !(env = getstrings(&p, end, reply[3])))
+            {
+                fallback(argv);
+            }
+
+            close(fd);
+
+            environ = env;
+            execvp(args[0], args);
+
+            fprintf(stderr, "invoking compiler failed\n%s not installed?\n", args[0]);
+            return 1;
+        }
+        case DAEMON_REPLY_EXIT:
+            return (int)reply[1];
+        default:
+            close(fd);
+            fallback(argv);
+    }
+
+    return 1;
+}
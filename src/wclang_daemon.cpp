@@ -0,0 +1,638 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_daemon.h"
+#include "wclang_process.h"
+
+extern char **environ;
+
+/*
+ * Write end of the pipe to the daemon (daemon child only)
+ */
+static int childpipe = -1;
+
+static bool writeall(int fd, const void *data, size_t len)
+{
+    const char *p = static_cast<const char*>(data);
+
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+
+        if (n == -1)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool readall(int fd, void *data, size_t len)
+{
+    char *p = static_cast<char*>(data);
+
+    while (len)
+    {
+        ssize_t n = read(fd, p, len);
+
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR) continue;
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static void putu32(std::string &data, unsigned int val)
+{
+    data.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+static unsigned int getu32(const char *p)
+{
+    unsigned int val;
+    std::memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static void putstrings(std::string &data, char **strings)
+{
+    for (char **p = strings; *p; ++p)
+    {
+        data += *p;
+        data += '\0';
+    }
+}
+
+static size_t countstrings(char **strings)
+{
+    size_t n = 0;
+    while (strings[n]) ++n;
+    return n;
+}
+
+/*
+ * Splits NUL terminated strings, returns false
+ * if there are fewer than 'count' strings
+ */
+static bool getstrings(const char *&p, const char *end, size_t count,
+                       string_vector &strings)
+{
+    while (count--)
+    {
+        const char *s = p;
+
+        while (p < end && *p) ++p;
+
+        if (p >= end)
+            return false;
+
+        strings.push_back(std::string(s, p));
+        ++p;
+    }
+
+    return true;
+}
+
+bool getdaemonsocketpath(std::string &path)
+{
+    const char *p;
+
+    if ((p = getenv("WCLANG_DAEMON_SOCKET")) && *p)
+    {
+        path = p;
+    }
+    else if ((p = getenv("XDG_RUNTIME_DIR")) && *p)
+    {
+        path = p;
+        path += "/wclangd.sock";
+    }
+    else
+    {
+        path = "/tmp/wclangd-";
+        path += std::to_string(getuid());
+        path += ".sock";
+    }
+
+    return path.size() < sizeof(sockaddr_un::sun_path);
+}
+
+/*
+ * Daemon child side
+ */
+
+static void sendrecord(char type, const std::string &data)
+{
+    std::string record;
+
+    record += type;
+    putu32(record, data.size());
+    record += data;
+
+    writeall(childpipe, record.c_str(), record.size());
+}
+
+static void publishdiscovery(const std::string &data)
+{
+    sendrecord('D', data);
+}
+
+bool isdaemonchild()
+{
+    return childpipe != -1;
+}
+
+int daemonexec(char **cargs)
+{
+    std::string data;
+
+    putu32(data, countstrings(cargs));
+    putu32(data, countstrings(environ));
+    putstrings(data, cargs);
+    putstrings(data, environ);
+
+    sendrecord('X', data);
+    return 0;
+}
+
+int daemonfallback()
+{
+    sendrecord('F', std::string());
+    return 0;
+}
+
+/*
+ * Daemon
+ */
+
+#ifdef __linux__
+
+static volatile sig_atomic_t terminate = 0;
+
+static void onterminate(int)
+{
+    terminate = 1;
+}
+
+struct daemonrequest {
+    pid_t pid;
+    int clientfd;
+    int pipefd;
+    std::string records;
+};
+
+static void sendreply(int fd, unsigned int type, unsigned int status,
+                      const std::string &execdata = std::string())
+{
+    std::string reply;
+
+    putu32(reply, type);
+    putu32(reply, status);
+
+    if (execdata.size() >= 2 * sizeof(unsigned int))
+    {
+        reply.append(execdata, 0, 2 * sizeof(unsigned int)); /* argc, envc */
+        putu32(reply, execdata.size() - 2 * sizeof(unsigned int));
+        reply.append(execdata, 2 * sizeof(unsigned int), std::string::npos);
+    }
+    else
+    {
+        putu32(reply, 0);
+        putu32(reply, 0);
+        putu32(reply, 0);
+    }
+
+    writeall(fd, reply.c_str(), reply.size());
+}
+
+int daemonmain(int argc, char **argv, wclangmainfun wclangmain)
+{
+    std::string socketpath;
+    bool verbose = false;
+    discoverymap memory;
+    std::vector<daemonrequest> requests;
+    sockaddr_un addr;
+    int listenfd, inotifyfd;
+
+    constexpr unsigned int WATCHMASK = IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                       IN_DELETE_SELF | IN_MODIFY |
+                                       IN_MOVE_SELF | IN_MOVED_FROM |
+                                       IN_MOVED_TO;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+
+        if (!std::strncmp(arg, "--socket=", STRLEN("--socket=")))
+        {
+            socketpath = arg + STRLEN("--socket=");
+        }
+        else if (!std::strcmp(arg, "--verbose"))
+        {
+            verbose = true;
+        }
+        else
+        {
+            std::cerr << "usage: wclangd [--socket=<path>] [--verbose]" << std::endl;
+            return !!std::strcmp(arg, "--help");
+        }
+    }
+
+    if (socketpath.empty() && !getdaemonsocketpath(socketpath))
+    {
+        std::cerr << "wclangd: socket path too long" << std::endl;
+        return 1;
+    }
+
+    if (socketpath.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "wclangd: socket path too long" << std::endl;
+        return 1;
+    }
+
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socketpath.c_str());
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listenfd == -1)
+    {
+        std::cerr << "wclangd: socket() failed: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    /*
+     * Replace stale sockets, but do not steal
+     * the socket of a running daemon
+     */
+
+    if (!connect(listenfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+    {
+        std::cerr << "wclangd: already running on " << socketpath << std::endl;
+        return 1;
+    }
+
+    close(listenfd);
+    unlink(socketpath.c_str());
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    mode_t oldmask = umask(0077);
+
+    if (listenfd == -1 || bind(listenfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+        listen(listenfd, 128))
+    {
+        std::cerr << "wclangd: cannot listen on " << socketpath << ": "
+                  << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    umask(oldmask);
+
+    if ((inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    {
+        std::cerr << "wclangd: inotify_init1() failed: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, onterminate);
+    signal(SIGINT, onterminate);
+
+    if (verbose)
+        std::cerr << "wclangd: listening on " << socketpath << std::endl;
+
+    auto invalidate = [&]()
+    {
+        if (verbose && !memory.empty())
+            std::cerr << "wclangd: toolchain changed, dropping "
+                      << memory.size() << " entries" << std::endl;
+
+        memory.clear();
+
+        /* drops all watches at once */
+        close(inotifyfd);
+        inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    };
+
+    auto adddiscovery = [&](const std::string &data)
+    {
+        std::string key;
+        discoveryentry entry;
+
+        if (!parsediscovery(data, key, entry))
+            return;
+
+        for (const auto &dep : entry.deps)
+        {
+            if (inotify_add_watch(inotifyfd, dep.path.c_str(), WATCHMASK) == -1)
+                return;
+        }
+
+        /*
+         * The entry may have changed before
+         * the watches were in place
+         */
+
+        if (checkdeps(entry.deps))
+            memory[key] = data;
+    };
+
+    /*
+     * Runs in the forked child, a client that is slow to
+     * send its request only stalls its own child
+     */
+    auto runrequest = [&](int clientfd) -> int
+    {
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        unsigned int header[4];
+        int fds[3] = { -1, -1, -1 };
+        iovec iov = { header, sizeof(header) };
+        msghdr msg;
+        timeval timeout = { 5, 0 };
+        std::string payload;
+        string_vector strings;
+        std::vector<char*> args;
+
+        setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(clientfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+            {
+                std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            }
+        }
+
+        if (n != sizeof(header) || header[0] != DAEMON_MAGIC ||
+            fds[0] == -1 || header[3] > 64 * 1024 * 1024)
+        {
+            sendrecord('C', std::string());
+            return EXIT_FAILURE;
+        }
+
+        payload.resize(header[3]);
+
+        const char *p = &payload[0];
+        const char *end = p + payload.size();
+
+        if (!readall(clientfd, &payload[0], payload.size()) ||
+            !getstrings(p, end, 1 + header[1] + header[2], strings) || !header[1])
+        {
+            sendrecord('C', std::string());
+            return EXIT_FAILURE;
+        }
+
+        close(clientfd);
+
+        if (verbose)
+            std::cerr << "wclangd: request: " << strings[1] << std::endl;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+
+        if (chdir(strings[0].c_str()))
+        {
+            std::cerr << "wclangd: cannot change directory to "
+                      << strings[0] << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        clearenv();
+
+        for (size_t i = 1 + header[1]; i < strings.size(); ++i)
+            putenv(strdup(strings[i].c_str()));
+
+        for (size_t i = 1; i <= header[1]; ++i)
+            args.push_back(strdup(strings[i].c_str()));
+
+        args.push_back(nullptr);
+
+        setdiscoverymemory(&memory, publishdiscovery);
+
+        return wclangmain(args.size() - 1, &args[0]);
+    };
+
+    auto handlerequest = [&](int clientfd)
+    {
+        ucred cred;
+        socklen_t credlen = sizeof(cred);
+        int pipefd[2];
+        pid_t pid;
+
+        if (getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ||
+            cred.uid != getuid())
+        {
+            close(clientfd);
+            return;
+        }
+
+        if (pipe2(pipefd, O_CLOEXEC) || (pid = fork()) == -1)
+        {
+            sendreply(clientfd, DAEMON_REPLY_FALLBACK, 0);
+            close(clientfd);
+            return;
+        }
+
+        if (pid == 0)
+        {
+            close(listenfd);
+            close(inotifyfd);
+            close(pipefd[0]);
+
+            signal(SIGPIPE, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+
+            childpipe = pipefd[1];
+
+            std::exit(runrequest(clientfd));
+        }
+
+        close(pipefd[1]);
+
+        daemonrequest request;
+        request.pid = pid;
+        request.clientfd = clientfd;
+        request.pipefd = pipefd[0];
+        requests.push_back(request);
+    };
+
+    auto finishrequest = [&](daemonrequest &request)
+    {
+        int status = 0;
+        const char *p = request.records.c_str();
+        const char *end = p + request.records.size();
+        bool replied = false;
+
+        while (waitpid(request.pid, &status, 0) == -1 && errno == EINTR);
+
+        while (end - p >= 1 + (ssize_t)sizeof(unsigned int))
+        {
+            char type = *p++;
+            size_t len = getu32(p);
+            p += sizeof(unsigned int);
+
+            if ((size_t)(end - p) < len)
+                break;
+
+            std::string data(p, len);
+            p += len;
+
+            switch (type)
+            {
+                case 'D': adddiscovery(data); break;
+                case 'X':
+                {
+                    sendreply(request.clientfd, DAEMON_REPLY_EXEC, 0, data);
+                    replied = true;
+                    break;
+                }
+                case 'F':
+                {
+                    sendreply(request.clientfd, DAEMON_REPLY_FALLBACK, 0);
+                    replied = true;
+                    break;
+                }
+                case 'C': replied = true; break; /* malformed request */
+            }
+        }
+
+        if (!replied)
+        {
+            sendreply(request.clientfd, DAEMON_REPLY_EXIT, decodestatus(status));
+        }
+
+        close(request.clientfd);
+        close(request.pipefd);
+    };
+
+    while (!terminate)
+    {
+        std::vector<pollfd> pfds;
+
+        pfds.push_back({ listenfd, POLLIN, 0 });
+        pfds.push_back({ inotifyfd, POLLIN, 0 });
+
+        for (const auto &request : requests)
+            pfds.push_back({ request.pipefd, POLLIN, 0 });
+
+        if (poll(&pfds[0], pfds.size(), -1) == -1)
+        {
+            if (errno == EINTR) continue;
+            std::cerr << "wclangd: poll() failed: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        if (pfds[1].revents)
+            invalidate();
+
+        for (size_t i = requests.size(); i-- > 0;)
+        {
+            if (!pfds[2 + i].revents)
+                continue;
+
+            char buf[4096];
+            ssize_t n = read(requests[i].pipefd, buf, sizeof(buf));
+
+            if (n > 0)
+            {
+                requests[i].records.append(buf, n);
+                continue;
+            }
+
+            if (n == -1 && errno == EINTR)
+                continue;
+
+            finishrequest(requests[i]);
+            requests.erase(requests.begin() + i);
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            int clientfd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+
+            if (clientfd != -1)
+                handlerequest(clientfd);
+        }
+    }
+
+    for (auto &request : requests)
+        finishrequest(request);
+
+    close(listenfd);
+    unlink(socketpath.c_str());
+
+    if (verbose)
+        std::cerr << "wclangd: terminated" << std::endl;
+
+    return 0;
+}
+
+#else
+
+int daemonmain(int, char **, wclangmainfun)
+{
+    std::cerr << "wclangd: not supported on this platform (requires inotify)"
+              << std::endl;
+    return 1;
+}
+
+#endif /* __linux__ */
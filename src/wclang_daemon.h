@@ -0,0 +1,28 @@
+/*
+ * wclangd
+ *
+ * The daemon listens on a unix socket for requests sent by
+ * wclang-client (argv, cwd, env and the stdio descriptors).
+ * Every request is handled by a forked child running the regular
+ * wclang code path; the resolved compiler command is sent back and
+ * executed by the client. Discovery results are kept in memory and
+ * dropped as soon as inotify reports a change to one of their
+ * dependencies.
+ */
+
+typedef int (*wclangmainfun)(int argc, char **argv);
+
+enum {
+    DAEMON_REPLY_EXEC = 1,
+    DAEMON_REPLY_EXIT,
+    DAEMON_REPLY_FALLBACK
+};
+
+constexpr unsigned int DAEMON_MAGIC = 0x31444357; /* "WCD1" */
+
+bool getdaemonsocketpath(std::string &path);
+int daemonmain(int argc, char **argv, wclangmainfun wclangmain);
+
+bool isdaemonchild();
+int daemonexec(char **cargs);
+int daemonfallback();
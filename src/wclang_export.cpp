@@ -0,0 +1,337 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <map>
+#include "wclang.h"
+#include "wclang_export.h"
+
+bool istoolchainformat(const char *format)
+{
+    return !std::strcmp(format, "cmake") || !std::strcmp(format, "meson") ||
+           !std::strcmp(format, "json");
+}
+
+/*
+ * Resolves the ENVVARS tools (AR=<target>-ar or the LLVM tools) to
+ * full paths, tools the installation does not provide are left out
+ */
+static std::map<std::string, std::string> findtools(const toolchaininfo &info)
+{
+    std::map<std::string, std::string> tools;
+
+    for (const auto &var : info.env)
+    {
+        size_t pos = var.find('=');
+
+        if (pos == std::string::npos)
+            continue;
+
+        std::string tool = var.substr(pos+1);
+
+        /* tools which need arguments (llvm-dlltool -m ...) */
+        if (tool.find(' ') != std::string::npos)
+            continue;
+
+        std::string path = tool[0] == PATHDIV ? tool : info.toolpath + PATHDIV + tool;
+
+        if (fileexists(path.c_str()))
+            tools[var.substr(0, pos)] = path;
+    }
+
+    return tools;
+}
+
+/*
+ * Returns the processor of 'target' or its family (x86),
+ * an empty string if it is unknown
+ */
+static std::string getarch(const std::string &target, bool family)
+{
+    std::string arch = target.substr(0, target.find('-'));
+
+    if (arch == "x86_64" || arch == "amd64")
+        return "x86_64";
+
+    if (arch.size() == 4 && arch[0] == 'i' && !arch.compare(2, 2, "86"))
+        return family ? "x86" : arch;
+
+    return std::string();
+}
+
+/*
+ * CMake
+ */
+
+static std::string cmakeflags(const string_vector &flags)
+{
+    std::string result;
+
+    for (const auto &flag : flags)
+    {
+        if (!result.empty())
+            result += ' ';
+
+        bool quote = flag.find_first_of(" \t") != std::string::npos;
+
+        if (quote)
+            result += "\\\"";
+
+        for (char c : flag)
+        {
+            if (c == '"' || c == '\\' || c == '$')
+                result += '\\';
+
+            result += c;
+        }
+
+        if (quote)
+            result += "\\\"";
+    }
+
+    return result;
+}
+
+static void exportcmake(const toolchaininfo &info, std::ostream &out)
+{
+    static constexpr const char *TOOLS[][2] = {
+        { "AR", "CMAKE_AR" }, { "RANLIB", "CMAKE_RANLIB" },
+        { "STRIP", "CMAKE_STRIP" }, { "NM", "CMAKE_NM" },
+        { "OBJCOPY", "CMAKE_OBJCOPY" }, { "OBJDUMP", "CMAKE_OBJDUMP" },
+        { "READELF", "CMAKE_READELF" }, { "DLLTOOL", "CMAKE_DLLTOOL" },
+        { "LD", "CMAKE_LINKER" }, { "WINDRES", "CMAKE_RC_COMPILER" }
+    };
+
+    auto tools = findtools(info);
+    std::string arch = getarch(info.target, false);
+    std::string linkerflags = cmakeflags(info.linkerflags);
+    bool first = true;
+
+    out << "# generated by " VERSION " for " << info.target << "\n";
+    out << "# clang finds the mingw linker through PATH, which must contain "
+        << info.toolpath << "\n\n";
+
+    out << "set(CMAKE_SYSTEM_NAME Windows)\n";
+
+    if (!arch.empty())
+        out << "set(CMAKE_SYSTEM_PROCESSOR " << arch << ")\n";
+
+    out << "\nset(CMAKE_C_COMPILER \"" << info.cc << "\")\n";
+    out << "set(CMAKE_CXX_COMPILER \"" << info.cxx << "\")\n\n";
+
+    out << "set(CMAKE_C_FLAGS_INIT \"" << cmakeflags(info.cflags) << "\")\n";
+    out << "set(CMAKE_CXX_FLAGS_INIT \"" << cmakeflags(info.cxxflags) << "\")\n";
+
+    if (!info.cxxoptflags.empty())
+    {
+        for (const char *config : { "RELEASE", "RELWITHDEBINFO", "MINSIZEREL" })
+        {
+            out << "set(CMAKE_CXX_FLAGS_" << config << "_INIT \""
+                << cmakeflags(info.cxxoptflags) << "\")\n";
+        }
+    }
+
+    out << "\n";
+
+    for (const char *type : { "EXE", "SHARED", "MODULE" })
+        out << "set(CMAKE_" << type << "_LINKER_FLAGS_INIT \"" << linkerflags << "\")\n";
+
+    for (const auto &tool : TOOLS)
+    {
+        auto it = tools.find(tool[0]);
+
+        if (it == tools.end())
+            continue;
+
+        out << (first ? "\n" : "") << "set(" << tool[1] << " \"" << it->second << "\")\n";
+        first = false;
+    }
+
+    if (!info.sysroot.empty())
+    {
+        out << "\nset(CMAKE_FIND_ROOT_PATH \"" << info.sysroot << "\")\n";
+        out << "set(CMAKE_FIND_ROOT_PATH_MODE_PROGRAM NEVER)\n";
+        out << "set(CMAKE_FIND_ROOT_PATH_MODE_LIBRARY ONLY)\n";
+        out << "set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ONLY)\n";
+        out << "set(CMAKE_FIND_ROOT_PATH_MODE_PACKAGE ONLY)\n";
+    }
+}
+
+/*
+ * Meson
+ */
+
+static std::string mesonstring(const std::string &str)
+{
+    std::string result = "'";
+
+    for (char c : str)
+    {
+        if (c == '\'' || c == '\\')
+            result += '\\';
+
+        result += c;
+    }
+
+    return result + "'";
+}
+
+static std::string mesonarray(const string_vector &values)
+{
+    std::string result = "[";
+
+    for (const auto &value : values)
+    {
+        if (result.size() > 1)
+            result += ", ";
+
+        result += mesonstring(value);
+    }
+
+    return result + "]";
+}
+
+static void exportmeson(const toolchaininfo &info, std::ostream &out)
+{
+    static constexpr const char *TOOLS[][2] = {
+        { "AR", "ar" }, { "RANLIB", "ranlib" }, { "STRIP", "strip" },
+        { "NM", "nm" }, { "OBJCOPY", "objcopy" }, { "OBJDUMP", "objdump" },
+        { "READELF", "readelf" }, { "DLLTOOL", "dlltool" },
+        { "WINDRES", "windres" }
+    };
+
+    auto tools = findtools(info);
+    std::string cpu = getarch(info.target, false);
+
+    /*
+     * Meson has no per-buildtype arguments, the optimization
+     * dependent flags are used unconditionally
+     */
+    string_vector cxxflags = info.cxxflags;
+    cxxflags.insert(cxxflags.end(), info.cxxoptflags.begin(), info.cxxoptflags.end());
+
+    /*
+     * The injected flags are passed when linking as well, like wclang does
+     */
+    string_vector clinkflags = info.linkerflags;
+    string_vector cxxlinkflags = info.linkerflags;
+    clinkflags.insert(clinkflags.end(), info.cflags.begin(), info.cflags.end());
+    cxxlinkflags.insert(cxxlinkflags.end(), info.cxxflags.begin(), info.cxxflags.end());
+
+    out << "# generated by " VERSION " for " << info.target << "\n";
+    out << "# clang finds the mingw linker through PATH, which must contain "
+        << info.toolpath << "\n\n";
+
+    out << "[binaries]\n";
+    out << "c = " << mesonstring(info.cc) << "\n";
+    out << "cpp = " << mesonstring(info.cxx) << "\n";
+
+    for (const auto &tool : TOOLS)
+    {
+        auto it = tools.find(tool[0]);
+
+        if (it != tools.end())
+            out << tool[1] << " = " << mesonstring(it->second) << "\n";
+    }
+
+    out << "\n[host_machine]\n";
+    out << "system = 'windows'\n";
+
+    if (!cpu.empty())
+    {
+        out << "cpu_family = '" << getarch(info.target, true) << "'\n";
+        out << "cpu = '" << cpu << "'\n";
+    }
+
+    out << "endian = 'little'\n";
+
+    out << "\n[built-in options]\n";
+    out << "c_args = " << mesonarray(info.cflags) << "\n";
+    out << "cpp_args = " << mesonarray(cxxflags) << "\n";
+    out << "c_link_args = " << mesonarray(clinkflags) << "\n";
+    out << "cpp_link_args = " << mesonarray(cxxlinkflags) << "\n";
+}
+
+/*
+ * JSON
+ */
+
+static std::string jsonarray(const string_vector &values)
+{
+    std::string result = "[";
+
+    for (const auto &value : values)
+    {
+        if (result.size() > 1)
+            result += ", ";
+
+        result += jsonstring(value);
+    }
+
+    return result + "]";
+}
+
+static void exportjson(const toolchaininfo &info, std::ostream &out)
+{
+    auto tools = findtools(info);
+    const char *path = getenvvar("PATH");
+    bool first = true;
+
+    out << "{\n";
+    out << "  \"target\": " << jsonstring(info.target) << ",\n";
+    out << "  \"c_compiler\": " << jsonstring(info.cc) << ",\n";
+    out << "  \"cxx_compiler\": " << jsonstring(info.cxx) << ",\n";
+    out << "  \"c_flags\": " << jsonarray(info.cflags) << ",\n";
+    out << "  \"cxx_flags\": " << jsonarray(info.cxxflags) << ",\n";
+    out << "  \"cxx_optimized_flags\": " << jsonarray(info.cxxoptflags) << ",\n";
+    out << "  \"linker_flags\": " << jsonarray(info.linkerflags) << ",\n";
+    out << "  \"sysroot\": " << jsonstring(info.sysroot) << ",\n";
+    out << "  \"tools\": {";
+
+    for (const auto &tool : tools)
+    {
+        out << (first ? "\n" : ",\n") << "    " << jsonstring(tool.first)
+            << ": " << jsonstring(tool.second);
+        first = false;
+    }
+
+    out << (first ? "},\n" : "\n  },\n");
+    out << "  \"env\": {\n";
+    out << "    \"PATH\": " << jsonstring(path ? path : "") << "\n";
+    out << "  }\n";
+    out << "}\n";
+}
+
+int exporttoolchain(const toolchaininfo &info)
+{
+    std::ostream &out = outstream();
+
+    if (!std::strcmp(info.format, "cmake"))
+        exportcmake(info, out);
+    else if (!std::strcmp(info.format, "meson"))
+        exportmeson(info, out);
+    else
+        exportjson(info, out);
+
+    out.flush();
+
+    return out ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,24 @@
+/*
+ * Toolchain export (-wc-export-toolchain=<format>)
+ *
+ * Writes a CMake toolchain file, a Meson cross file or a JSON
+ * description that invokes clang directly with the flags wclang
+ * would inject, so that builds can bypass the wrapper.
+ */
+
+struct toolchaininfo {
+    const char *format;
+    std::string target;
+    std::string cc;
+    std::string cxx;
+    string_vector cflags;
+    string_vector cxxflags;
+    string_vector cxxoptflags; /* -O1 and higher only */
+    string_vector linkerflags;
+    string_vector env;         /* ENVVARS, e.g. AR=<target>-ar */
+    std::string toolpath;      /* directory of the mingw tools */
+    std::string sysroot;
+};
+
+bool istoolchainformat(const char *format);
+int exporttoolchain(const toolchaininfo &info);
@@ -0,0 +1,162 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <algorithm>
+#include "wclang_hash.h"
+
+static constexpr uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+sha256::sha256() : length(), buffered()
+{
+    static constexpr uint32_t INIT[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    std::memcpy(state, INIT, sizeof(state));
+}
+
+void sha256::transform(const unsigned char *block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t)block[i*4] << 24 | (uint32_t)block[i*4+1] << 16 |
+               (uint32_t)block[i*4+2] << 8 | (uint32_t)block[i*4+3];
+    }
+
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + K[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256::update(const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+
+    length += len;
+
+    if (buffered)
+    {
+        size_t n = std::min(len, sizeof(buffer) - buffered);
+
+        std::memcpy(buffer + buffered, p, n);
+        buffered += n;
+        p += n;
+        len -= n;
+
+        if (buffered < sizeof(buffer))
+            return;
+
+        transform(buffer);
+        buffered = 0;
+    }
+
+    for (; len >= sizeof(buffer); p += sizeof(buffer), len -= sizeof(buffer))
+        transform(p);
+
+    std::memcpy(buffer, p, len);
+    buffered = len;
+}
+
+void sha256::update(const std::string &str)
+{
+    update(str.c_str(), str.size());
+}
+
+void sha256::updatestring(const std::string &str)
+{
+    uint64_t len = str.size();
+    update(&len, sizeof(len));
+    update(str);
+}
+
+std::string sha256::hexdigest()
+{
+    static constexpr char HEX[] = "0123456789abcdef";
+    unsigned char pad[72] = { 0x80 };
+    uint64_t bits = length * 8;
+    size_t padlen = (buffered < 56 ? 56 : 120) - buffered;
+    std::string digest;
+
+    for (int i = 0; i < 8; ++i)
+        pad[padlen + i] = (unsigned char)(bits >> (56 - i * 8));
+
+    update(pad, padlen + 8);
+
+    for (uint32_t s : state)
+    {
+        for (int i = 24; i >= 0; i -= 8)
+        {
+            unsigned char c = (unsigned char)(s >> i);
+            digest += HEX[c >> 4];
+            digest += HEX[c & 15];
+        }
+    }
+
+    return digest;
+}
+
+std::string sha256string(const std::string &data)
+{
+    sha256 hash;
+    hash.update(data);
+    return hash.hexdigest();
+}
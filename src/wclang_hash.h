@@ -0,0 +1,31 @@
+#include <string>
+#include <cstdint>
+
+/*
+ * SHA-256, used for content addressed cache entries
+ */
+
+struct sha256 {
+    sha256();
+
+    void update(const void *data, size_t len);
+    void update(const std::string &str);
+
+    /*
+     * Adds a string including its length, so that
+     * ("ab", "c") and ("a", "bc") hash differently
+     */
+    void updatestring(const std::string &str);
+
+    std::string hexdigest();
+
+private:
+    void transform(const unsigned char *block);
+
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t buffered;
+};
+
+std::string sha256string(const std::string &data);
@@ -0,0 +1,302 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_hmap.h"
+
+static constexpr char HMAPDIR[] = "/hmap";
+static constexpr char DEPSMAGIC[] = "wclang-hmap 1";
+
+/*
+ * Limits the recursion into (possibly cyclic) symlinked directories
+ */
+static constexpr int MAXDEPTH = 8;
+
+/*
+ * clang/Lex/HeaderMapTypes.h
+ */
+
+static constexpr uint32_t HMAP_HEADERMAGIC = ('h' << 24) | ('m' << 16) | ('a' << 8) | 'p';
+static constexpr uint16_t HMAP_HEADERVERSION = 1;
+
+struct hmapbucket {
+    uint32_t key;    /* offsets into the string table, 0 = empty */
+    uint32_t prefix;
+    uint32_t suffix;
+};
+
+struct hmapheader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t stringsoffset;
+    uint32_t numentries;
+    uint32_t numbuckets;     /* power of two */
+    uint32_t maxvaluelength;
+};
+
+static_assert(sizeof(hmapbucket) == 12 && sizeof(hmapheader) == 24, "");
+
+struct hmapentry {
+    std::string key;
+    std::string prefix;
+    bool duplicate;
+};
+
+/* keys are case insensitive */
+typedef std::map<std::string, hmapentry> hmapentries;
+
+bool useheadermap()
+{
+    const char *p;
+    return (p = getenvvar("WCLANG_HEADER_MAP")) && *p == '1';
+}
+
+static std::string tolowercase(const std::string &str)
+{
+    std::string result = str;
+
+    for (char &c : result)
+        c = tolower(c);
+
+    return result;
+}
+
+/*
+ * clang's HashHMapKey()
+ */
+static uint32_t hashkey(const std::string &key)
+{
+    uint32_t hash = 0;
+
+    for (char c : key)
+        hash += tolower(c) * 13;
+
+    return hash;
+}
+
+/*
+ * Adds the headers below 'dir' to 'entries', 'stable' is cleared
+ * if a directory changed too recently to be recorded
+ */
+static void scanheaders(int dirfd, const std::string &base, const std::string &subdir,
+                        int depth, hmapentries &entries, cachedep_vector &deps,
+                        bool &stable)
+{
+    std::string dir = subdir.empty() ? base : base + PATHDIV + subdir;
+
+    if (!adddirectorydep(dirfd, dir, deps))
+        stable = false;
+
+    scandirectory(dirfd, [&](const char *name)
+    {
+        struct stat st;
+
+        if (*name == '.' || fstatat(dirfd, name, &st, 0))
+            return;
+
+        std::string key = subdir.empty() ? name : subdir + PATHDIV + name;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            int subdirfd;
+
+            if (depth < MAXDEPTH && (subdirfd = opendirectory(name, dirfd)) != -1)
+            {
+                scanheaders(subdirfd, base, key, depth+1, entries, deps, stable);
+                close(subdirfd);
+            }
+            return;
+        }
+
+        if (!S_ISREG(st.st_mode))
+            return;
+
+        auto result = entries.insert(std::make_pair(tolowercase(key), hmapentry()));
+        hmapentry &entry = result.first->second;
+
+        if (!result.second)
+        {
+            entry.duplicate = true;
+            return;
+        }
+
+        entry.key = key;
+        entry.prefix = base + PATHDIV;
+        entry.duplicate = false;
+    });
+}
+
+static std::string buildheadermap(const hmapentries &entries)
+{
+    std::string strings(1, '\0'); /* offset 0 marks empty buckets */
+    std::vector<hmapbucket> buckets;
+    hmapheader header;
+    uint32_t numentries = 0;
+    uint32_t numbuckets = 8;
+    uint32_t maxvaluelength = 0;
+
+    for (const auto &entry : entries)
+        numentries += !entry.second.duplicate;
+
+    /* keep at least half of the buckets empty */
+    while (numbuckets < numentries * 2)
+        numbuckets *= 2;
+
+    buckets.resize(numbuckets, hmapbucket());
+
+    auto addstring = [&](const std::string &str) -> uint32_t
+    {
+        uint32_t offset = strings.size();
+        strings += str;
+        strings += '\0';
+        return offset;
+    };
+
+    for (const auto &e : entries)
+    {
+        const hmapentry &entry = e.second;
+
+        if (entry.duplicate)
+            continue;
+
+        uint32_t bucket = hashkey(entry.key);
+
+        while (buckets[bucket & (numbuckets-1)].key)
+            ++bucket;
+
+        hmapbucket &b = buckets[bucket & (numbuckets-1)];
+
+        b.key = addstring(entry.key);
+        b.prefix = addstring(entry.prefix);
+        b.suffix = addstring(entry.key);
+
+        maxvaluelength = std::max<uint32_t>(maxvaluelength, entry.prefix.size() + entry.key.size());
+    }
+
+    header.magic = HMAP_HEADERMAGIC;
+    header.version = HMAP_HEADERVERSION;
+    header.reserved = 0;
+    header.stringsoffset = sizeof(header) + numbuckets * sizeof(hmapbucket);
+    header.numentries = numentries;
+    header.numbuckets = numbuckets;
+    header.maxvaluelength = maxvaluelength;
+
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(buckets.data()), numbuckets * sizeof(hmapbucket));
+    data += strings;
+
+    return data;
+}
+
+std::string getheadermap(const string_vector &dirs, bool verbose)
+{
+    std::string dir;
+    std::string key;
+    cachedep_vector deps;
+
+    if (dirs.empty() || !getcachedir(dir))
+        return std::string();
+
+    for (const auto &d : dirs)
+    {
+        key += d;
+        key += '\n';
+    }
+
+    dir += HMAPDIR;
+
+    std::string base = dir + PATHDIV + hashtostring(fnv1a64(key));
+    std::string hmap = base + ".hmap";
+    std::string depsfile = base + ".deps";
+
+    /*
+     * The map is written before its dependencies,
+     * valid dependencies imply a complete map
+     */
+
+    if (loaddeps(depsfile, DEPSMAGIC, deps) && checkdeps(deps))
+        return hmap;
+
+    hmapentries entries;
+    bool stable = true;
+
+    deps.clear();
+
+    for (const auto &d : dirs)
+    {
+        int dirfd = opendirectory(d.c_str());
+
+        if (dirfd == -1)
+            continue;
+
+        scanheaders(dirfd, d, std::string(), 0, entries, deps, stable);
+        close(dirfd);
+    }
+
+    if (!makedirectories(dir))
+        return std::string();
+
+    unlink(depsfile.c_str());
+
+    if (!writefileatomic(hmap, buildheadermap(entries)))
+        return std::string();
+
+    if (stable)
+        storedeps(depsfile, DEPSMAGIC, deps);
+
+    if (verbose)
+        verbosemsg("generated header map % (% headers)", hmap, entries.size());
+
+    return hmap;
+}
+
+size_t clearheadermaps()
+{
+    std::string dir;
+    string_vector files;
+    size_t n = 0;
+
+    if (!getcachedir(dir))
+        return 0;
+
+    dir += HMAPDIR;
+
+    if (!listfiles(dir.c_str(), &files))
+        return 0;
+
+    for (const auto &file : files)
+    {
+        if (file.size() > 5 && !file.compare(file.size()-5, 5, ".hmap"))
+            ++n;
+
+        unlink((dir + PATHDIV + file).c_str());
+    }
+
+    return n;
+}
@@ -0,0 +1,26 @@
+/*
+ * Header maps (-wc-header-map, $WCLANG_HEADER_MAP=1)
+ *
+ * Indexes every header below the intrinsics, C++ and C include
+ * directories in a clang header map (.hmap), which is passed with
+ * -isystem ahead of the directories. An #include then costs a single
+ * hash lookup instead of a failed lookup in every directory before
+ * the one holding the header.
+ *
+ * Headers that exist in more than one directory are left out, so
+ * that the #include_next chains of the clang and libstdc++ wrapper
+ * headers (stdlib.h, stdint.h, ...) still walk the directories.
+ *
+ * The map is cached below <cachedir>/hmap and regenerated once one
+ * of the indexed directories changes.
+ */
+
+bool useheadermap();
+
+/*
+ * Returns the header map for 'dirs' (in search order)
+ * or an empty string if it cannot be created
+ */
+std::string getheadermap(const string_vector &dirs, bool verbose);
+
+size_t clearheadermaps();
@@ -0,0 +1,526 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_http.h"
+
+static constexpr size_t MAXHEADERSIZE = 64 * 1024;
+
+bool parsehttpurl(const char *url, httpurl &result)
+{
+    if (std::strncmp(url, "http://", STRLEN("http://")))
+        return false;
+
+    const char *host = url + STRLEN("http://");
+    const char *path = std::strchr(host, '/');
+    std::string authority = path ? std::string(host, path) : std::string(host);
+
+    if (authority.empty() || authority.find('@') != std::string::npos)
+        return false;
+
+    size_t colon = authority.rfind(':');
+
+    /* [::1]:8080 */
+    if (colon != std::string::npos && authority.find(']') != std::string::npos &&
+        colon < authority.find(']'))
+    {
+        colon = std::string::npos;
+    }
+
+    result.host = authority.substr(0, colon);
+    result.port = colon != std::string::npos ? authority.substr(colon+1) : "80";
+    result.path = path ? path : "";
+
+    if (result.host.size() > 2 && result.host[0] == '[' && result.host.back() == ']')
+        result.host = result.host.substr(1, result.host.size()-2);
+
+    while (!result.path.empty() && result.path.back() == '/')
+        result.path.pop_back();
+
+    return !result.host.empty() && !result.port.empty() &&
+           result.port.find_first_not_of("0123456789") == std::string::npos;
+}
+
+/*
+ * I/O with an absolute deadline, -1 milliseconds: none
+ */
+
+static int remainingms(time_point start, int timeoutms)
+{
+    if (timeoutms < 0)
+        return -1;
+
+    ullong elapsed = getmicrodiff(start, getticks()) / 1000;
+    return elapsed >= (ullong)timeoutms ? 0 : timeoutms - (int)elapsed;
+}
+
+static bool waitfd(int fd, short events, time_point start, int timeoutms)
+{
+    struct pollfd pfd = { fd, events, 0 };
+
+    while (true)
+    {
+        int ms = remainingms(start, timeoutms);
+
+        if (ms == 0)
+            return false;
+
+        int n = poll(&pfd, 1, ms);
+
+        if (n > 0)
+            return true;
+
+        if (n == 0 || errno != EINTR)
+            return false;
+    }
+}
+
+static bool sendall(int fd, const char *data, size_t size, time_point start, int timeoutms)
+{
+    while (size)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+
+        if (n > 0)
+        {
+            data += n;
+            size -= n;
+        }
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!waitfd(fd, POLLOUT, start, timeoutms))
+                return false;
+        }
+        else if (n == -1 && errno != EINTR)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Appends to 'data', returns false on errors and timeouts,
+ * 'eof' tells whether the peer has closed the connection
+ */
+static bool receive(int fd, std::string &data, bool &eof, time_point start, int timeoutms)
+{
+    char buf[64 * 1024];
+
+    while (true)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+        if (n > 0)
+        {
+            data.append(buf, n);
+            eof = false;
+            return true;
+        }
+
+        if (n == 0)
+        {
+            eof = true;
+            return true;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (!waitfd(fd, POLLIN, start, timeoutms))
+                return false;
+        }
+        else if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+static bool getheader(const std::string &headers, const char *name, std::string &value)
+{
+    size_t len = std::strlen(name);
+    size_t pos = headers.find("\r\n");
+
+    while (pos != std::string::npos && pos + 2 < headers.size())
+    {
+        pos += 2;
+
+        if (headers.size() - pos > len && headers[pos+len] == ':' &&
+            !strncasecmp(headers.c_str() + pos, name, len))
+        {
+            size_t end = headers.find("\r\n", pos);
+            value = headers.substr(pos + len + 1, end - pos - len - 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t") + 1);
+            return true;
+        }
+
+        pos = headers.find("\r\n", pos);
+    }
+
+    return false;
+}
+
+static bool decodechunked(const std::string &data, std::string &body, bool &complete)
+{
+    size_t pos = 0;
+
+    body.clear();
+    complete = false;
+
+    while (true)
+    {
+        size_t eol = data.find("\r\n", pos);
+
+        if (eol == std::string::npos)
+            return true;
+
+        char *end;
+        ullong size = std::strtoull(data.c_str() + pos, &end, 16);
+
+        if (end == data.c_str() + pos)
+            return false;
+
+        if (!size)
+        {
+            complete = true;
+            return true;
+        }
+
+        pos = eol + 2;
+
+        if (data.size() - pos < size + 2)
+            return true;
+
+        body.append(data, pos, size);
+        pos += size + 2;
+    }
+}
+
+/*
+ * Reads the header block and the body of a request or response,
+ * 'headers' receives everything before the empty line
+ */
+static bool readmessage(int fd, std::string &headers, std::string &body, size_t maxbody,
+                        bool untileof, time_point start, int timeoutms)
+{
+    std::string data;
+    std::string value;
+    size_t end;
+    bool eof = false;
+
+    while ((end = data.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (eof || data.size() > MAXHEADERSIZE || !receive(fd, data, eof, start, timeoutms))
+            return false;
+    }
+
+    headers = data.substr(0, end);
+    data.erase(0, end + 4);
+
+    if (getheader(headers, "Transfer-Encoding", value) && !strcasecmp(value.c_str(), "chunked"))
+    {
+        bool complete;
+
+        while (decodechunked(data, body, complete) && !complete)
+        {
+            if (eof || body.size() > maxbody || !receive(fd, data, eof, start, timeoutms))
+                return false;
+        }
+
+        return complete;
+    }
+
+    if (getheader(headers, "Content-Length", value))
+    {
+        ullong length = std::strtoull(value.c_str(), nullptr, 10);
+
+        if (length > maxbody)
+            return false;
+
+        while (data.size() < length)
+        {
+            if (eof || !receive(fd, data, eof, start, timeoutms))
+                return false;
+        }
+
+        data.resize(length);
+        body = std::move(data);
+        return true;
+    }
+
+    /* responses without length end with the connection */
+    while (untileof && !eof)
+    {
+        if (data.size() > maxbody || !receive(fd, data, eof, start, timeoutms))
+            return false;
+    }
+
+    body = std::move(data);
+    return true;
+}
+
+/*
+ * Addresses of 'url' as raw sockaddrs. Host names are resolved in a
+ * child process, a blocking getaddrinfo() could not be bounded by the
+ * deadline otherwise.
+ */
+static bool resolve(const httpurl &url, string_vector &addrs, time_point start, int timeoutms)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+    std::string data;
+    int pipefd[2];
+    pid_t pid;
+
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    auto getaddrs = [&](std::string &data)
+    {
+        for (struct addrinfo *ai = result; ai; ai = ai->ai_next)
+        {
+            unsigned int len = ai->ai_addrlen;
+            data.append(reinterpret_cast<const char*>(&len), sizeof(len));
+            data.append(reinterpret_cast<const char*>(ai->ai_addr), len);
+        }
+
+        freeaddrinfo(result);
+    };
+
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    if (!getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &result))
+    {
+        getaddrs(data);
+    }
+    else
+    {
+        if (pipe2(pipefd, O_CLOEXEC) || (pid = fork()) == -1)
+            return false;
+
+        if (pid == 0)
+        {
+            close(pipefd[0]);
+            hints.ai_flags = AI_NUMERICSERV;
+
+            if (getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &result))
+                _exit(1);
+
+            getaddrs(data);
+
+            for (size_t pos = 0; pos < data.size();)
+            {
+                ssize_t n = write(pipefd[1], data.c_str() + pos, data.size() - pos);
+
+                if (n == -1 && errno == EINTR) continue;
+                if (n <= 0) _exit(1);
+
+                pos += n;
+            }
+
+            _exit(0);
+        }
+
+        close(pipefd[1]);
+
+        char buf[4096];
+        ssize_t n;
+
+        while (waitfd(pipefd[0], POLLIN, start, timeoutms))
+        {
+            if ((n = read(pipefd[0], buf, sizeof(buf))) > 0)
+                data.append(buf, n);
+            else if (n == 0 || errno != EINTR)
+                break;
+        }
+
+        close(pipefd[0]);
+
+        /* gone already, or still stuck in getaddrinfo() */
+        kill(pid, SIGKILL);
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR);
+    }
+
+    for (size_t pos = 0; data.size() - pos >= sizeof(unsigned int);)
+    {
+        unsigned int len;
+        std::memcpy(&len, data.c_str() + pos, sizeof(len));
+        pos += sizeof(len);
+
+        if (data.size() - pos < len || len < sizeof(sockaddr) || len > sizeof(sockaddr_storage))
+            break;
+
+        addrs.push_back(data.substr(pos, len));
+        pos += len;
+    }
+
+    return !addrs.empty();
+}
+
+static int connectto(const httpurl &url, time_point start, int timeoutms)
+{
+    string_vector addrs;
+
+    if (!resolve(url, addrs, start, timeoutms))
+        return -1;
+
+    int fd = -1;
+
+    for (const auto &addr : addrs)
+    {
+        sockaddr_storage sa;
+        std::memcpy(&sa, addr.c_str(), addr.size());
+
+        fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (fd == -1)
+            continue;
+
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&sa), addr.size()) == 0)
+            break;
+
+        if (errno == EINPROGRESS && waitfd(fd, POLLOUT, start, timeoutms))
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+
+            if (!getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) && !error)
+                break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+int httprequest(const httpurl &url, const char *method, const std::string &path,
+                const std::string *body, std::string *response, int timeoutms)
+{
+    time_point start = getticks();
+    int fd = connectto(url, start, timeoutms);
+
+    if (fd == -1)
+        return -1;
+
+    std::string request;
+
+    request += method;
+    request += " " + url.path + path + " HTTP/1.1\r\n";
+    /* IPv6 literals are bracketed */
+    if (url.host.find(':') != std::string::npos)
+        request += "Host: [" + url.host + "]:" + url.port + "\r\n";
+    else
+        request += "Host: " + url.host + ":" + url.port + "\r\n";
+    request += "User-Agent: " PACKAGE_NAME "\r\n";
+    request += "Connection: close\r\n";
+
+    if (body)
+    {
+        request += "Content-Type: application/octet-stream\r\n";
+        request += "Content-Length: " + std::to_string(body->size()) + "\r\n";
+    }
+
+    request += "\r\n";
+
+    std::string headers;
+    std::string data;
+    int status = -1;
+
+    if (sendall(fd, request.c_str(), request.size(), start, timeoutms) &&
+        (!body || sendall(fd, body->c_str(), body->size(), start, timeoutms)) &&
+        readmessage(fd, headers, data, (size_t)-1, strcmp(method, "HEAD"), start, timeoutms) &&
+        !headers.compare(0, STRLEN("HTTP/1."), "HTTP/1.") && headers.size() > 12)
+    {
+        status = std::atoi(headers.c_str() + 9);
+
+        if (response)
+            *response = std::move(data);
+    }
+
+    close(fd);
+    return status;
+}
+
+bool readhttprequest(int fd, httpmessage &request, size_t maxbody, int timeoutms)
+{
+    time_point start = getticks();
+    std::string headers;
+
+    if (!readmessage(fd, headers, request.body, maxbody, false, start, timeoutms))
+        return false;
+
+    size_t space = headers.find(' ');
+    size_t space2 = headers.find(' ', space+1);
+    size_t eol = headers.find("\r\n");
+
+    if (space == std::string::npos || space2 == std::string::npos || space2 > eol)
+        return false;
+
+    request.method = headers.substr(0, space);
+    request.path = headers.substr(space+1, space2-space-1);
+
+    return true;
+}
+
+bool writehttpresponse(int fd, int status, const std::string &body, int timeoutms)
+{
+    const char *reason;
+
+    switch (status)
+    {
+        case 200: reason = "OK"; break;
+        case 201: reason = "Created"; break;
+        case 400: reason = "Bad Request"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        case 413: reason = "Payload Too Large"; break;
+        default: reason = "Internal Server Error"; break;
+    }
+
+    std::string response;
+
+    response += "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n";
+    response += "Content-Type: application/octet-stream\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += "Connection: close\r\n\r\n";
+
+    time_point start = getticks();
+
+    return sendall(fd, response.c_str(), response.size(), start, timeoutms) &&
+           sendall(fd, body.c_str(), body.size(), start, timeoutms);
+}
@@ -0,0 +1,38 @@
+/*
+ * Minimal HTTP/1.1 (http:// only, one request per connection)
+ *
+ * Used by the remote object cache and wclang-cache-server.
+ * Timeouts cover a whole request, -1 disables them.
+ */
+
+struct httpurl {
+    std::string host;
+    std::string port;
+    std::string path;
+};
+
+/*
+ * http://host[:port][/path], 'path' loses its trailing slashes
+ */
+bool parsehttpurl(const char *url, httpurl &result);
+
+/*
+ * Sends 'method' for url.path + 'path' with an optional body. Returns
+ * the status code, or -1 if the server cannot be reached or does not
+ * answer in time.
+ */
+int httprequest(const httpurl &url, const char *method, const std::string &path,
+                const std::string *body, std::string *response, int timeoutms);
+
+/*
+ * Server side
+ */
+
+struct httpmessage {
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+bool readhttprequest(int fd, httpmessage &request, size_t maxbody, int timeoutms);
+bool writehttpresponse(int fd, int status, const std::string &body, int timeoutms);
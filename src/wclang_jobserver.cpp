@@ -0,0 +1,246 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_jobserver.h"
+#include "wclang_process.h"
+
+jobserver::~jobserver()
+{
+    releasetokens(*this);
+
+    if (readfd != -1) close(readfd);
+    if (writefd != -1 && writefd != readfd) close(writefd);
+}
+
+static bool isfifo(int fd)
+{
+    struct stat st;
+    return !fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
+
+/*
+ * Opens the inherited descriptor once more, so that O_NONBLOCK
+ * does not change the file description shared with make
+ */
+static int reopenfd(int fd, int flags)
+{
+    char path[64];
+
+    if (!isfifo(fd))
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, flags | O_CLOEXEC);
+}
+
+bool openjobserver(jobserver &js)
+{
+    const char *makeflags = getenvvar("MAKEFLAGS");
+    const char *auth = nullptr;
+    size_t optlen = 0;
+
+    if (!makeflags)
+        return false;
+
+    /*
+     * The last occurrence wins
+     */
+
+    for (const char *opt : { "--jobserver-auth=", "--jobserver-fds=" })
+    {
+        for (const char *p = makeflags; (p = std::strstr(p, opt)); ++p)
+        {
+            if (p > auth)
+            {
+                auth = p;
+                optlen = std::strlen(opt);
+            }
+        }
+    }
+
+    if (!auth)
+        return false;
+
+    auth += optlen;
+
+    std::string value(auth, std::strcspn(auth, " "));
+
+    if (!value.compare(0, STRLEN("fifo:"), "fifo:"))
+    {
+        std::string path = value.substr(STRLEN("fifo:"));
+
+        js.readfd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+        if (js.readfd == -1 || !isfifo(js.readfd))
+            return false;
+
+        js.writefd = js.readfd;
+        return true;
+    }
+
+    int r, w;
+    char c;
+
+    if (sscanf(value.c_str(), "%d,%d%c", &r, &w, &c) != 2 || r < 0 || w < 0)
+        return false;
+
+    js.readfd = reopenfd(r, O_RDONLY | O_NONBLOCK);
+    js.writefd = reopenfd(w, O_WRONLY);
+
+    return js.readfd != -1 && js.writefd != -1;
+}
+
+int acquiretokens(jobserver &js, int max)
+{
+    while ((int)js.tokens.size() < max - 1)
+    {
+        char token;
+
+        if (read(js.readfd, &token, 1) != 1)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        js.tokens += token;
+    }
+
+    return (int)js.tokens.size() + 1;
+}
+
+void releasetokens(jobserver &js)
+{
+    while (!js.tokens.empty())
+    {
+        ssize_t n = write(js.writefd, js.tokens.c_str(), js.tokens.size());
+
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR) continue;
+            break;
+        }
+
+        js.tokens.erase(0, n);
+    }
+}
+
+int runwithtokens(char **cargs, jobserver &js, struct rusage *usage)
+{
+    struct sigaction ignore, oldint, oldquit;
+    pid_t pid;
+
+    if ((pid = spawnprocess(cargs)) == -1)
+    {
+        releasetokens(js);
+        return RUNCOMMAND_ERROR;
+    }
+
+    /*
+     * Ctrl+C terminates the compiler, make sure
+     * we live long enough to return the tokens
+     */
+
+    std::memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ignore, &oldint);
+    sigaction(SIGQUIT, &ignore, &oldquit);
+
+    int status = waitprocess(pid, usage);
+
+    sigaction(SIGINT, &oldint, nullptr);
+    sigaction(SIGQUIT, &oldquit, nullptr);
+
+    releasetokens(js);
+
+    return status == RUNCOMMAND_ERROR ? 1 : status;
+}
+
+static void getlinkmode(const string_vector &args, const compilerver &clangversion,
+                        bool &lto, bool &lld)
+{
+    bool ltojobs = false;
+    bool threads = false;
+
+    lto = false;
+    lld = false;
+
+    for (const auto &arg : args)
+    {
+        if (!arg.compare(0, STRLEN("-flto-jobs="), "-flto-jobs="))
+            ltojobs = true;
+        else if (!arg.compare(0, STRLEN("-flto"), "-flto"))
+            lto = true;
+        else if (arg == "-fno-lto")
+            lto = false;
+        else if (arg == "-fuse-ld=lld" || arg == "-fuse-ld=ld.lld")
+            lld = true;
+        else if (!arg.compare(0, STRLEN("-Wl,"), "-Wl,") &&
+                 arg.find("--threads") != std::string::npos)
+            threads = true;
+    }
+
+    if (ltojobs) lto = false;
+    if (threads) lld = false;
+
+    /* lld takes a thread count since version 11 */
+    if (clangversion < compilerver(11, 0, 0)) lld = false;
+}
+
+bool uselinkjobs(const string_vector &args, const compilerver &clangversion)
+{
+    const char *makeflags = getenvvar("MAKEFLAGS");
+    bool lto, lld;
+
+    if (!makeflags || (!std::strstr(makeflags, "--jobserver-auth=") &&
+                       !std::strstr(makeflags, "--jobserver-fds=")))
+    {
+        return false;
+    }
+
+    getlinkmode(args, clangversion, lto, lld);
+    return lto || lld;
+}
+
+int setlinkjobs(string_vector &args, const compilerver &clangversion, jobserver &js, int max)
+{
+    bool lto, lld;
+    int jobs;
+
+    if (!openjobserver(js))
+        return 0;
+
+    getlinkmode(args, clangversion, lto, lld);
+    jobs = acquiretokens(js, max);
+
+    if (lto) args.push_back("-flto-jobs=" + std::to_string(jobs));
+    if (lld) args.push_back("-Wl,--threads=" + std::to_string(jobs));
+
+    return jobs;
+}
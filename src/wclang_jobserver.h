@@ -0,0 +1,45 @@
+/*
+ * GNU make jobserver client
+ *
+ * Link steps with LTO or lld use one thread per CPU by default.
+ * Under make -jN we take additional tokens from the jobserver
+ * (--jobserver-auth=R,W or --jobserver-auth=fifo:PATH in MAKEFLAGS)
+ * without blocking and limit the linker to the number of tokens
+ * we hold. Tokens are returned once the compiler has exited.
+ */
+
+struct jobserver {
+    int readfd;
+    int writefd;
+    std::string tokens;
+
+    jobserver() : readfd(-1), writefd(-1) {}
+    ~jobserver();
+};
+
+bool openjobserver(jobserver &js);
+
+/*
+ * Takes up to 'max' - 1 additional tokens, returns the number
+ * of jobs we may run (including the implicit token)
+ */
+int acquiretokens(jobserver &js, int max);
+void releasetokens(jobserver &js);
+
+/*
+ * Runs the compiler and releases the tokens once it has exited,
+ * 'usage' receives its resource usage
+ */
+int runwithtokens(char **cargs, jobserver &js, struct rusage *usage = nullptr);
+
+/*
+ * Returns true if MAKEFLAGS announces a jobserver and the link step
+ * uses LTO or lld (clang>=11) without an explicit thread count
+ */
+bool uselinkjobs(const string_vector &args, const compilerver &clangversion);
+
+/*
+ * Takes tokens and appends -flto-jobs=N / -Wl,--threads=N,
+ * returns N or 0 if the jobserver is not usable
+ */
+int setlinkjobs(string_vector &args, const compilerver &clangversion, jobserver &js, int max);
@@ -0,0 +1,265 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <utility>
+#include "wclang.h"
+#include "wclang_json.h"
+
+/* nesting limit, the parser is recursive */
+static constexpr int MAXJSONDEPTH = 64;
+
+static void skipspace(const char *&p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+}
+
+static void appendutf8(std::string &str, unsigned long cp)
+{
+    if (cp < 0x80)
+    {
+        str += (char)cp;
+    }
+    else if (cp < 0x800)
+    {
+        str += (char)(0xC0 | (cp >> 6));
+        str += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        str += (char)(0xE0 | (cp >> 12));
+        str += (char)(0x80 | ((cp >> 6) & 0x3F));
+        str += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        str += (char)(0xF0 | (cp >> 18));
+        str += (char)(0x80 | ((cp >> 12) & 0x3F));
+        str += (char)(0x80 | ((cp >> 6) & 0x3F));
+        str += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool parsehex4(const char *&p, const char *end, unsigned long &value)
+{
+    if (end - p < 4)
+        return false;
+
+    value = 0;
+
+    for (int i = 0; i < 4; ++i, ++p)
+    {
+        char c = *p;
+        value <<= 4;
+
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return false;
+    }
+
+    return true;
+}
+
+static bool parsejsonstring(const char *&p, const char *end, std::string &str)
+{
+    if (p == end || *p++ != '"')
+        return false;
+
+    while (p < end)
+    {
+        char c = *p++;
+
+        if (c == '"')
+            return true;
+
+        if (c != '\\')
+        {
+            str += c;
+            continue;
+        }
+
+        if (p == end)
+            return false;
+
+        switch (c = *p++)
+        {
+            case '"': case '\\': case '/': str += c; break;
+            case 'b': str += '\b'; break;
+            case 'f': str += '\f'; break;
+            case 'n': str += '\n'; break;
+            case 'r': str += '\r'; break;
+            case 't': str += '\t'; break;
+            case 'u':
+            {
+                unsigned long cp, low;
+
+                if (!parsehex4(p, end, cp))
+                    return false;
+
+                /* surrogate pair */
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 &&
+                    p[0] == '\\' && p[1] == 'u')
+                {
+                    p += 2;
+
+                    if (!parsehex4(p, end, low) || low < 0xDC00 || low > 0xDFFF)
+                        return false;
+
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+
+                appendutf8(str, cp);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+static bool parsejson(const char *&p, const char *end, jsonvalue &value, int depth)
+{
+    skipspace(p, end);
+
+    if (p == end || depth > MAXJSONDEPTH)
+        return false;
+
+    auto literal = [&](const char *word) -> bool
+    {
+        size_t len = std::strlen(word);
+
+        if ((size_t)(end - p) < len || std::strncmp(p, word, len))
+            return false;
+
+        p += len;
+        return true;
+    };
+
+    switch (*p)
+    {
+        case '"':
+        {
+            value.type = jsonvalue::STRING;
+            return parsejsonstring(p, end, value.str);
+        }
+        case '[':
+        case '{':
+        {
+            bool isobject = *p++ == '{';
+            char close = isobject ? '}' : ']';
+
+            value.type = isobject ? jsonvalue::OBJECT : jsonvalue::ARRAY;
+            skipspace(p, end);
+
+            if (p < end && *p == close)
+            {
+                ++p;
+                return true;
+            }
+
+            while (p < end)
+            {
+                if (isobject)
+                {
+                    std::string key;
+
+                    skipspace(p, end);
+
+                    if (!parsejsonstring(p, end, key))
+                        return false;
+
+                    skipspace(p, end);
+
+                    if (p == end || *p++ != ':')
+                        return false;
+
+                    value.members.push_back(std::make_pair(key, jsonvalue()));
+
+                    if (!parsejson(p, end, value.members.back().second, depth+1))
+                        return false;
+                }
+                else
+                {
+                    value.items.push_back(jsonvalue());
+
+                    if (!parsejson(p, end, value.items.back(), depth+1))
+                        return false;
+                }
+
+                skipspace(p, end);
+
+                if (p == end)
+                    return false;
+
+                if (*p == close)
+                {
+                    ++p;
+                    return true;
+                }
+
+                if (*p++ != ',')
+                    return false;
+            }
+
+            return false;
+        }
+        case 't':
+        case 'f':
+        {
+            value.type = jsonvalue::BOOLEAN;
+            value.str = *p == 't' ? "true" : "false";
+            return literal(value.str.c_str());
+        }
+        case 'n':
+        {
+            value.type = jsonvalue::NUL;
+            return literal("null");
+        }
+        default:
+        {
+            const char *start = p;
+
+            while (p < end && (std::strchr("+-.eE", *p) || (*p >= '0' && *p <= '9')))
+                ++p;
+
+            value.type = jsonvalue::NUMBER;
+            value.str.assign(start, p);
+
+            return p != start;
+        }
+    }
+}
+
+bool parsejson(const std::string &data, jsonvalue &value)
+{
+    const char *p = data.c_str();
+    const char *end = p + data.size();
+
+    if (!parsejson(p, end, value, 0))
+        return false;
+
+    skipspace(p, end);
+    return p == end;
+}
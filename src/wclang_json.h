@@ -0,0 +1,30 @@
+#include <utility>
+
+/*
+ * Minimal JSON reader (compilation databases, metrics logs)
+ */
+
+struct jsonvalue {
+    enum { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } type;
+    std::string str;
+    std::vector<jsonvalue> items;
+    std::vector<std::pair<std::string, jsonvalue>> members;
+
+    jsonvalue() : type(NUL) {}
+
+    const jsonvalue *get(const char *key, int type) const
+    {
+        for (const auto &member : members)
+        {
+            if (member.first == key)
+                return member.second.type == type ? &member.second : nullptr;
+        }
+
+        return nullptr;
+    }
+};
+
+/*
+ * Parses 'data', which must hold a single value
+ */
+bool parsejson(const std::string &data, jsonvalue &value);
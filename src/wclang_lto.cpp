@@ -0,0 +1,131 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_lto.h"
+
+static constexpr char LTOCACHEDIR[] = "/thinlto";
+static constexpr char DEFAULTCACHESIZE[] = "2g";
+
+int parseltomode(const char *mode)
+{
+    if (!std::strcmp(mode, "thin"))
+        return LTO_THIN;
+
+    if (!std::strcmp(mode, "full"))
+        return LTO_FULL;
+
+    if (!std::strcmp(mode, "off"))
+        return LTO_OFF;
+
+    return -1;
+}
+
+/*
+ * lld's cache pruning policy, sizes take the k/m/g suffixes
+ */
+static std::string getcachepolicy()
+{
+    const char *size = getenvvar("WCLANG_LTO_CACHE_SIZE");
+    std::string policy = "prune_interval=20m:prune_after=168h:cache_size_bytes=";
+
+    if (!size || !*size)
+        size = DEFAULTCACHESIZE;
+
+    for (const char *p = size; *p; ++p)
+        policy += tolower(*p);
+
+    return policy;
+}
+
+void addltoflags(const commandargs &cmdargs, string_vector &args)
+{
+    std::string dir;
+
+    if (cmdargs.lto == LTO_FULL)
+    {
+        args.push_back("-flto=full");
+        return;
+    }
+
+    args.push_back("-flto=thin");
+
+    if (!cmdargs.islinkstep || !getcachedir(dir))
+        return;
+
+    /*
+     * lld's mingw driver accepts --thinlto-cache-dir since version 12
+     * and passes COFF options (-lldltocachepolicy) with -Xlink since 13
+     */
+
+    if (cmdargs.clangversion < compilerver(12, 0, 0))
+    {
+        if (cmdargs.verbose)
+            verbosemsg("no ThinLTO cache, lld % is too old", cmdargs.clangversion.str());
+        return;
+    }
+
+    dir += LTOCACHEDIR;
+    dir += PATHDIV;
+    dir += cmdargs.target;
+
+    args.push_back("-Wl,--thinlto-cache-dir=" + dir);
+
+    if (cmdargs.clangversion >= compilerver(13, 0, 0))
+        args.push_back("-Wl,-Xlink=-lldltocachepolicy:" + getcachepolicy());
+}
+
+size_t clearltocache()
+{
+    std::string dir;
+    string_vector targets;
+    string_vector files;
+    size_t n = 0;
+
+    if (!getcachedir(dir))
+        return 0;
+
+    dir += LTOCACHEDIR;
+
+    if (!listfiles(dir.c_str(), &targets))
+        return 0;
+
+    for (const auto &target : targets)
+    {
+        std::string targetdir = dir + PATHDIV + target;
+
+        if (!listfiles(targetdir.c_str(), &files))
+            continue;
+
+        for (const auto &file : files)
+        {
+            if (!unlink((targetdir + PATHDIV + file).c_str()))
+                ++n;
+        }
+
+        rmdir(targetdir.c_str());
+    }
+
+    return n;
+}
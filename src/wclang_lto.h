@@ -0,0 +1,28 @@
+/*
+ * Link time optimization (-wc-lto=thin|full|off, $WCLANG_LTO)
+ *
+ * Compile steps emit bitcode, link steps use lld, which understands
+ * bitcode for mingw targets. ThinLTO links keep a persistent cache
+ * below <cachedir>/thinlto/<target>, so relinks only re-optimize the
+ * modules that changed. lld prunes the cache to
+ * $WCLANG_LTO_CACHE_SIZE (default: 2G) and drops entries unused for
+ * a week.
+ */
+
+enum {
+    LTO_OFF,
+    LTO_THIN,
+    LTO_FULL
+};
+
+/*
+ * Returns LTO_* or -1
+ */
+int parseltomode(const char *mode);
+
+/*
+ * Appends the LTO flags of the compile or link step to 'args'
+ */
+void addltoflags(const commandargs &cmdargs, string_vector &args);
+
+size_t clearltocache();
@@ -0,0 +1,423 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_daemon.h"
+#include "wclang_objcache.h"
+#include "wclang_parallel.h"
+#include "wclang_jobserver.h"
+#include "wclang_pch.h"
+#include "wclang_rsp.h"
+#include "wclang_targets.h"
+#include "wclang_process.h"
+#include "wclang_scandeps.h"
+#include "wclang_rc.h"
+#include "wclang_metrics.h"
+#include "wclang_admission.h"
+
+/*
+ * Runs the compiler as child process, so that it shows up in the
+ * trace and the metrics log, and merges the output of -ftime-trace
+ * if given
+ */
+static int runtraced(char **cargs, struct rusage *usage)
+{
+    std::string command;
+    std::string timetrace;
+    const char *output = nullptr;
+    const char *input = nullptr;
+    std::vector<int> inputs;
+
+    for (char **arg = cargs; *arg; ++arg)
+    {
+        if (arg != cargs) command += " ";
+        command += *arg;
+
+        if (!std::strcmp(*arg, "-o") && arg[1])
+            output = arg[1];
+        else if (!std::strncmp(*arg, "-ftime-trace", STRLEN("-ftime-trace")))
+            timetrace = *arg;
+    }
+
+    findinputfiles(cargs, inputs);
+
+    if (inputs.size() == 1)
+        input = cargs[inputs[0]];
+
+    time_point childstart = getticks();
+
+    pid_t pid = spawnprocess(cargs);
+
+    if (pid == -1)
+        return RUNCOMMAND_ERROR;
+
+    tracebegin("compile");
+    int status = waitprocess(pid, usage);
+    traceend("\"command\":" + jsonstring(command) +
+             ",\"status\":" + std::to_string(status));
+
+    /*
+     * -ftime-trace writes <output>.json,
+     * -ftime-trace=<file or dir> as given
+     */
+
+    if (!timetrace.empty() && (output || input))
+    {
+        std::string file = output ? output : getfileName(input);
+        size_t dot = file.find_last_of('.');
+        size_t slash = file.find_last_of(PATHDIV);
+
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+            file.resize(dot);
+
+        file += ".json";
+
+        if (timetrace.size() > STRLEN("-ftime-trace="))
+        {
+            std::string value = timetrace.substr(STRLEN("-ftime-trace="));
+
+            if (isdirectory(value.c_str(), nullptr))
+                file = value + "/" + getfileName(file.c_str());
+            else
+                file = value;
+        }
+
+        mergeclangtrace(file, childstart);
+    }
+
+    return status;
+}
+
+static int runwclang(int argc, char **argv, bool expandtemplates)
+{
+    commandstate state;
+    commandargs &cmdargs = state.cmdargs;
+    string_vector &args = state.args;
+    std::string &compiler = state.compiler;
+    char **cargs = nullptr;
+    int cargsi = 0;
+
+    if (usetrace())
+    {
+        std::string name = PACKAGE_NAME;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            name += " ";
+            name += argv[i];
+        }
+
+        settracename(name);
+    }
+
+    int computed = computecommand(argc, argv, state);
+
+    if (computed != COMMAND_READY)
+        return computed;
+
+    if (expandtemplates)
+        expandoutputtemplates(args, state.target);
+
+    if (cmdargs.scandeps)
+    {
+        /* clang-scan-deps runs as our child */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        return runscandeps(argv[0], cmdargs);
+    }
+
+    /*
+     * Limit the LTO and linker threads to the
+     * number of jobserver tokens we get
+     */
+
+    jobserver js;
+
+    if (cmdargs.islinkstep && !cmdargs.iscompilestep && uselinkjobs(args, cmdargs.clangversion))
+    {
+        /* the jobserver descriptors belong to the client */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        int jobs = setlinkjobs(args, cmdargs.clangversion, js, getjobcount(nullptr));
+
+        if (cmdargs.verbose && jobs)
+            verbosemsg("jobserver: % link jobs", jobs);
+    }
+
+    if (cmdargs.autopch && cmdargs.iscompilestep &&
+        addautopch(args, !isdaemonchild(), cmdargs.verbose) == AUTOPCH_NEEDSBUILD)
+    {
+        /* build the PCH outside of the daemon */
+        return daemonfallback();
+    }
+
+    cargs = new char* [args.size()+2];
+    cargs[args.size()] = nullptr;
+
+    for (const auto &opt : args)
+        cargs[cargsi++] = strdup(opt.c_str());
+
+    if (cmdargs.appendexe)
+        appendexetooutputname(cargs);
+
+    /*
+     * Execute command
+     */
+
+    if (cmdargs.verbose)
+    {
+        std::string commandin, commandout;
+
+        for (int i = 0; i < argc; ++i)
+        {
+            if (i) commandin += " ";
+            commandin += argv[i];
+        }
+
+        for (char **arg = cargs; *arg; ++arg)
+        {
+            if (arg != cargs) commandout += " ";
+            commandout += *arg;
+        }
+
+        timepoint("end");
+        verbosemsg("command in: %", commandin);
+        verbosemsg("command out: %", commandout);
+        printtimes();
+    }
+
+    if (usetrace() && isdaemonchild())
+    {
+        /* the compiler must run as our child to be traced */
+        discardtrace();
+        return daemonfallback();
+    }
+
+    if (cmdargs.iscompilestep && isresourcecompile(cargs))
+    {
+        /* llvm-rc and llvm-cvtres run as our children */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        time_point childstart = getticks();
+        bool cached = false;
+        int status;
+
+        if (cmdargs.objectcache)
+        {
+            customcompile rc;
+            getresourcecompile(cargs, cmdargs, rc);
+
+            tracebegin("object cache");
+            cached = runobjectcache(cargs, cmdargs.verbose, status, nullptr, &rc);
+            traceend();
+        }
+
+        if (!cached)
+            status = runresourcecompile(cargs, cmdargs);
+
+        writemetrics(cargs, cmdargs, childstart, status);
+        return status;
+    }
+
+    bool parallel = cmdargs.jobs > 1 && cmdargs.iscompilestep && isparallelcompile(cargs);
+
+    /*
+     * Memory admission, -wc-jobs admits each job on its own.
+     * Cache hits pass it as well, misses run the compiler.
+     */
+
+    admission adm;
+
+    if (useadmission() && !parallel && (cmdargs.iscompilestep || cmdargs.islinkstep))
+    {
+        /* the compiler must run as our child */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        tracebegin("admission");
+        acquireadmission(cargs, cmdargs, adm);
+        traceend();
+
+        setspawnhook([&adm](pid_t pid) { addtocgroup(adm, pid); });
+    }
+
+    if (parallel)
+    {
+        if (isdaemonchild())
+            return daemonfallback();
+
+        time_point childstart = getticks();
+        int status = runparallel(cargs, cmdargs.jobs, cmdargs.verbose);
+
+        writemetrics(cargs, cmdargs, childstart, status);
+        return status;
+    }
+
+    if (cmdargs.probecache && isconfigureprobe(cargs))
+    {
+        struct rusage usage = {};
+        int status;
+
+        if (isdaemonchild())
+            return daemonfallback();
+
+        time_point childstart = getticks();
+
+        tracebegin("probe cache");
+        bool cached = runprobecache(cargs, cmdargs.verbose, status, &usage);
+        traceend();
+
+        if (cached)
+        {
+            releaseadmission(adm, status, &usage);
+            writemetrics(cargs, cmdargs, childstart, status);
+            return status;
+        }
+    }
+
+    if (cmdargs.objectcache && cmdargs.iscompilestep)
+    {
+        struct rusage usage = {};
+        int status;
+
+        /*
+         * The object cache runs the compiler itself,
+         * let the client do this outside of the daemon
+         */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        time_point childstart = getticks();
+
+        tracebegin("object cache");
+        bool cached = runobjectcache(cargs, cmdargs.verbose, status, &usage);
+        traceend();
+
+        if (cached)
+        {
+            releaseadmission(adm, status, &usage);
+            writemetrics(cargs, cmdargs, childstart, status);
+            return status;
+        }
+    }
+
+    if (usemetrics() && isdaemonchild())
+    {
+        /* the compiler must run as our child to be measured */
+        return daemonfallback();
+    }
+
+    /*
+     * Pass huge command lines (mostly link steps with
+     * many objects) in a response file. This is done last,
+     * the branches above need to see the real arguments.
+     */
+
+    if (needresponsefile(cargs))
+    {
+        /* the descriptor would not exist in the client */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        if (writeresponsefile(cargs) == -1)
+            warn("cannot write response file");
+        else if (cmdargs.verbose)
+            verbosemsg("passing arguments in response file %", cargs[1]);
+    }
+
+    if (!js.tokens.empty())
+    {
+        struct rusage usage;
+        time_point childstart = getticks();
+
+        tracebegin("compile");
+        int status = runwithtokens(cargs, js, &usage);
+        traceend();
+
+        if (status != RUNCOMMAND_ERROR)
+        {
+            releaseadmission(adm, status, &usage);
+            writemetrics(cargs, cmdargs, childstart, status, &usage);
+            return status;
+        }
+    }
+
+    if (usetrace() || usemetrics() || adm.held())
+    {
+        struct rusage usage;
+        time_point childstart = getticks();
+        int status = runtraced(cargs, &usage);
+
+        if (status != RUNCOMMAND_ERROR)
+        {
+            releaseadmission(adm, status, &usage);
+            writemetrics(cargs, cmdargs, childstart, status, &usage);
+            return status;
+        }
+    }
+
+    if (isdaemonchild())
+        return daemonexec(cargs);
+
+    execvp(compiler.c_str(), cargs);
+
+    std::cerr << "invoking compiler failed" << std::endl;
+    std::cerr << compiler << " not installed?" << std::endl;
+    return 1;
+}
+
+static int wclangmain(int argc, char **argv)
+{
+    if (iswindres(argc, argv))
+    {
+        if (isdaemonchild())
+            return daemonfallback();
+
+        return runwindres(argc, argv);
+    }
+
+    if (ismultitarget(argc, argv))
+    {
+        /* the targets are run as our children */
+        if (isdaemonchild())
+            return daemonfallback();
+
+        return runtargets(argc, argv, runwclang);
+    }
+
+    return runwclang(argc, argv, false);
+}
+
+int main(int argc, char **argv)
+{
+    if (!std::strcmp(getfileName(argv[0]), "wclangd"))
+        return daemonmain(argc, argv, wclangmain);
+
+    return wclangmain(argc, argv);
+}
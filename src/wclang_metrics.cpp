@@ -0,0 +1,135 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_hash.h"
+#include "wclang_metrics.h"
+
+/* roughly our execve(), static initializers run first */
+static time_point processstart = getticks();
+
+const char *getmetricslog()
+{
+    const char *file = getenvvar("WCLANG_METRICS_LOG");
+
+    if (!file || !*file || !std::strcmp(file, "0"))
+        return nullptr;
+
+    return file;
+}
+
+bool usemetrics()
+{
+    return getmetricslog() != nullptr;
+}
+
+static ullong getmicroseconds(const struct timeval &tv)
+{
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+void writemetrics(char **cargs, const commandargs &cmdargs, time_point childstart,
+                  int status, const struct rusage *usage)
+{
+    const char *file = getmetricslog();
+
+    if (!file)
+        return;
+
+    time_point end = getticks();
+    struct rusage children;
+    std::string command;
+    std::string output;
+    std::vector<int> inputs;
+    char cwd[PATH_MAX];
+
+    /*
+     * Without the usage of a single child (object cache,
+     * parallel jobs, ...), sum up all children we waited for
+     */
+
+    if (!usage)
+    {
+        if (getrusage(RUSAGE_CHILDREN, &children))
+            std::memset(&children, 0, sizeof(children));
+
+        usage = &children;
+    }
+
+    for (char **arg = cargs; *arg; ++arg)
+    {
+        if (arg != cargs) command += " ";
+        command += *arg;
+
+        if (!std::strcmp(*arg, "-o") && arg[1])
+            output = arg[1];
+    }
+
+    findinputfiles(cargs, inputs);
+
+    if (!getcwd(cwd, sizeof(cwd)))
+        *cwd = '\0';
+
+    const char *step = cmdargs.iscompilestep ? "compile" :
+                       cmdargs.islinkstep ? "link" : "other";
+
+    std::string line;
+
+    line += "{\"time\":" + std::to_string((long long)time(nullptr));
+    line += ",\"command_hash\":" + jsonstring(sha256string(command).substr(0, 16));
+    line += ",\"directory\":" + jsonstring(cwd);
+    line += ",\"source\":" + jsonstring(cmdargs.iscompilestep && inputs.size() == 1 ?
+                                          cargs[inputs[0]] : "");
+    line += ",\"inputs\":" + std::to_string(inputs.size());
+    line += ",\"output\":" + jsonstring(output);
+    line += ",\"target\":" + jsonstring(cmdargs.target);
+    line += ",\"step\":" + jsonstring(step);
+    line += ",\"overhead_us\":" + std::to_string(getmicrodiff(processstart, childstart));
+    line += ",\"wall_us\":" + std::to_string(getmicrodiff(childstart, end));
+    line += ",\"user_us\":" + std::to_string(getmicroseconds(usage->ru_utime));
+    line += ",\"sys_us\":" + std::to_string(getmicroseconds(usage->ru_stime));
+    line += ",\"maxrss_kb\":" + std::to_string((long long)usage->ru_maxrss);
+    line += ",\"status\":" + std::to_string(status);
+    line += "}\n";
+
+    int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+        return;
+
+    /*
+     * A single O_APPEND write, so that concurrent
+     * invocations neither lock nor interleave
+     */
+    ssize_t n = write(fd, line.c_str(), line.size());
+    (void)n;
+
+    close(fd);
+}
@@ -0,0 +1,24 @@
+/*
+ * Per-invocation metrics
+ *
+ * With $WCLANG_METRICS_LOG=<file>, the compiler runs as our child
+ * instead of replacing us, and one JSON line per invocation is
+ * appended to <file>: a hash of the rewritten command, the source,
+ * the step (compile, link, other), the wrapper overhead (our start
+ * until the compiler's), the wall time, user and system CPU time and
+ * the maximum RSS of the child (wait4()) and the exit status.
+ *
+ * wclang-stats aggregates these logs.
+ */
+
+struct rusage;
+
+const char *getmetricslog();
+bool usemetrics();
+
+/*
+ * 'childstart' is the time the compiler was started. Without 'usage',
+ * the usage of all children we have waited for is logged.
+ */
+void writemetrics(char **cargs, const commandargs &cmdargs, time_point childstart,
+                  int status, const struct rusage *usage = nullptr);
@@ -0,0 +1,1354 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+#include <map>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_hash.h"
+#include "wclang_objcache.h"
+#include "wclang_process.h"
+#include "wclang_http.h"
+#include "wclang_rsp.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static constexpr char OBJECTSDIR[] = "/objects";
+static constexpr char BUNDLEMAGIC[] = "wclang-object 1\n";
+static constexpr char PROBESDIR[] = "/probes";
+static constexpr char PROBEMAGIC[] = "wclang-probe 1\n";
+static constexpr ullong DEFAULTCACHESIZE = 5ULL * 1024 * 1024 * 1024;
+static constexpr int DEFAULTREMOTETIMEOUT = 2000;
+static constexpr int UPLOADTIMEOUT = 60000;
+
+/*
+ * The cache is split into 256 directories (first byte of the key),
+ * each directory is cleaned up on its own when it exceeds its share
+ */
+static constexpr int CACHESUBDIRS = 256;
+
+struct compilestep {
+    string_vector args;
+    size_t input;
+    std::string output;
+    std::string depfile;
+    bool deptargets;
+    bool debug;
+    bool prefixmap;
+    bool color;
+
+    compilestep() : input(), deptargets(), debug(), prefixmap(), color() {}
+};
+
+bool useobjectcache()
+{
+    const char *p;
+    return (p = getenvvar("WCLANG_OBJECT_CACHE")) && *p == '1';
+}
+
+static std::string relativepath(const std::string &path, const std::string &cwd)
+{
+    auto split = [](const std::string &path)
+    {
+        string_vector components;
+        size_t pos = 0;
+
+        while (pos < path.size())
+        {
+            size_t end = path.find(PATHDIV, pos);
+            if (end == std::string::npos) end = path.size();
+
+            std::string component(path, pos, end-pos);
+
+            if (!component.empty() && component != ".")
+                components.push_back(component);
+
+            pos = end+1;
+        }
+
+        return components;
+    };
+
+    string_vector p = split(path);
+    string_vector c = split(cwd);
+    std::string result;
+    size_t common = 0;
+
+    while (common < p.size() && common < c.size() && p[common] == c[common])
+        ++common;
+
+    for (size_t i = common; i < c.size(); ++i)
+        result += "../";
+
+    for (size_t i = common; i < p.size(); ++i)
+    {
+        result += p[i];
+        if (i+1 < p.size()) result += "/";
+    }
+
+    if (result.empty())
+        return ".";
+
+    if (result[result.size()-1] == '/')
+        result.resize(result.size()-1);
+
+    return result;
+}
+
+/*
+ * Rewrites absolute paths below 'basedir' relative to 'cwd'
+ */
+static void normalizepaths(string_vector &args, const std::string &basedir,
+                           const std::string &cwd)
+{
+    static constexpr const char* JOINED[] = {
+        "-I", "-iquote", "-isystem", "-idirafter", "-include",
+        "-imacros", "-o", "-MF"
+    };
+
+    auto isbelow = [&](const std::string &path)
+    {
+        return !path.compare(0, basedir.size(), basedir) &&
+               (path.size() == basedir.size() || path[basedir.size()] == PATHDIV ||
+                basedir == "/");
+    };
+
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        std::string &arg = args[i];
+
+        if (arg[0] == PATHDIV)
+        {
+            const std::string &prev = args[i-1];
+
+            /* keep explicit dependency targets */
+            if (prev == "-MT" || prev == "-MQ")
+                continue;
+
+            if (isbelow(arg))
+                arg = relativepath(arg, cwd);
+
+            continue;
+        }
+
+        if (arg[0] != '-')
+            continue;
+
+        for (const char *opt : JOINED)
+        {
+            size_t len = std::strlen(opt);
+
+            if (!arg.compare(0, len, opt) && arg.size() > len && arg[len] == PATHDIV)
+            {
+                std::string path(arg, len);
+
+                if (isbelow(path))
+                    arg = opt + relativepath(path, cwd);
+
+                break;
+            }
+        }
+    }
+}
+
+static bool analyze(char **cargs, compilestep &cs)
+{
+    std::vector<int> inputs;
+    bool compileonly = false;
+    bool wantdepfile = false;
+    int output = -1;
+
+    /* we could not run it without a response file */
+    if (needresponsefile(cargs))
+        return false;
+
+    findinputfiles(cargs, inputs);
+
+    if (inputs.size() != 1)
+        return false;
+
+    const char *input = cargs[inputs[0]];
+
+    if (*input == '@' || !std::strcmp(input, "-"))
+        return false;
+
+    static constexpr const char* UNCACHEABLE[] = {
+        "-E", "-S", "-M", "-MM", "-MJ", "-fsyntax-only", "--analyze",
+        "-save-temps", "-ftime-trace", "-fprofile-use", "-fprofile-instr-use",
+        "-fprofile-sample-use", "-gsplit-dwarf", "-fmodules"
+    };
+
+    for (int i = 1; cargs[i]; ++i)
+    {
+        const char *arg = cargs[i];
+        const char *next = cargs[i+1];
+
+        if (*arg == '@')
+            return false;
+
+        if (*arg != '-')
+            continue;
+
+        for (const char *opt : UNCACHEABLE)
+        {
+            size_t len = std::strlen(opt);
+
+            if (!std::strncmp(arg, opt, len) && (!arg[len] || arg[len] == '=' ||
+                 (opt[1] != 'M' && opt[1] != 'E' && opt[1] != 'S')))
+            {
+                return false;
+            }
+        }
+
+        if (!std::strcmp(arg, "-c"))
+        {
+            compileonly = true;
+        }
+        else if (!std::strcmp(arg, "-MD") || !std::strcmp(arg, "-MMD"))
+        {
+            wantdepfile = true;
+        }
+        else if (!std::strncmp(arg, "-MF", STRLEN("-MF")))
+        {
+            cs.depfile = arg[3] ? arg+3 : (next ? next : "");
+        }
+        else if (!std::strncmp(arg, "-MT", STRLEN("-MT")) ||
+                 !std::strncmp(arg, "-MQ", STRLEN("-MQ")))
+        {
+            cs.deptargets = true;
+        }
+        else if (!std::strncmp(arg, "-o", STRLEN("-o")))
+        {
+            if (arg[2]) cs.output = arg+2;
+            else if (next) cs.output = next;
+            output = i;
+        }
+        else if (arg[1] == 'g' && std::strcmp(arg, "-g0") &&
+                 std::strncmp(arg, "-gno-", STRLEN("-gno-")) &&
+                 std::strcmp(arg, "-gcc-toolchain"))
+        {
+            cs.debug = true;
+        }
+        else if (!std::strncmp(arg, "-fdebug-prefix-map=", STRLEN("-fdebug-prefix-map=")) ||
+                 !std::strncmp(arg, "-ffile-prefix-map=", STRLEN("-ffile-prefix-map=")))
+        {
+            cs.prefixmap = true;
+        }
+        else if (!std::strcmp(arg, "-fcolor-diagnostics") ||
+                 !std::strcmp(arg, "-fno-color-diagnostics"))
+        {
+            cs.color = true;
+        }
+
+        if (optionhasvalue(arg) && next)
+            ++i;
+    }
+
+    if (!compileonly)
+        return false;
+
+    if (output == -1)
+    {
+        std::string base = getfileName(input);
+        size_t dot = base.find_last_of('.');
+
+        if (dot != std::string::npos)
+            base.resize(dot);
+
+        cs.output = base + ".o";
+    }
+
+    if (!wantdepfile)
+    {
+        cs.depfile.clear();
+    }
+    else if (cs.depfile.empty())
+    {
+        cs.depfile = cs.output;
+        size_t dot = cs.depfile.find_last_of('.');
+        size_t slash = cs.depfile.find_last_of(PATHDIV);
+
+        if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+            cs.depfile.resize(dot);
+
+        cs.depfile += ".d";
+    }
+
+    for (char **arg = cargs; *arg; ++arg)
+        cs.args.push_back(*arg);
+
+    cs.input = inputs[0];
+    return true;
+}
+
+/*
+ * Arguments which only affect the output location
+ * or diagnostics are not part of the cache key
+ */
+static size_t skiparg(const string_vector &args, size_t i, bool preprocess)
+{
+    const std::string &arg = args[i];
+
+    if (arg == "-fcolor-diagnostics" || arg == "-fno-color-diagnostics")
+        return 1;
+
+    if (!arg.compare(0, 2, "-o"))
+        return arg.size() > 2 ? 1 : 2;
+
+    if (!arg.compare(0, 3, "-MF"))
+        return arg.size() > 3 ? 1 : 2;
+
+    if (!preprocess)
+        return 0;
+
+    if (arg == "-c" || arg == "-MD" || arg == "-MMD" || arg == "-MP")
+        return 1;
+
+    if (!arg.compare(0, 3, "-MT") || !arg.compare(0, 3, "-MQ"))
+        return arg.size() > 3 ? 1 : 2;
+
+    return 0;
+}
+
+static std::vector<char*> toargv(const string_vector &args)
+{
+    std::vector<char*> argv;
+
+    for (const auto &arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+
+    argv.push_back(nullptr);
+    return argv;
+}
+
+static void putu64(std::string &data, ullong val)
+{
+    for (int i = 0; i < 8; ++i)
+        data += (char)(val >> (i * 8));
+}
+
+static ullong getu64(const char *p)
+{
+    ullong val = 0;
+
+    for (int i = 0; i < 8; ++i)
+        val |= (ullong)(unsigned char)p[i] << (i * 8);
+
+    return val;
+}
+
+/*
+ * Bundle: magic, then sections of
+ * tag, compressed flag, raw size, stored size, data
+ */
+
+static void putsection(std::string &bundle, char tag, const std::string &data)
+{
+    bundle += tag;
+
+#ifdef HAVE_ZLIB
+    if (data.size() > 64)
+    {
+        std::string compressed;
+        uLongf len = compressBound(data.size());
+
+        compressed.resize(len);
+
+        if (compress2(reinterpret_cast<Bytef*>(&compressed[0]), &len,
+                      reinterpret_cast<const Bytef*>(data.c_str()),
+                      data.size(), 1) == Z_OK && len < data.size())
+        {
+            compressed.resize(len);
+
+            bundle += 'z';
+            putu64(bundle, data.size());
+            putu64(bundle, compressed.size());
+            bundle += compressed;
+            return;
+        }
+    }
+#endif
+
+    bundle += 'r';
+    putu64(bundle, data.size());
+    putu64(bundle, data.size());
+    bundle += data;
+}
+
+static bool getsections(const std::string &bundle, std::map<char, std::string> &sections,
+                        const char *magic = BUNDLEMAGIC)
+{
+    size_t pos = std::strlen(magic);
+
+    if (bundle.compare(0, pos, magic))
+        return false;
+
+    while (pos < bundle.size())
+    {
+        if (bundle.size() - pos < 18)
+            return false;
+
+        char tag = bundle[pos];
+        char mode = bundle[pos+1];
+        ullong rawsize = getu64(&bundle[pos+2]);
+        ullong storedsize = getu64(&bundle[pos+10]);
+
+        pos += 18;
+
+        if (bundle.size() - pos < storedsize)
+            return false;
+
+        std::string &data = sections[tag];
+
+        if (mode == 'r' && rawsize == storedsize)
+        {
+            data.assign(bundle, pos, storedsize);
+        }
+#ifdef HAVE_ZLIB
+        else if (mode == 'z')
+        {
+            uLongf len = rawsize;
+            data.resize(rawsize);
+
+            if (uncompress(reinterpret_cast<Bytef*>(&data[0]), &len,
+                           reinterpret_cast<const Bytef*>(&bundle[pos]),
+                           storedsize) != Z_OK || len != rawsize)
+            {
+                return false;
+            }
+        }
+#endif
+        else
+        {
+            return false;
+        }
+
+        pos += storedsize;
+    }
+
+    return true;
+}
+
+static void writeerr(const std::string &err)
+{
+    if (isterminal())
+    {
+        std::cerr << err << std::flush;
+        return;
+    }
+
+    /*
+     * Strip color escape sequences
+     * when not writing to a terminal
+     */
+
+    std::string plain;
+
+    for (size_t i = 0; i < err.size(); ++i)
+    {
+        if (err[i] == '\x1b' && i+1 < err.size() && err[i+1] == '[')
+        {
+            i += 2;
+            while (i < err.size() && (err[i] < '@' || err[i] > '~')) ++i;
+            continue;
+        }
+
+        plain += err[i];
+    }
+
+    std::cerr << plain << std::flush;
+}
+
+static std::string escapedeptarget(const std::string &target)
+{
+    std::string escaped;
+
+    for (char c : target)
+    {
+        if (c == ' ' || c == '#') escaped += '\\';
+        else if (c == '$') escaped += '$';
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+static ullong getcachesize()
+{
+    return parsesize(getenvvar("WCLANG_OBJECT_CACHE_SIZE"), DEFAULTCACHESIZE);
+}
+
+struct cachefile {
+    std::string path;
+    ullong size;
+    ullong mtime;
+};
+
+static void listcachefiles(const std::string &dir, std::vector<cachefile> &files)
+{
+    string_vector entries;
+    struct stat st;
+
+    if (!listfiles(dir.c_str(), &entries))
+        return;
+
+    for (const auto &entry : entries)
+    {
+        cachefile file;
+        file.path = dir + "/" + entry;
+
+        if (stat(file.path.c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        file.size = st.st_size;
+        file.mtime = getmtime(st);
+        files.push_back(file);
+    }
+}
+
+static void cleanupdir(const std::string &dir)
+{
+    std::vector<cachefile> files;
+    ullong limit = getcachesize() / CACHESUBDIRS;
+    ullong total = 0;
+    ullong now = time(nullptr) * 1000000000ULL;
+
+    listcachefiles(dir, files);
+
+    for (auto it = files.begin(); it != files.end();)
+    {
+        /* leftovers of crashed writers */
+        if (it->path.find(".tmp.") != std::string::npos &&
+            it->mtime + 3600 * 1000000000ULL < now)
+        {
+            unlink(it->path.c_str());
+            it = files.erase(it);
+            continue;
+        }
+
+        total += it->size;
+        ++it;
+    }
+
+    if (total <= limit)
+        return;
+
+    std::sort(files.begin(), files.end(), [](const cachefile &a, const cachefile &b)
+    {
+        return a.mtime < b.mtime;
+    });
+
+    for (const auto &file : files)
+    {
+        if (total <= limit / 10 * 9)
+            break;
+
+        if (!unlink(file.path.c_str()))
+            total -= file.size;
+    }
+}
+
+/*
+ * Remote cache
+ *
+ * Entries are fetched with GET <url>/<key> and published with
+ * PUT <url>/<key>, the body is the bundle.
+ */
+
+static bool getremotecache(httpurl &url)
+{
+    const char *p = getenvvar("WCLANG_REMOTE_CACHE");
+
+    if (!p || !*p)
+        return false;
+
+    if (!parsehttpurl(p, url))
+    {
+        warn("invalid WCLANG_REMOTE_CACHE url: %", p);
+        return false;
+    }
+
+    return true;
+}
+
+static int getremotetimeout()
+{
+    const char *p = getenvvar("WCLANG_REMOTE_CACHE_TIMEOUT");
+    int timeout = p ? std::atoi(p) : 0;
+
+    return timeout > 0 ? timeout : DEFAULTREMOTETIMEOUT;
+}
+
+static bool fetchremote(const httpurl &url, const std::string &key, std::string &bundle, bool verbose)
+{
+    int status = httprequest(url, "GET", "/" + key, nullptr, &bundle, getremotetimeout());
+
+    if (status == 200)
+        return true;
+
+    /* unreachable, timed out or failing: compile */
+    if (status != 404)
+    {
+        if (verbose)
+            verbosemsg("remote cache: GET failed (%)", status);
+
+        countcachestat('E');
+    }
+
+    return false;
+}
+
+/*
+ * Uploads in a detached process, the build does not wait for it
+ */
+static void storeremote(const httpurl &url, const std::string &key, const std::string &bundle)
+{
+    const char *p = getenvvar("WCLANG_REMOTE_CACHE_READONLY");
+
+    if (p && *p == '1')
+        return;
+
+    /*
+     * Upload in a grandchild, which is reparented to init, so
+     * in-process callers (libwclang, wclangd) are left no zombie
+     */
+
+    pid_t pid = fork();
+
+    if (pid == -1)
+        return;
+
+    if (pid != 0)
+    {
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR);
+        return;
+    }
+
+    if (fork() != 0)
+        _exit(0);
+
+    /* keep make's output pipes and our terminal out of it */
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+    setsid();
+
+    for (int fd = 0; fd < 3 && null != -1; ++fd)
+        dup2(null, fd);
+
+    httprequest(url, "PUT", "/" + key, &bundle, nullptr, UPLOADTIMEOUT);
+    _exit(0);
+}
+
+bool runobjectcache(char **cargs, bool verbose, int &status, struct rusage *usage,
+                    const customcompile *custom)
+{
+    compilestep cs;
+    std::string cachedir;
+    std::string basedir;
+    char cwd[PATH_MAX];
+    char compiler[PATH_MAX];
+    const char *p;
+    struct stat st;
+
+    if (!getcachedir(cachedir) || !getcwd(cwd, sizeof(cwd)))
+        return false;
+
+    if (!analyze(cargs, cs))
+    {
+        if (verbose)
+            verbosemsg("%", "object cache: command is not cacheable");
+
+        countcachestat('U');
+        return false;
+    }
+
+    basedir = (p = getenvvar("WCLANG_OBJECT_CACHE_BASEDIR")) && *p ? p : cwd;
+    normalizepaths(cs.args, basedir, cwd);
+
+    /*
+     * Preprocess
+     */
+
+    string_vector ppargs;
+    std::string preprocessed;
+    std::string pperr;
+
+    for (size_t i = 0; i < cs.args.size();)
+    {
+        if (size_t n = i ? skiparg(cs.args, i, true) : 0)
+        {
+            i += n;
+            continue;
+        }
+
+        if (custom && i == cs.input)
+            ppargs.insert(ppargs.end(), custom->ppargs.begin(), custom->ppargs.end());
+
+        ppargs.push_back(cs.args[i++]);
+    }
+
+    ppargs.push_back("-E");
+
+    if (runprocess(&toargv(ppargs)[0], &preprocessed, &pperr) != 0)
+    {
+        if (verbose)
+            verbosemsg("%", "object cache: preprocessing failed");
+
+        countcachestat('U');
+        return false;
+    }
+
+    /*
+     * Cache key
+     */
+
+    sha256 hash;
+
+    hash.updatestring(BUNDLEMAGIC);
+
+    if (!realpath(cs.args[0].c_str(), compiler) || stat(compiler, &st))
+        return false;
+
+    hash.updatestring(compiler);
+    hash.updatestring(std::to_string(st.st_size));
+    hash.updatestring(std::to_string(getmtime(st)));
+
+    for (size_t i = 1; i < cs.args.size();)
+    {
+        if (i == cs.input)
+        {
+            const char *ext = std::strrchr(cs.args[i].c_str(), '.');
+            hash.updatestring(ext ? ext : "");
+            ++i;
+            continue;
+        }
+
+        if (size_t n = skiparg(cs.args, i, false))
+        {
+            i += n;
+            continue;
+        }
+
+        /*
+         * Preprocessed output does not contain the
+         * contents of a precompiled header
+         */
+        if (cs.args[i] == "-include-pch" && i+1 < cs.args.size() &&
+            !stat(cs.args[i+1].c_str(), &st))
+        {
+            hash.updatestring(std::to_string(st.st_size));
+            hash.updatestring(std::to_string(getmtime(st)));
+        }
+
+        hash.updatestring(cs.args[i++]);
+    }
+
+    /*
+     * Debug info contains the compilation directory
+     */
+
+    if (cs.debug && !cs.prefixmap)
+        hash.updatestring(cwd);
+
+    hash.updatestring(preprocessed);
+
+    if (custom && custom->getfiles)
+    {
+        string_vector files;
+        std::string data;
+
+        custom->getfiles(preprocessed, files);
+
+        for (const auto &file : files)
+        {
+            if (!readfile(file.c_str(), data))
+                return false;
+
+            hash.updatestring(file);
+            hash.updatestring(data);
+        }
+    }
+
+    std::string key = hash.hexdigest();
+    std::string subdir = cachedir + OBJECTSDIR + "/" + key.substr(0, 2);
+    std::string entry = subdir + "/" + key.substr(2);
+    std::string bundle;
+    std::map<char, std::string> sections;
+
+    /*
+     * Lookup, the remote cache is asked on local misses
+     */
+
+    httpurl remote;
+    bool useremote = getremotecache(remote);
+    char hit = 'H';
+
+    bool found = readfile(entry.c_str(), bundle) && getsections(bundle, sections) &&
+                 sections.count('o');
+
+    if (!found && useremote && fetchremote(remote, key, bundle, verbose))
+    {
+        sections.clear();
+        found = getsections(bundle, sections) && sections.count('o');
+
+        if (found)
+        {
+            hit = 'R';
+
+            if (makedirectories(subdir) && writefileatomic(entry, bundle))
+                cleanupdir(subdir);
+        }
+    }
+
+    if (found && writefileatomic(cs.output, sections['o']))
+    {
+        if (!cs.depfile.empty())
+        {
+            std::string deps = sections['d'];
+
+            if (!cs.deptargets)
+                deps = escapedeptarget(cs.output) + deps;
+
+            writefileatomic(cs.depfile, deps);
+        }
+
+        std::cout << sections['s'] << std::flush;
+        writeerr(sections['e']);
+
+        /* mtime is used for LRU eviction */
+        utime(entry.c_str(), nullptr);
+
+        if (verbose)
+            verbosemsg("object cache: %hit %", hit == 'R' ? "remote " : "", key);
+
+        countcachestat(hit);
+        status = 0;
+        return true;
+    }
+
+    /*
+     * Compile
+     */
+
+    std::string out;
+    std::string err;
+
+    if (isterminal() && !cs.color)
+        cs.args.push_back("-fcolor-diagnostics");
+
+    /* prints its messages itself, they are not replayed */
+    if (custom)
+        status = custom->run();
+    else
+        status = runprocess(&toargv(cs.args)[0], &out, &err, -1, usage);
+
+    if (status == RUNCOMMAND_ERROR)
+    {
+        std::cerr << "invoking compiler failed" << std::endl;
+        std::cerr << cs.args[0] << " not installed?" << std::endl;
+        status = 1;
+        return true;
+    }
+
+    std::cout << out << std::flush;
+    writeerr(err);
+
+    if (verbose)
+        verbosemsg("object cache: miss %", key);
+
+    countcachestat('M');
+
+    if (status != 0)
+        return true;
+
+    std::string object;
+    std::string deps;
+
+    if (!readfile(cs.output.c_str(), object))
+        return true;
+
+    if (!cs.depfile.empty())
+    {
+        if (!readfile(cs.depfile.c_str(), deps))
+            return true;
+
+        if (!cs.deptargets)
+        {
+            size_t colon = deps.find(':');
+
+            if (colon == std::string::npos)
+                return true;
+
+            deps.erase(0, colon);
+        }
+    }
+
+    bundle = BUNDLEMAGIC;
+    putsection(bundle, 'o', object);
+    putsection(bundle, 'd', deps);
+    putsection(bundle, 's', out);
+    putsection(bundle, 'e', err);
+
+    if (makedirectories(subdir) && writefileatomic(entry, bundle))
+        cleanupdir(subdir);
+
+    if (useremote)
+        storeremote(remote, key, bundle);
+
+    return true;
+}
+
+/*
+ * Configure probes
+ */
+
+static constexpr const char* PROBEPATTERNS[] = {
+    "conftest.*",                       /* autoconf */
+    "*/CMakeFiles/CMakeTmp/*",          /* CMake try_compile */
+    "*/CMakeFiles/CMakeScratch/*",      /* CMake>=3.24 try_compile */
+    "*/CMakeFiles/*/CompilerIdC/*",     /* CMake compiler identification */
+    "*/CMakeFiles/*/CompilerIdCXX/*"
+};
+
+/*
+ * Variables the compiler driver reads
+ */
+static constexpr const char* PROBEENVVARS[] = {
+    "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH",
+    "LIBRARY_PATH", "COMPILER_PATH"
+};
+
+bool useprobecache()
+{
+    const char *p;
+    return (p = getenvvar("WCLANG_PROBE_CACHE")) && *p == '1';
+}
+
+static bool matchprobepattern(const char *pattern, const std::string &path)
+{
+    /* patterns without a slash match the file name */
+    if (!std::strchr(pattern, PATHDIV))
+        return !fnmatch(pattern, getfileName(path.c_str()), 0);
+
+    return !fnmatch(pattern, path.c_str(), 0);
+}
+
+static bool isprobefile(const std::string &file, const std::string &cwd)
+{
+    std::string path = file[0] == PATHDIV ? file : cwd + PATHDIV + file;
+    const char *p = getenvvar("WCLANG_PROBE_CACHE_PATTERNS");
+    string_vector patterns;
+
+    for (const char *pattern : PROBEPATTERNS)
+        patterns.push_back(pattern);
+
+    while (p && *p)
+    {
+        const char *end = std::strchr(p, ',');
+        if (!end) end = p + std::strlen(p);
+
+        if (end != p)
+            patterns.push_back(std::string(p, end));
+
+        p = *end ? end+1 : end;
+    }
+
+    for (const auto &pattern : patterns)
+    {
+        if (matchprobepattern(pattern.c_str(), path))
+            return true;
+    }
+
+    return false;
+}
+
+bool isconfigureprobe(char **cargs)
+{
+    std::vector<int> inputs;
+    char cwd[PATH_MAX];
+
+    if (!getcwd(cwd, sizeof(cwd)) || needresponsefile(cargs))
+        return false;
+
+    findinputfiles(cargs, inputs);
+
+    for (int i : inputs)
+    {
+        if (isprobefile(cargs[i], cwd))
+            return true;
+    }
+
+    for (char **arg = cargs+1; *arg; ++arg)
+    {
+        if (!std::strcmp(*arg, "-o") && arg[1])
+            return isprobefile(arg[1], cwd);
+
+        if (!std::strncmp(*arg, "-o", STRLEN("-o")) && (*arg)[2])
+            return isprobefile(*arg+2, cwd);
+    }
+
+    return false;
+}
+
+/*
+ * Output file of a probe, empty if it
+ * writes to stdout only
+ */
+static bool getprobeoutput(const string_vector &args, const std::vector<int> &inputs,
+                           std::string &output)
+{
+    const char *suffix = nullptr;
+    bool stdoutonly = false;
+
+    static constexpr const char* UNCACHEABLE[] = {
+        "-MD", "-MMD", "-MF", "-save-temps", "-ftime-trace", "-gsplit-dwarf"
+    };
+
+    output.clear();
+
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        const std::string &arg = args[i];
+
+        if (arg[0] == '@' || arg == "-")
+            return false;
+
+        for (const char *opt : UNCACHEABLE)
+        {
+            if (!arg.compare(0, std::strlen(opt), opt))
+                return false;
+        }
+
+        if (arg == "-c") suffix = ".o";
+        else if (arg == "-S") suffix = ".s";
+        else if (arg == "-E" || arg == "-M" || arg == "-MM" || arg == "-fsyntax-only")
+            stdoutonly = true;
+        else if (!arg.compare(0, 2, "-o"))
+            output = arg.size() > 2 ? arg.substr(2) : (i+1 < args.size() ? args[i+1] : "");
+
+        if (optionhasvalue(arg.c_str()))
+            ++i;
+    }
+
+    if (output == "-")
+        output.clear();
+
+    if (!output.empty() || (stdoutonly && !suffix))
+        return true;
+
+    /* the default name of executables depends on the target */
+    if (!suffix || inputs.size() != 1)
+        return false;
+
+    output = getfileName(args[inputs[0]].c_str());
+    size_t dot = output.find_last_of('.');
+
+    if (dot != std::string::npos)
+        output.resize(dot);
+
+    output += suffix;
+    return true;
+}
+
+bool runprobecache(char **cargs, bool verbose, int &status, struct rusage *usage)
+{
+    string_vector args;
+    std::vector<int> inputs;
+    std::string cachedir;
+    std::string output;
+    char cwd[PATH_MAX];
+    char compiler[PATH_MAX];
+    struct stat st;
+    const char *p;
+
+    if (!getcachedir(cachedir) || !getcwd(cwd, sizeof(cwd)))
+        return false;
+
+    findinputfiles(cargs, inputs);
+
+    for (char **arg = cargs; *arg; ++arg)
+        args.push_back(*arg);
+
+    /*
+     * CMake runs each try_compile in a new directory,
+     * the probe is compiled with paths relative to it
+     */
+
+    normalizepaths(args, cwd, cwd);
+
+    if (inputs.empty() || !getprobeoutput(args, inputs, output))
+    {
+        if (verbose)
+            verbosemsg("%", "probe cache: command is not cacheable");
+
+        return false;
+    }
+
+    /*
+     * Cache key: toolchain identity, arguments, inputs
+     */
+
+    sha256 hash;
+
+    hash.updatestring(PROBEMAGIC);
+
+    if (!realpath(args[0].c_str(), compiler) || stat(compiler, &st))
+        return false;
+
+    hash.updatestring(compiler);
+    hash.updatestring(std::to_string(st.st_size));
+    hash.updatestring(std::to_string(getmtime(st)));
+
+    for (size_t i = 1; i < args.size(); ++i)
+        hash.updatestring(args[i]);
+
+    for (int i : inputs)
+    {
+        std::string data;
+
+        if (!readfile(args[i].c_str(), data))
+            return false;
+
+        hash.updatestring(data);
+    }
+
+    for (const char *var : PROBEENVVARS)
+    {
+        hash.updatestring(var);
+        hash.updatestring((p = getenvvar(var)) ? p : "");
+    }
+
+    /*
+     * Probes check for headers and libraries, adding one to the
+     * searched directories (or the mingw lib directory next to an
+     * include directory) changes their mtime
+     */
+
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        const std::string &arg = args[i];
+        std::string dir;
+
+        if ((arg == "-isystem" || arg == "-I" || arg == "-L") && i+1 < args.size())
+            dir = args[i+1];
+        else if (arg.size() > 2 && (!arg.compare(0, 2, "-I") || !arg.compare(0, 2, "-L")))
+            dir = arg.substr(2);
+        else
+            continue;
+
+        for (const std::string &path : { dir, dir + "/../lib" })
+        {
+            if (!stat(path.c_str(), &st))
+            {
+                hash.updatestring(path);
+                hash.updatestring(std::to_string(getmtime(st)));
+            }
+        }
+    }
+
+    std::string key = hash.hexdigest();
+    std::string subdir = cachedir + PROBESDIR + "/" + key.substr(0, 2);
+    std::string entry = subdir + "/" + key.substr(2);
+    std::string bundle;
+    std::map<char, std::string> sections;
+
+    /*
+     * Lookup, failed probes are replayed as well
+     */
+
+    if (readfile(entry.c_str(), bundle) && getsections(bundle, sections, PROBEMAGIC) &&
+        sections.count('x'))
+    {
+        if (sections.count('o'))
+        {
+            if (!writefileatomic(output, sections['o']))
+                return false;
+
+            chmod(output.c_str(), std::strtoul(sections['m'].c_str(), nullptr, 8));
+        }
+        else if (!output.empty())
+        {
+            unlink(output.c_str());
+        }
+
+        std::cout << sections['s'] << std::flush;
+        writeerr(sections['e']);
+
+        utime(entry.c_str(), nullptr);
+
+        if (verbose)
+            verbosemsg("probe cache: hit %", key);
+
+        countcachestat('P');
+        status = std::atoi(sections['x'].c_str());
+        return true;
+    }
+
+    /*
+     * Run
+     */
+
+    std::string out;
+    std::string err;
+
+    status = runprocess(&toargv(args)[0], &out, &err, -1, usage);
+
+    if (status == RUNCOMMAND_ERROR)
+    {
+        std::cerr << "invoking compiler failed" << std::endl;
+        std::cerr << args[0] << " not installed?" << std::endl;
+        status = 1;
+        return true;
+    }
+
+    std::cout << out << std::flush;
+    writeerr(err);
+
+    if (verbose)
+        verbosemsg("probe cache: miss %", key);
+
+    countcachestat('Q');
+
+    bundle = PROBEMAGIC;
+    putsection(bundle, 'x', std::to_string(status));
+    putsection(bundle, 's', out);
+    putsection(bundle, 'e', err);
+
+    if (status == 0 && !output.empty())
+    {
+        std::string data;
+        char mode[8];
+
+        if (!readfile(output.c_str(), data) || stat(output.c_str(), &st))
+            return true;
+
+        snprintf(mode, sizeof(mode), "%o", (unsigned)(st.st_mode & 0777));
+
+        putsection(bundle, 'o', data);
+        putsection(bundle, 'm', mode);
+    }
+
+    if (makedirectories(subdir) && writefileatomic(entry, bundle))
+        cleanupdir(subdir);
+
+    return true;
+}
+
+void printobjectcachestats()
+{
+    std::string dir;
+    cachestats stats;
+    std::vector<cachefile> files;
+    ullong size = 0;
+    char buf[3];
+
+    if (!getcachedir(dir))
+        return;
+
+    readcachestats(stats);
+
+    ullong hits = stats['H'], misses = stats['M'], uncacheable = stats['U'];
+    ullong remotehits = stats['R'], remoteerrors = stats['E'];
+    ullong probehits = stats['P'], probemisses = stats['Q'];
+
+    for (int i = 0; i < CACHESUBDIRS; ++i)
+    {
+        snprintf(buf, sizeof(buf), "%02x", i);
+        listcachefiles(dir + OBJECTSDIR + "/" + buf, files);
+    }
+
+    for (const auto &file : files)
+        size += file.size;
+
+    std::cout << "object cache entries: " << files.size() << std::endl;
+    std::cout << "object cache size: " << size / 1024 << " KiB (limit: "
+              << getcachesize() / 1024 << " KiB)" << std::endl;
+    std::cout << "object cache hits: " << hits << std::endl;
+    std::cout << "object cache misses: " << misses << std::endl;
+    std::cout << "object cache uncacheable: " << uncacheable << std::endl;
+
+    if (remotehits + remoteerrors)
+    {
+        std::cout << "object cache remote hits: " << remotehits << std::endl;
+        std::cout << "object cache remote errors: " << remoteerrors << std::endl;
+    }
+
+    if (hits + remotehits + misses)
+    {
+        std::cout << "object cache hit rate: " << ((hits + remotehits) * 100.0 /
+                                                   (hits + remotehits + misses))
+                  << "%" << std::endl;
+    }
+
+    if (probehits + probemisses)
+    {
+        std::cout << "probe cache hits: " << probehits << std::endl;
+        std::cout << "probe cache misses: " << probemisses << std::endl;
+    }
+}
+
+static size_t clearentries(const char *subdir)
+{
+    std::string dir;
+    std::vector<cachefile> files;
+    size_t n = 0;
+    char buf[3];
+
+    if (!getcachedir(dir))
+        return 0;
+
+    for (int i = 0; i < CACHESUBDIRS; ++i)
+    {
+        snprintf(buf, sizeof(buf), "%02x", i);
+        listcachefiles(dir + subdir + "/" + buf, files);
+    }
+
+    for (const auto &file : files)
+    {
+        if (!unlink(file.path.c_str()))
+            ++n;
+    }
+
+    return n;
+}
+
+size_t clearobjectcache()
+{
+    return clearentries(OBJECTSDIR);
+}
+
+size_t clearprobecache()
+{
+    return clearentries(PROBESDIR);
+}
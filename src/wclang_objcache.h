@@ -0,0 +1,58 @@
+/*
+ * Object cache
+ *
+ * Caches the results of compile steps (-c) below
+ * <cachedir>/objects, keyed by the SHA-256 of the compiler
+ * identity, the rewritten arguments and the preprocessed source.
+ *
+ * Absolute paths below $WCLANG_OBJECT_CACHE_BASEDIR (default: the
+ * working directory) are rewritten to relative paths before
+ * compiling, so that different checkouts share cache entries.
+ *
+ * The cache is bounded by $WCLANG_OBJECT_CACHE_SIZE (default: 5G),
+ * least recently used entries are evicted first.
+ *
+ * With $WCLANG_REMOTE_CACHE=<http url>, misses are looked up in a
+ * shared cache (GET <url>/<key>) and new entries are uploaded in the
+ * background (PUT <url>/<key>), see wclang-cache-server.
+ */
+
+bool useobjectcache();
+
+/*
+ * Compile steps which are not run by the compiler itself
+ * (resource scripts): 'ppargs' are inserted before the input
+ * when preprocessing, 'getfiles' lists the files the step reads
+ * besides the preprocessed input, 'run' compiles on a miss.
+ */
+struct customcompile {
+    string_vector ppargs;
+    std::function<void (const std::string &preprocessed, string_vector &files)> getfiles;
+    std::function<int ()> run;
+};
+
+/*
+ * Returns false if the command can not be cached,
+ * 'status' is the exit status of the compile step otherwise.
+ * 'usage' receives the compiler's resource usage on misses.
+ */
+bool runobjectcache(char **cargs, bool verbose, int &status, struct rusage *usage = nullptr,
+                    const customcompile *custom = nullptr);
+
+void printobjectcachestats();
+size_t clearobjectcache();
+
+/*
+ * Configure probe cache
+ *
+ * Replays compile and link probes of configure scripts and CMake
+ * try_compile (conftest.*, CMakeFiles/CMakeTmp, ...; more patterns
+ * in $WCLANG_PROBE_CACHE_PATTERNS) from <cachedir>/probes, keyed by
+ * the compiler identity, the arguments, the inputs and the mtime of
+ * the searched directories. Failed probes are cached as well.
+ */
+
+bool useprobecache();
+bool isconfigureprobe(char **cargs);
+bool runprobecache(char **cargs, bool verbose, int &status, struct rusage *usage = nullptr);
+size_t clearprobecache();
@@ -0,0 +1,436 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <tuple>
+#include <map>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_cache.h"
+#include "wclang_parallel.h"
+#include "wclang_process.h"
+#include "wclang_admission.h"
+
+static constexpr char DURATIONSFILE[] = "/durations";
+static constexpr char DURATIONSLOCKFILE[] = "/durations.lock";
+
+/* files remembered, the least recently compiled ones are dropped */
+static constexpr size_t MAXDURATIONS = 50000;
+
+/* retry interval for jobs waiting for admission */
+static constexpr int ADMISSIONPOLLMS = 50;
+
+struct compilejob {
+    std::vector<char*> argv;
+    std::string input;
+    std::string path;
+    pid_t pid;
+    int out;
+    int err;
+    std::string outdata;
+    std::string errdata;
+    int status;
+    bool done;
+    time_point start;
+    ullong duration;
+    admission adm;
+
+    compilejob() : pid(-1), out(-1), err(-1), status(), done(), start(), duration() {}
+};
+
+typedef std::map<std::string, ullong> durationmap;
+typedef std::vector<std::pair<std::string, ullong>> durationlist;
+
+int getjobcount(const char *value)
+{
+    char *end;
+    long n;
+
+    if (!value || !*value)
+    {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int)n : 1;
+    }
+
+    n = std::strtol(value, &end, 10);
+
+    if (*end || n < 1 || n > 1024)
+        return -1;
+
+    return (int)n;
+}
+
+bool isparallelcompile(char **cargs)
+{
+    /*
+     * Options which refer to a single output
+     * or change the meaning of following inputs
+     */
+    static constexpr const char* SINGLEOUTPUT[] = {
+        "-o", "-x", "-MF", "-MT", "-MQ", "-MJ", "-E", "-S", "-M", "-MM", "-###"
+    };
+
+    std::vector<int> inputs;
+
+    findinputfiles(cargs, inputs);
+
+    if (inputs.size() < 2)
+        return false;
+
+    for (int i = 1; cargs[i]; ++i)
+    {
+        const char *arg = cargs[i];
+
+        if (*arg == '@' || !std::strcmp(arg, "-"))
+            return false;
+
+        if (*arg != '-')
+            continue;
+
+        for (const char *opt : SINGLEOUTPUT)
+        {
+            size_t len = std::strlen(opt);
+
+            if (!std::strncmp(arg, opt, len) &&
+                (!arg[len] || (len == 2 && (opt[1] == 'o' || opt[1] == 'x'))))
+            {
+                return false;
+            }
+        }
+
+        if (!std::strncmp(arg, "-save-temps", STRLEN("-save-temps")))
+            return false;
+
+        if (optionhasvalue(arg) && cargs[i+1])
+            ++i;
+    }
+
+    return true;
+}
+
+static std::string absolutepath(const std::string &file)
+{
+    char path[PATH_MAX];
+
+    if (realpath(file.c_str(), path))
+        return path;
+
+    if (!getcwd(path, sizeof(path)))
+        return file;
+
+    return std::string(path) + "/" + file;
+}
+
+/*
+ * One "<duration> <path>" line per file,
+ * least recently compiled first
+ */
+static void loaddurations(durationlist &durations)
+{
+    std::string dir;
+    std::string data;
+
+    if (!getcachedir(dir) || !readfile((dir + DURATIONSFILE).c_str(), data))
+        return;
+
+    std::stringstream lines(data);
+    std::string line;
+
+    while (std::getline(lines, line))
+    {
+        size_t space = line.find(' ');
+
+        if (space == std::string::npos)
+            continue;
+
+        durations.push_back({ line.substr(space+1), std::strtoull(line.c_str(), nullptr, 10) });
+    }
+}
+
+static void storedurations(const std::vector<compilejob> &jobs)
+{
+    durationlist durations;
+    durationmap updated;
+    std::string dir;
+    std::string data;
+
+    for (const auto &job : jobs)
+    {
+        if (job.done && job.status == 0)
+            updated[job.path] = job.duration;
+    }
+
+    if (updated.empty() || !getcachedir(dir) || !makedirectories(dir))
+        return;
+
+    int lockfd = open((dir + DURATIONSLOCKFILE).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (lockfd == -1)
+        return;
+
+    while (flock(lockfd, LOCK_EX) == -1 && errno == EINTR);
+
+    /*
+     * Merge with what other invocations wrote in the meantime,
+     * our files move to the end
+     */
+
+    loaddurations(durations);
+
+    durations.erase(std::remove_if(durations.begin(), durations.end(),
+                                   [&](const durationlist::value_type &duration)
+                                   { return updated.count(duration.first) != 0; }),
+                    durations.end());
+
+    durations.insert(durations.end(), updated.begin(), updated.end());
+
+    size_t first = durations.size() > MAXDURATIONS ? durations.size() - MAXDURATIONS : 0;
+
+    for (size_t i = first; i < durations.size(); ++i)
+        data += std::to_string(durations[i].second) + " " + durations[i].first + "\n";
+
+    writefileatomic(dir + DURATIONSFILE, data);
+    close(lockfd);
+}
+
+static bool startjob(compilejob &job)
+{
+    job.start = getticks();
+    job.pid = spawnprocess(&job.argv[0], &job.out, &job.err);
+
+    if (job.pid == -1)
+    {
+        releaseadmission(job.adm, RUNCOMMAND_ERROR);
+        return false;
+    }
+
+    addtocgroup(job.adm, job.pid);
+    return true;
+}
+
+static void finishjob(compilejob &job)
+{
+    struct rusage usage;
+
+    job.status = waitprocess(job.pid, &usage);
+
+    if (job.status == RUNCOMMAND_ERROR)
+        job.status = 1;
+
+    releaseadmission(job.adm, job.status, &usage);
+
+    time_point end = getticks();
+
+    job.duration = getmicrodiff(job.start, end);
+    job.done = true;
+
+    traceevent("compile " + job.input, job.start, end, job.pid,
+               "\"status\":" + std::to_string(job.status));
+}
+
+int runparallel(char **cargs, int jobcount, bool verbose)
+{
+    std::vector<compilejob> jobs;
+    std::vector<size_t> order;
+    std::vector<int> inputs;
+    std::vector<ullong> expected;
+    durationlist known;
+    durationmap durations;
+    bool color = false;
+
+    findinputfiles(cargs, inputs);
+
+    for (char **arg = cargs; *arg; ++arg)
+    {
+        if (!std::strcmp(*arg, "-fcolor-diagnostics") ||
+            !std::strcmp(*arg, "-fno-color-diagnostics"))
+        {
+            color = true;
+        }
+    }
+
+    /*
+     * One job per input, all other arguments are kept as they are
+     */
+
+    jobs.resize(inputs.size());
+
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        compilejob &job = jobs[i];
+
+        for (int j = 0; cargs[j]; ++j)
+        {
+            if (j != inputs[i] && std::find(inputs.begin(), inputs.end(), j) != inputs.end())
+                continue;
+
+            job.argv.push_back(cargs[j]);
+        }
+
+        /* output is piped, keep colors if we are writing to a terminal */
+        if (!color && isterminal())
+            job.argv.push_back(const_cast<char*>("-fcolor-diagnostics"));
+
+        job.argv.push_back(nullptr);
+        job.input = cargs[inputs[i]];
+        job.path = absolutepath(job.input);
+        order.push_back(i);
+    }
+
+    /*
+     * Longest first, unknown files are assumed to be long
+     */
+
+    loaddurations(known);
+    durations.insert(known.begin(), known.end());
+
+    for (const auto &job : jobs)
+    {
+        auto it = durations.find(job.path);
+        expected.push_back(it != durations.end() ? it->second : ULLONG_MAX);
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return expected[a] > expected[b];
+    });
+
+    if (verbose)
+        verbosemsg("compiling % files with % jobs", jobs.size(), jobcount);
+
+    size_t next = 0;
+    size_t running = 0;
+    size_t flushed = 0;
+    int status = 0;
+
+    bool admission = useadmission();
+
+    while (flushed < jobs.size())
+    {
+        bool waiting = false;
+
+        while (running < (size_t)jobcount && next < order.size())
+        {
+            compilejob &job = jobs[order[next]];
+
+            /*
+             * Each job passes the memory admission on its own, without
+             * blocking, the output of the running ones is still read
+             */
+            if (admission && !job.adm.held())
+                queueadmission(&job.argv[0], false, job.adm);
+
+            if (!tryadmission(job.adm))
+            {
+                waiting = true;
+                break;
+            }
+
+            ++next;
+
+            if (startjob(job))
+            {
+                ++running;
+                continue;
+            }
+
+            job.errdata = "invoking compiler failed\n";
+            job.errdata += std::string(job.argv[0]) + " not installed?\n";
+            job.status = 1;
+            job.done = true;
+        }
+
+        std::vector<pollfd> pfds;
+
+        for (const auto &job : jobs)
+        {
+            if (job.out != -1) pfds.push_back({ job.out, POLLIN, 0 });
+            if (job.err != -1) pfds.push_back({ job.err, POLLIN, 0 });
+        }
+
+        if ((!pfds.empty() || waiting) &&
+            poll(pfds.data(), pfds.size(), waiting ? ADMISSIONPOLLMS : -1) == -1 && errno != EINTR)
+        {
+            break;
+        }
+
+        for (auto &job : jobs)
+        {
+            for (int *fd : { &job.out, &job.err })
+            {
+                auto pfd = std::find_if(pfds.begin(), pfds.end(), [&](const pollfd &p)
+                {
+                    return p.fd == *fd;
+                });
+
+                if (*fd == -1 || pfd == pfds.end() || !pfd->revents)
+                    continue;
+
+                char buf[65536];
+                ssize_t len = read(*fd, buf, sizeof(buf));
+
+                if (len > 0)
+                {
+                    (fd == &job.out ? job.outdata : job.errdata).append(buf, len);
+                }
+                else if (len == 0 || errno != EINTR)
+                {
+                    close(*fd);
+                    *fd = -1;
+                }
+            }
+
+            if (job.pid != -1 && !job.done && job.out == -1 && job.err == -1)
+            {
+                finishjob(job);
+                --running;
+            }
+        }
+
+        /*
+         * Write output in input order
+         */
+
+        for (; flushed < jobs.size() && jobs[flushed].done; ++flushed)
+        {
+            compilejob &job = jobs[flushed];
+
+            std::cout << job.outdata << std::flush;
+            std::cerr << job.errdata << std::flush;
+
+            if (!status && job.status)
+                status = job.status;
+        }
+    }
+
+    storedurations(jobs);
+    return status;
+}
@@ -0,0 +1,18 @@
+/*
+ * Parallel compile steps (-wc-jobs=N)
+ *
+ * A compile step with several source files is split into one compiler
+ * invocation per translation unit. Output of the jobs is buffered and
+ * written in the order of the input files. Files that took longest on
+ * previous runs (<cachedir>/durations) are started first.
+ */
+
+int getjobcount(const char *value);
+
+/*
+ * Returns true if 'cargs' compiles more than one
+ * input and can be split into independent jobs
+ */
+bool isparallelcompile(char **cargs);
+
+int runparallel(char **cargs, int jobs, bool verbose);
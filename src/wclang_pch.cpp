@@ -0,0 +1,493 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <ctime>
+#include <climits>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_cache.h"
+#include "wclang_hash.h"
+#include "wclang_pch.h"
+#include "wclang_process.h"
+
+static constexpr char PCHDIR[] = "/pch";
+static constexpr char PCHMAGIC[] = "wclang-pch 1";
+static constexpr char DEFAULTHEADERS[] =
+    "windows.h,string,vector,map,memory,algorithm,functional";
+
+/*
+ * Headers may be modified while the PCH is being built,
+ * and file timestamps lag behind the real time clock
+ */
+static constexpr ullong BUILDMARGINNS = 1000000000ULL;
+
+/*
+ * Do not retry failed builds for an hour
+ */
+static constexpr ullong FAILEDRETRYNS = 3600 * 1000000000ULL;
+
+static ullong getrealtime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool useautopch()
+{
+    const char *p;
+    return (p = getenvvar("WCLANG_AUTO_PCH")) && *p == '1';
+}
+
+static void getheaderset(std::set<std::string> &headers)
+{
+    const char *p = getenvvar("WCLANG_AUTO_PCH_HEADERS");
+    std::string list = p && *p ? p : DEFAULTHEADERS;
+    std::string header;
+
+    for (char c : list + ",")
+    {
+        if (c == ',' || c == ' ')
+        {
+            if (!header.empty()) headers.insert(header);
+            header.clear();
+            continue;
+        }
+
+        header += c;
+    }
+}
+
+static const char *getheaderlanguage(const std::string &file)
+{
+    static constexpr const char* CXXEXTENSIONS[] = {
+        "cpp", "cc", "cxx", "c++", "cp", "C"
+    };
+
+    size_t dot = file.find_last_of('.');
+
+    if (dot == std::string::npos)
+        return nullptr;
+
+    std::string ext(file, dot+1);
+
+    if (ext == "c")
+        return "c-header";
+
+    for (const char *cxxext : CXXEXTENSIONS)
+        if (ext == cxxext) return "c++-header";
+
+    return nullptr;
+}
+
+/*
+ * Collects the leading #include <...> directives of 'file' as long as
+ * they name headers of the configured set. Anything else (macros,
+ * conditionals, other includes) ends the prefix, as it may change
+ * what the following headers expand to.
+ */
+static bool getincludeprefix(const std::string &file, const std::set<std::string> &headers,
+                             string_vector &prefix)
+{
+    std::string data;
+    size_t i = 0;
+
+    if (!readfile(file.c_str(), data))
+        return false;
+
+    size_t n = data.size();
+
+    while (true)
+    {
+        while (i < n)
+        {
+            if (isspace((unsigned char)data[i]))
+                ++i;
+            else if (!data.compare(i, 2, "//"))
+                i = std::min(data.find('\n', i), n);
+            else if (!data.compare(i, 2, "/*"))
+                i = std::min(data.find("*/", i+2), n-2) + 2;
+            else
+                break;
+        }
+
+        if (i >= n || data[i] != '#')
+            break;
+
+        size_t eol = std::min(data.find('\n', i), n);
+        std::string line(data, i+1, eol-i-1);
+        size_t p = line.find_first_not_of(" \t");
+
+        i = eol;
+
+        if (p == std::string::npos)
+            break;
+
+        if (!line.compare(p, STRLEN("pragma"), "pragma"))
+        {
+            p = line.find_first_not_of(" \t", p + STRLEN("pragma"));
+
+            if (p != std::string::npos && !line.compare(p, STRLEN("once"), "once"))
+                continue;
+
+            break;
+        }
+
+        if (line.compare(p, STRLEN("include"), "include"))
+            break;
+
+        p = line.find_first_not_of(" \t", p + STRLEN("include"));
+
+        if (p == std::string::npos || line[p] != '<')
+            break;
+
+        size_t end = line.find('>', p);
+
+        if (end == std::string::npos)
+            break;
+
+        std::string header(line, p+1, end-p-1);
+
+        if (!headers.count(header))
+            break;
+
+        if (std::find(prefix.begin(), prefix.end(), header) == prefix.end())
+            prefix.push_back(header);
+    }
+
+    return !prefix.empty();
+}
+
+static void parsedepfile(const std::string &data, string_vector &deps)
+{
+    size_t colon = data.find(": ");
+    std::string dep;
+
+    if (colon == std::string::npos)
+        return;
+
+    for (size_t i = colon+1; i <= data.size(); ++i)
+    {
+        char c = i < data.size() ? data[i] : '\n';
+
+        if (c == '\\' && i+1 < data.size())
+        {
+            if (data[i+1] == ' ')
+            {
+                dep += ' ';
+                ++i;
+                continue;
+            }
+
+            if (data[i+1] == '\n')
+            {
+                ++i;
+                c = '\n';
+            }
+        }
+
+        if (isspace((unsigned char)c))
+        {
+            if (!dep.empty()) deps.push_back(dep);
+            dep.clear();
+            continue;
+        }
+
+        dep += c;
+    }
+}
+
+static bool isvalid(const std::string &base)
+{
+    std::string data;
+    std::string line;
+    struct stat st;
+    ullong buildstart;
+
+    if (!readfile((base + ".deps").c_str(), data) || stat((base + ".pch").c_str(), &st))
+        return false;
+
+    std::stringstream lines(data);
+
+    if (!std::getline(lines, line) || line.compare(0, STRLEN(PCHMAGIC), PCHMAGIC))
+        return false;
+
+    buildstart = std::strtoull(line.c_str() + STRLEN(PCHMAGIC), nullptr, 10);
+
+    while (std::getline(lines, line))
+    {
+        if (stat(line.c_str(), &st) || getmtime(st) > buildstart)
+            return false;
+    }
+
+    return true;
+}
+
+static bool hasfailed(const std::string &base)
+{
+    struct stat st;
+    return !stat((base + ".failed").c_str(), &st) && getmtime(st) + FAILEDRETRYNS > getrealtime();
+}
+
+static bool buildpch(const std::string &base, const string_vector &args,
+                     const char *language, const string_vector &headers, bool verbose)
+{
+    tracescope trace("auto-pch build");
+    std::string header;
+    std::string out, err;
+    std::string tmppch = base + ".pch.tmp." + std::to_string(getpid());
+    std::string tmpdeps = base + ".d.tmp." + std::to_string(getpid());
+    std::string depdata;
+    string_vector deps;
+    std::vector<char*> argv;
+
+    for (const auto &h : headers)
+        header += "#include <" + h + ">\n";
+
+    if (!writefileatomic(base + ".h", header))
+        return false;
+
+    string_vector pchargs = args;
+    std::string hdr = base + ".h";
+
+    for (const char *arg : { "-x", language, hdr.c_str(), "-o", tmppch.c_str(),
+                             "-MD", "-MF", tmpdeps.c_str() })
+    {
+        pchargs.push_back(arg);
+    }
+
+    for (auto &arg : pchargs)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+
+    argv.push_back(nullptr);
+
+    if (verbose)
+        verbosemsg("auto-pch: building %.pch", base);
+
+    ullong buildstart = getrealtime() - BUILDMARGINNS;
+    int status = runprocess(&argv[0], &out, &err);
+
+    if (status != 0 || !readfile(tmpdeps.c_str(), depdata))
+    {
+        if (verbose)
+        {
+            std::string msg = err;
+
+            while (!msg.empty() && msg.back() == '\n')
+                msg.pop_back();
+
+            verbosemsg("auto-pch: build failed:\n%", msg);
+        }
+
+        writefileatomic(base + ".failed", err);
+        unlink(tmppch.c_str());
+        unlink(tmpdeps.c_str());
+        return false;
+    }
+
+    unlink(tmpdeps.c_str());
+    parsedepfile(depdata, deps);
+
+    depdata = std::string(PCHMAGIC) + " " + std::to_string(buildstart) + "\n";
+
+    for (const auto &dep : deps)
+    {
+        if (dep != hdr)
+            depdata += dep + "\n";
+    }
+
+    /*
+     * Readers without the lock see either no .deps
+     * or a .deps matching the .pch
+     */
+
+    unlink((base + ".deps").c_str());
+
+    if (rename(tmppch.c_str(), (base + ".pch").c_str()))
+    {
+        unlink(tmppch.c_str());
+        return false;
+    }
+
+    return writefileatomic(base + ".deps", depdata);
+}
+
+int addautopch(string_vector &args, bool build, bool verbose)
+{
+    std::set<std::string> headerset;
+    string_vector headers;
+    string_vector pchargs;
+    std::vector<char*> argv;
+    std::vector<int> inputs;
+    std::string dir;
+    const char *language;
+    char compiler[PATH_MAX];
+    struct stat st;
+
+    for (auto &arg : args)
+    {
+        /* arguments which change what the headers expand to */
+        if (!arg.compare(0, 2, "-x") || arg == "-include" ||
+            arg == "-imacros" || arg == "-include-pch" || arg == "-E" || arg == "-M" ||
+            arg == "-MM" || arg == "-fsyntax-only")
+        {
+            return AUTOPCH_SKIPPED;
+        }
+
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+
+    argv.push_back(nullptr);
+    findinputfiles(&argv[0], inputs);
+
+    if (inputs.size() != 1 || !getcachedir(dir))
+        return AUTOPCH_SKIPPED;
+
+    std::string input = args[inputs[0]];
+
+    if (!(language = getheaderlanguage(input)))
+        return AUTOPCH_SKIPPED;
+
+    getheaderset(headerset);
+
+    if (!getincludeprefix(input, headerset, headers))
+        return AUTOPCH_SKIPPED;
+
+    /*
+     * Fingerprint
+     */
+
+    if (!realpath(args[0].c_str(), compiler) || stat(compiler, &st))
+        return AUTOPCH_SKIPPED;
+
+    sha256 hash;
+
+    hash.updatestring(PCHMAGIC);
+    hash.updatestring(compiler);
+    hash.updatestring(std::to_string(st.st_size));
+    hash.updatestring(std::to_string(getmtime(st)));
+    hash.updatestring(language);
+
+    for (const auto &header : headers)
+        hash.updatestring(header);
+
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        const std::string &arg = args[i];
+
+        if ((int)i == inputs[0] || arg == "-c" || arg == "-MD" || arg == "-MMD" ||
+            arg == "-MP" || arg == "-fcolor-diagnostics" || arg == "-fno-color-diagnostics")
+        {
+            continue;
+        }
+
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ")
+        {
+            ++i;
+            continue;
+        }
+
+        if (!arg.compare(0, 2, "-o") || !arg.compare(0, 3, "-MF") ||
+            !arg.compare(0, 3, "-MT") || !arg.compare(0, 3, "-MQ"))
+        {
+            continue;
+        }
+
+        hash.updatestring(arg);
+        pchargs.push_back(arg);
+    }
+
+    dir += PCHDIR;
+
+    std::string base = dir + "/" + hash.hexdigest();
+
+    if (!isvalid(base))
+    {
+        if (!build)
+            return AUTOPCH_NEEDSBUILD;
+
+        if (hasfailed(base) || !makedirectories(dir))
+            return AUTOPCH_SKIPPED;
+
+        int lockfd = open((base + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (lockfd == -1)
+            return AUTOPCH_SKIPPED;
+
+        while (flock(lockfd, LOCK_EX) == -1 && errno == EINTR);
+
+        /*
+         * Someone else may have built it while we were waiting
+         */
+
+        bool ok = isvalid(base) ||
+                  (!hasfailed(base) && buildpch(base, pchargs, language, headers, verbose));
+
+        close(lockfd);
+
+        if (!ok)
+            return AUTOPCH_SKIPPED;
+    }
+
+    if (verbose)
+        verbosemsg("auto-pch: using %.pch", base);
+
+    args.push_back("-include-pch");
+    args.push_back(base + ".pch");
+
+    return AUTOPCH_ADDED;
+}
+
+size_t clearautopch()
+{
+    std::string dir;
+    string_vector files;
+    size_t n = 0;
+
+    if (!getcachedir(dir))
+        return 0;
+
+    dir += PCHDIR;
+
+    if (!listfiles(dir.c_str(), &files))
+        return 0;
+
+    for (const auto &file : files)
+    {
+        if (file.size() > 4 && !file.compare(file.size()-4, 4, ".pch"))
+            ++n;
+
+        unlink((dir + "/" + file).c_str());
+    }
+
+    return n;
+}
@@ -0,0 +1,28 @@
+/*
+ * Automatic precompiled headers (-wc-auto-pch)
+ *
+ * If a source file starts with includes of headers listed in
+ * $WCLANG_AUTO_PCH_HEADERS (default: windows.h and a few libstdc++
+ * headers), a PCH of exactly these includes is built once per
+ * fingerprint (compiler, language, headers, arguments) below
+ * <cachedir>/pch and passed with -include-pch.
+ *
+ * The PCH is rebuilt once one of the headers it was built from
+ * changes; concurrent builders are serialized with flock().
+ */
+
+enum {
+    AUTOPCH_SKIPPED,
+    AUTOPCH_ADDED,
+    AUTOPCH_NEEDSBUILD
+};
+
+bool useautopch();
+
+/*
+ * Adds -include-pch to 'args' if applicable. If 'build' is false,
+ * AUTOPCH_NEEDSBUILD is returned instead of building a missing PCH.
+ */
+int addautopch(string_vector &args, bool build, bool verbose);
+
+size_t clearautopch();
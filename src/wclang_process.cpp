@@ -0,0 +1,257 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <spawn.h>
+#include <poll.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_process.h"
+
+int decodestatus(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+
+    return 128 + WTERMSIG(status);
+}
+
+static thread_local spawncallback spawnhook;
+
+/*
+ * posix_spawnp() searches the PATH of the process,
+ * a library context may have its own
+ */
+static std::string findprogram(const char *name)
+{
+    const char *path = getenvvar("PATH");
+
+    if (std::strchr(name, '/') || !path)
+        return name;
+
+    for (const char *p = path; ; ++p)
+    {
+        const char *end = std::strchr(p, ':');
+        std::string dir(p, end ? end : p + std::strlen(p));
+        std::string file = (dir.empty() ? "." : dir) + "/" + name;
+
+        if (!access(file.c_str(), X_OK))
+            return file;
+
+        if (!end)
+            break;
+
+        p = end;
+    }
+
+    return name;
+}
+
+void setspawnhook(spawncallback hook)
+{
+    spawnhook = hook;
+}
+
+pid_t spawnprocess(char **argv, int *out, int *err)
+{
+    posix_spawn_file_actions_t actions;
+    int outpipe[2] = { -1, -1 };
+    int errpipe[2] = { -1, -1 };
+    pid_t pid;
+
+    auto closepipes = [&]()
+    {
+        for (int fd : { outpipe[0], outpipe[1], errpipe[0], errpipe[1] })
+            if (fd != -1) close(fd);
+    };
+
+    /*
+     * The pipes are close-on-exec,
+     * dup2() clears it for the copies
+     */
+
+    if ((out && pipe2(outpipe, O_CLOEXEC)) || (err && pipe2(errpipe, O_CLOEXEC)))
+    {
+        closepipes();
+        return -1;
+    }
+
+    if (posix_spawn_file_actions_init(&actions))
+    {
+        closepipes();
+        return -1;
+    }
+
+    if (out) posix_spawn_file_actions_adddup2(&actions, outpipe[1], STDOUT_FILENO);
+    if (err) posix_spawn_file_actions_adddup2(&actions, errpipe[1], STDERR_FILENO);
+
+    std::vector<char*> env;
+    std::string program = findprogram(argv[0]);
+
+    int error = posix_spawnp(&pid, program.c_str(), &actions, nullptr, argv,
+                             getenvironment(env));
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error)
+    {
+        closepipes();
+        errno = error;
+        return -1;
+    }
+
+    if (out) { close(outpipe[1]); *out = outpipe[0]; }
+    if (err) { close(errpipe[1]); *err = errpipe[0]; }
+
+    if (spawnhook)
+        spawnhook(pid);
+
+    return pid;
+}
+
+int waitprocess(pid_t pid, struct rusage *usage)
+{
+    int status;
+
+    while (wait4(pid, &status, 0, usage) == -1)
+    {
+        if (errno != EINTR)
+            return RUNCOMMAND_ERROR;
+    }
+
+    return decodestatus(status);
+}
+
+int runprocess(char **argv, std::string *out, std::string *err, int timeoutms,
+               struct rusage *usage)
+{
+    int outfd = -1;
+    int errfd = -1;
+    pid_t pid;
+
+    if ((pid = spawnprocess(argv, out ? &outfd : nullptr, err ? &errfd : nullptr)) == -1)
+        return RUNCOMMAND_ERROR;
+
+    if (out) out->clear();
+    if (err) err->clear();
+
+    time_point start = getticks();
+    bool timedout = false;
+
+    auto remaining = [&]() -> int
+    {
+        if (timeoutms < 0)
+            return -1;
+
+        ullong elapsed = getmicrodiff(start, getticks()) / 1000;
+        return elapsed >= (ullong)timeoutms ? 0 : timeoutms - (int)elapsed;
+    };
+
+    /*
+     * Read both pipes at once, the child may block
+     * on one of them otherwise
+     */
+
+    while (outfd != -1 || errfd != -1)
+    {
+        pollfd pfds[2];
+        nfds_t n = 0;
+        int timeout = remaining();
+
+        if (outfd != -1) pfds[n++] = { outfd, POLLIN, 0 };
+        if (errfd != -1) pfds[n++] = { errfd, POLLIN, 0 };
+
+        int ready = poll(pfds, n, timeout);
+
+        if (ready == -1)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (ready == 0)
+        {
+            timedout = true;
+            break;
+        }
+
+        for (nfds_t i = 0; i < n; ++i)
+        {
+            if (!pfds[i].revents)
+                continue;
+
+            bool isout = pfds[i].fd == outfd;
+            char buf[65536];
+            ssize_t len = read(pfds[i].fd, buf, sizeof(buf));
+
+            if (len > 0)
+            {
+                (isout ? out : err)->append(buf, len);
+            }
+            else if (len == 0 || errno != EINTR)
+            {
+                close(pfds[i].fd);
+                (isout ? outfd : errfd) = -1;
+            }
+        }
+    }
+
+    if (outfd != -1) close(outfd);
+    if (errfd != -1) close(errfd);
+
+    /*
+     * Without pipes (or once they are closed),
+     * wait for the exit within the time left
+     */
+
+    while (!timedout && timeoutms >= 0)
+    {
+        int status;
+        pid_t result = wait4(pid, &status, WNOHANG, usage);
+
+        if (result == pid)
+            return decodestatus(status);
+
+        if (result == -1 && errno != EINTR)
+            return RUNCOMMAND_ERROR;
+
+        if (!remaining())
+            timedout = true;
+        else
+            poll(nullptr, 0, std::min(remaining(), 10));
+    }
+
+    if (timedout)
+    {
+        kill(pid, SIGKILL);
+        waitprocess(pid);
+        return RUNCOMMAND_ERROR;
+    }
+
+    return waitprocess(pid, usage);
+}
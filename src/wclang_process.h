@@ -0,0 +1,47 @@
+#include <sys/types.h>
+
+struct rusage;
+
+/*
+ * Child processes
+ *
+ * Programs are started with posix_spawnp(): no shell, no copy of our
+ * address space (vfork semantics) and exec failures are reported to
+ * the caller instead of surfacing as exit status 127.
+ */
+
+constexpr int RUNCOMMAND_ERROR = -100000;
+
+/*
+ * Exit status of a wait() status, 128 + N for signal N
+ */
+int decodestatus(int status);
+
+/*
+ * Starts 'argv' ($PATH lookup if argv[0] has no slash). If 'out' or
+ * 'err' are given, they receive the read end of a pipe connected to
+ * the child's stdout or stderr. Returns the pid or -1.
+ */
+pid_t spawnprocess(char **argv, int *out = nullptr, int *err = nullptr);
+
+/*
+ * Called with the pid of every child spawnprocess() starts
+ * (moving compilers into their cgroup), nullptr: none
+ */
+typedef std::function<void (pid_t pid)> spawncallback;
+void setspawnhook(spawncallback hook);
+
+/*
+ * Waits for 'pid' and returns its exit status or RUNCOMMAND_ERROR,
+ * 'usage' receives the child's resource usage (wait4())
+ */
+int waitprocess(pid_t pid, struct rusage *usage = nullptr);
+
+/*
+ * Runs 'argv' and captures all of its output. The child is killed
+ * after 'timeoutms' milliseconds (-1: no timeout). Returns the exit
+ * status or RUNCOMMAND_ERROR if it cannot be started or timed out.
+ * 'usage' receives the child's resource usage.
+ */
+int runprocess(char **argv, std::string *out = nullptr, std::string *err = nullptr,
+               int timeoutms = -1, struct rusage *usage = nullptr);
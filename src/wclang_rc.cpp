@@ -0,0 +1,588 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "wclang.h"
+#include "wclang_process.h"
+#include "wclang_objcache.h"
+#include "wclang_rc.h"
+
+struct resourcejob {
+    string_vector ppargs;
+    string_vector rcargs;
+    std::string input;
+    std::string output;
+    std::string inputformat;
+    std::string outputformat;
+
+    resourcejob() : inputformat("rc"), outputformat("coff") {}
+};
+
+static bool hasextension(const std::string &file, const char *ext)
+{
+    size_t len = std::strlen(ext);
+    return file.size() > len && !strcasecmp(file.c_str() + file.size() - len, ext);
+}
+
+/*
+ * llvm-cvtres /machine: value of the target
+ */
+static const char *getmachine(const std::string &target)
+{
+    if (!target.compare(0, STRLEN("x86_64"), "x86_64")) return "x64";
+    if (!target.compare(0, STRLEN("aarch64"), "aarch64")) return "arm64";
+    if (!target.compare(0, STRLEN("arm"), "arm") ||
+        !target.compare(0, STRLEN("thumb"), "thumb")) return "arm";
+    return "x86";
+}
+
+/*
+ * llvm-cvtres /machine: value of a windres (BFD) target name
+ */
+static const char *getbfdmachine(const std::string &target)
+{
+    if (target.find("x86-64") != std::string::npos) return "x64";
+    if (target.find("aarch64") != std::string::npos ||
+        target.find("arm64") != std::string::npos) return "arm64";
+    if (target.find("arm") != std::string::npos) return "arm";
+    if (target.find("i386") != std::string::npos) return "x86";
+    return nullptr;
+}
+
+static std::vector<char*> toargv(const string_vector &args)
+{
+    std::vector<char*> argv;
+
+    for (const auto &arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+
+    argv.push_back(nullptr);
+    return argv;
+}
+
+static int runstep(const string_vector &args, bool verbose)
+{
+    if (verbose)
+    {
+        std::string command;
+
+        for (const auto &arg : args)
+        {
+            if (!command.empty()) command += " ";
+            command += arg;
+        }
+
+        verbosemsg("resource compiler: %", command);
+    }
+
+    int status = runprocess(&toargv(args)[0]);
+
+    if (status == RUNCOMMAND_ERROR)
+    {
+        errstream() << "invoking " << args[0] << " failed" << std::endl;
+        return 1;
+    }
+
+    return status;
+}
+
+static int compileresource(const resourcejob &job, const commandargs &cmdargs)
+{
+    std::string llvmrc;
+    std::string cvtres;
+    std::string pid = std::to_string(getpid());
+    std::string preprocessed = job.output + ".rc.tmp." + pid;
+    std::string res = job.inputformat == "res" ? job.input : job.output;
+    bool cvt = job.outputformat == "coff";
+    int status = 0;
+
+    if (job.inputformat != "rc" && job.inputformat != "res")
+    {
+        errstream() << "unsupported resource input format: " << job.inputformat << std::endl;
+        return 1;
+    }
+
+    if (job.outputformat != "coff" && job.outputformat != "res")
+    {
+        errstream() << "unsupported resource output format: " << job.outputformat << std::endl;
+        return 1;
+    }
+
+    const std::string &bindir = cmdargs.compilerbinpath;
+    int version = cmdargs.clangversion.major;
+
+    if ((job.inputformat == "rc" && !findllvmtool(bindir, version, "llvm-rc", llvmrc)) ||
+        (cvt && !findllvmtool(bindir, version, "llvm-cvtres", cvtres)))
+    {
+        errstream() << "cannot find '" << (llvmrc.empty() ? "llvm-rc" : "llvm-cvtres")
+                    << "' executable" << std::endl;
+        return 1;
+    }
+
+    if (job.inputformat == "rc")
+    {
+        string_vector args = job.ppargs;
+        std::string dir = job.input;
+
+        if (cvt)
+            res = job.output + ".res.tmp." + pid;
+
+        /*
+         * Preprocess
+         */
+
+        args.push_back("-E");
+        args.push_back("-xc");
+        args.push_back("-DRC_INVOKED");
+        args.push_back(job.input);
+        args.push_back("-o");
+        args.push_back(preprocessed);
+
+        if ((status = runstep(args, cmdargs.verbose)))
+        {
+            unlink(preprocessed.c_str());
+            return status;
+        }
+
+        /*
+         * Compile, files referenced by the script are
+         * looked up relative to the original input
+         */
+
+        stripfilename(&dir[0]);
+        dir.resize(std::strlen(dir.c_str()));
+
+        args.clear();
+        args.push_back(llvmrc);
+
+        /* llvm-rc>=13 runs the preprocessor on its own */
+        if (cmdargs.clangversion == compilerver() || cmdargs.clangversion >= compilerver(13, 0))
+            args.push_back("-no-preprocess");
+
+        args.push_back("-I");
+        args.push_back(dir.empty() ? "." : dir);
+        args.insert(args.end(), job.rcargs.begin(), job.rcargs.end());
+        args.push_back("-FO");
+        args.push_back(res);
+        args.push_back(preprocessed);
+
+        status = runstep(args, cmdargs.verbose);
+        unlink(preprocessed.c_str());
+    }
+
+    /*
+     * Convert to COFF
+     */
+
+    if (!status && cvt)
+    {
+        string_vector args;
+
+        args.push_back(cvtres);
+        args.push_back(std::string("/machine:") + getmachine(cmdargs.target));
+        args.push_back("/out:" + job.output);
+        args.push_back(res);
+
+        status = runstep(args, cmdargs.verbose);
+    }
+
+    if (cvt && res != job.input)
+        unlink(res.c_str());
+
+    return status;
+}
+
+bool isresourcecompile(char **cargs)
+{
+    std::vector<int> inputs;
+    bool compileonly = false;
+
+    findinputfiles(cargs, inputs);
+
+    if (inputs.size() != 1 || !hasextension(cargs[inputs[0]], ".rc"))
+        return false;
+
+    for (char **arg = cargs+1; *arg; ++arg)
+    {
+        if (!std::strcmp(*arg, "-c"))
+            compileonly = true;
+        else if (!std::strcmp(*arg, "-E") || !std::strcmp(*arg, "-S") ||
+                 !std::strcmp(*arg, "-fsyntax-only"))
+            return false;
+    }
+
+    return compileonly;
+}
+
+int runresourcecompile(char **cargs, const commandargs &cmdargs)
+{
+    resourcejob job;
+    std::vector<int> inputs;
+    std::string depfile;
+    std::string deptarget;
+    const char *depmode = nullptr;
+
+    findinputfiles(cargs, inputs);
+    job.input = cargs[inputs[0]];
+
+    /*
+     * Preprocessor arguments are passed as they are, the
+     * output and dependency options are set up again
+     */
+
+    for (int i = 0; cargs[i]; ++i)
+    {
+        const char *arg = cargs[i];
+        const char *next = cargs[i+1];
+
+        if (i == inputs[0] || !std::strcmp(arg, "-c"))
+            continue;
+
+        if (!std::strcmp(arg, "-MD") || !std::strcmp(arg, "-MMD"))
+        {
+            depmode = arg;
+            continue;
+        }
+
+        if (!std::strcmp(arg, "-MP"))
+            continue;
+
+        if ((!std::strncmp(arg, "-o", 2) && std::strncmp(arg, "-obj", 4)) ||
+            !std::strncmp(arg, "-MF", 3) ||
+            !std::strncmp(arg, "-MT", 3) || !std::strncmp(arg, "-MQ", 3))
+        {
+            size_t len = arg[1] == 'o' ? 2 : 3;
+            const char *value = arg[len] ? arg+len : next;
+
+            if (!value)
+                continue;
+
+            if (arg[1] == 'o') job.output = value;
+            else if (arg[2] == 'F') depfile = value;
+            else deptarget = value;
+
+            if (!arg[len]) ++i;
+            continue;
+        }
+
+        /* include directories are searched by llvm-rc as well */
+        if (!std::strncmp(arg, "-I", 2) && (arg[2] || next))
+        {
+            job.rcargs.push_back("-I");
+            job.rcargs.push_back(arg[2] ? arg+2 : next);
+        }
+
+        job.ppargs.push_back(arg);
+
+        if (optionhasvalue(arg) && next)
+            job.ppargs.push_back(cargs[++i]);
+    }
+
+    if (job.output.empty())
+    {
+        job.output = getfileName(job.input.c_str());
+        job.output.resize(job.output.size() - STRLEN(".rc"));
+        job.output += ".o";
+    }
+
+    if (depmode)
+    {
+        if (depfile.empty())
+        {
+            depfile = job.output;
+            size_t dot = depfile.find_last_of('.');
+            size_t slash = depfile.find_last_of(PATHDIV);
+
+            if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+                depfile.resize(dot);
+
+            depfile += ".d";
+        }
+
+        job.ppargs.push_back(depmode);
+        job.ppargs.push_back("-MF");
+        job.ppargs.push_back(depfile);
+        job.ppargs.push_back("-MT");
+        job.ppargs.push_back(deptarget.empty() ? job.output : deptarget);
+    }
+
+    return compileresource(job, cmdargs);
+}
+
+/*
+ * Files referenced by the script (icons, manifests, ...) are
+ * string literals naming existing files, searched like llvm-rc
+ * does: working directory, input directory, include directories
+ */
+static void findresourcefiles(const std::string &preprocessed,
+                              const string_vector &dirs, string_vector &files)
+{
+    size_t pos = 0;
+
+    while ((pos = preprocessed.find('"', pos)) != std::string::npos)
+    {
+        size_t end = preprocessed.find_first_of("\"\n", pos+1);
+
+        if (end == std::string::npos || preprocessed[end] != '"')
+        {
+            pos = end;
+            continue;
+        }
+
+        std::string name = preprocessed.substr(pos+1, end-pos-1);
+        size_t linestart = preprocessed.rfind('\n', pos);
+        struct stat st;
+
+        pos = end+1;
+
+        /* line markers */
+        if (preprocessed[linestart == std::string::npos ? 0 : linestart+1] == '#')
+            continue;
+
+        if (name.empty())
+            continue;
+
+        for (const auto &dir : dirs)
+        {
+            std::string file = name[0] == PATHDIV || dir.empty() ? name : dir + PATHDIV + name;
+
+            if (!stat(file.c_str(), &st) && S_ISREG(st.st_mode))
+            {
+                files.push_back(file);
+                break;
+            }
+
+            if (name[0] == PATHDIV)
+                break;
+        }
+    }
+}
+
+void getresourcecompile(char **cargs, const commandargs &cmdargs, customcompile &rc)
+{
+    std::vector<int> inputs;
+    string_vector dirs;
+
+    findinputfiles(cargs, inputs);
+
+    std::string dir = cargs[inputs[0]];
+    stripfilename(&dir[0]);
+    dir.resize(std::strlen(dir.c_str()));
+
+    dirs.push_back("");
+    dirs.push_back(dir.empty() ? "." : dir);
+
+    for (int i = 1; cargs[i]; ++i)
+    {
+        if (!std::strncmp(cargs[i], "-I", 2) && (cargs[i][2] || cargs[i+1]))
+            dirs.push_back(cargs[i][2] ? cargs[i]+2 : cargs[i+1]);
+    }
+
+    rc.ppargs = { "-xc", "-DRC_INVOKED" };
+
+    rc.getfiles = [dirs](const std::string &preprocessed, string_vector &files)
+    {
+        findresourcefiles(preprocessed, dirs, files);
+    };
+
+    rc.run = [cargs, &cmdargs]() { return runresourcecompile(cargs, cmdargs); };
+}
+
+bool iswindres(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strcmp(argv[i], "-wc-windres") || !std::strcmp(argv[i], "--wc-windres"))
+            return true;
+    }
+
+    return false;
+}
+
+int runwindres(int argc, char **argv)
+{
+    resourcejob job;
+    string_vector args;
+    string_vector positional;
+    std::string informat;
+    std::string outformat;
+    std::string target;
+
+    args.push_back(argv[0]);
+
+    /*
+     * Options are accepted as -x value, -xvalue,
+     * --long=value and --long value
+     */
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::string value;
+
+        if (arg == "-wc-windres" || arg == "--wc-windres")
+            continue;
+
+        if (!arg.compare(0, STRLEN("-wc-"), "-wc-") || !arg.compare(0, STRLEN("--wc-"), "--wc-"))
+        {
+            args.push_back(arg);
+            continue;
+        }
+
+        if (arg[0] != '-' || arg == "-")
+        {
+            positional.push_back(arg);
+            continue;
+        }
+
+        static constexpr const char* WITHVALUE[][2] = {
+            { "-i", "--input" }, { "-o", "--output" }, { "-J", "--input-format" },
+            { "-O", "--output-format" }, { "-I", "--include-dir" }, { "-D", "--define" },
+            { "-U", "--undefine" }, { "-l", "--language" }, { "-c", "--codepage" },
+            { "-F", "--target" }, { nullptr, "--preprocessor" },
+            { nullptr, "--preprocessor-arg" }
+        };
+
+        const char *opt = nullptr;
+
+        for (const auto &names : WITHVALUE)
+        {
+            if (names[0] && !arg.compare(0, 2, names[0]))
+            {
+                opt = names[0];
+                value = arg.substr(2);
+                break;
+            }
+
+            size_t len = std::strlen(names[1]);
+
+            if (!arg.compare(0, len, names[1]) && (arg.size() == len || arg[len] == '='))
+            {
+                opt = names[0] ? names[0] : names[1];
+                value = arg.size() > len ? arg.substr(len+1) : "";
+                break;
+            }
+        }
+
+        if (!opt)
+        {
+            if (arg == "-v" || arg == "--verbose")
+                args.push_back("-wc-verbose");
+            else if (arg != "--use-temp-file" && arg != "--no-use-temp-file")
+                warn("ignoring unsupported windres option: %", arg);
+
+            continue;
+        }
+
+        if (value.empty())
+        {
+            if (++i == argc)
+            {
+                errstream() << "missing value for " << arg << std::endl;
+                return 1;
+            }
+
+            value = argv[i];
+        }
+
+        std::string o = opt;
+
+        if (o == "-i") job.input = value;
+        else if (o == "-o") job.output = value;
+        else if (o == "-J") informat = value;
+        else if (o == "-O") outformat = value;
+        else if (o == "-F") target = value;
+        else if (o == "-I") { args.push_back("-I" + value); job.rcargs.push_back("-I"); job.rcargs.push_back(value); }
+        else if (o == "-D" || o == "-U") args.push_back(o + value);
+        else if (o == "-l") { job.rcargs.push_back("-L"); job.rcargs.push_back(value); }
+        else if (o == "-c") { job.rcargs.push_back("-C"); job.rcargs.push_back(value); }
+        else if (o == "--preprocessor-arg") args.push_back(value);
+        else if (o == "--preprocessor") warn("ignoring --preprocessor, clang is used");
+    }
+
+    for (const auto &file : positional)
+    {
+        if (job.input.empty()) job.input = file;
+        else if (job.output.empty()) job.output = file;
+        else
+        {
+            errstream() << "too many arguments: " << file << std::endl;
+            return 1;
+        }
+    }
+
+    if (job.input.empty() || job.output.empty() || job.input == "-" || job.output == "-")
+    {
+        errstream() << "-wc-windres needs an input and an output file" << std::endl;
+        return 1;
+    }
+
+    job.inputformat = !informat.empty() ? informat : hasextension(job.input, ".res") ? "res" : "rc";
+    job.outputformat = !outformat.empty() ? outformat : hasextension(job.output, ".res") ? "res" : "coff";
+
+    /*
+     * Compute the preprocessor command like for a
+     * compile step of the input
+     */
+
+    commandstate state;
+    std::vector<char*> cargv;
+
+    args.push_back("-c");
+    args.push_back(job.input);
+
+    cargv = toargv(args);
+
+    int status = computecommand((int)args.size(), &cargv[0], state);
+
+    if (status != COMMAND_READY)
+        return status;
+
+    /* llvm-cvtres converts for the target of the wclang invocation */
+    if (!target.empty())
+    {
+        const char *machine = getbfdmachine(target);
+
+        if (!machine)
+        {
+            errstream() << "unsupported windres target: " << target << std::endl;
+            return 1;
+        }
+
+        if (std::strcmp(machine, getmachine(state.cmdargs.target)))
+        {
+            errstream() << "windres target " << target << " does not match "
+                        << state.cmdargs.target << std::endl;
+            return 1;
+        }
+    }
+
+    for (const auto &arg : state.args)
+    {
+        if (arg != "-c" && arg != job.input)
+            job.ppargs.push_back(arg);
+    }
+
+    return compileresource(job, state.cmdargs);
+}
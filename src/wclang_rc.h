@@ -0,0 +1,32 @@
+/*
+ * Resource compilation (.rc inputs, -wc-windres)
+ *
+ * Resource scripts are preprocessed with clang and the target's
+ * header directories (-DRC_INVOKED), compiled with llvm-rc and
+ * converted to COFF objects with llvm-cvtres, instead of going
+ * through GNU windres and the mingw GCC preprocessor.
+ *
+ * .rc compile steps go through the object cache like C sources,
+ * keyed by the preprocessed script and the files it references.
+ */
+
+/*
+ * Returns true for compile steps (-c) of a single .rc file
+ */
+bool isresourcecompile(char **cargs);
+int runresourcecompile(char **cargs, const commandargs &cmdargs);
+
+/*
+ * Object cache hooks for a resource compile step,
+ * 'cargs' and 'cmdargs' must outlive 'rc'
+ */
+struct customcompile;
+void getresourcecompile(char **cargs, const commandargs &cmdargs, customcompile &rc);
+
+/*
+ * windres compatible front end: -wc-windres [-i] in.rc [-o] out.o
+ * (-I, -D, -U, -J, -O, -F, -l, -c, --preprocessor-arg, -v),
+ * -F/--target must name the target's machine (pe-x86-64, pe-i386, ...)
+ */
+bool iswindres(int argc, char **argv);
+int runwindres(int argc, char **argv);
@@ -0,0 +1,295 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_rsp.h"
+
+/* GCC gives up at the same depth */
+static constexpr int MAXDEPTH = 2000;
+
+/*
+ * Headroom for the variables the compiler driver adds
+ * before it executes cc1 or the linker
+ */
+static constexpr size_t ARGHEADROOM = 64*1024;
+
+#ifdef __linux__
+/* MAX_ARG_STRLEN, the limit for a single argument */
+static constexpr size_t MAXARGSTRLEN = 32*4096;
+#endif
+
+void splitarguments(const char *p, const char *end, string_vector &args)
+{
+    while (p < end)
+    {
+        std::string arg;
+        bool squote = false;
+        bool dquote = false;
+
+        while (p < end && std::isspace(static_cast<unsigned char>(*p)))
+            ++p;
+
+        if (p == end)
+            break;
+
+        for (; p < end; ++p)
+        {
+            char c = *p;
+
+            if (!squote && !dquote && std::isspace(static_cast<unsigned char>(c)))
+                break;
+
+            if (c == '\\')
+            {
+                if (++p == end) break;
+                arg += *p;
+            }
+            else if (squote)
+            {
+                if (c == '\'') squote = false;
+                else arg += c;
+            }
+            else if (dquote)
+            {
+                if (c == '"') dquote = false;
+                else arg += c;
+            }
+            else if (c == '\'')
+            {
+                squote = true;
+            }
+            else if (c == '"')
+            {
+                dquote = true;
+            }
+            else
+            {
+                arg += c;
+            }
+        }
+
+        args.push_back(arg);
+    }
+}
+
+static bool readresponsefile(const char *file, string_vector &args)
+{
+    struct stat st;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) || S_ISDIR(st.st_mode))
+    {
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    const char *p = static_cast<const char*>(data);
+    splitarguments(p, p + st.st_size, args);
+
+    munmap(data, st.st_size);
+    return true;
+}
+
+static void expand(const char *arg, string_vector &args, int depth)
+{
+    string_vector fileargs;
+
+    if (*arg != '@' || depth > MAXDEPTH || !readresponsefile(arg+1, fileargs))
+    {
+        args.push_back(arg);
+        return;
+    }
+
+    for (const auto &filearg : fileargs)
+        expand(filearg.c_str(), args, depth+1);
+}
+
+bool expandresponsefiles(int &argc, char **&argv, responsefileargs &storage)
+{
+    int i;
+
+    for (i = 1; i < argc; ++i)
+        if (argv[i][0] == '@') break;
+
+    if (i == argc)
+        return false;
+
+    storage.args.clear();
+    storage.argv.clear();
+
+    for (i = 0; i < argc; ++i)
+    {
+        if (i == 0) storage.args.push_back(argv[i]);
+        else expand(argv[i], storage.args, 0);
+    }
+
+    for (auto &arg : storage.args)
+        storage.argv.push_back(&arg[0]);
+
+    storage.argv.push_back(nullptr);
+
+    argc = (int)storage.args.size();
+    argv = &storage.argv[0];
+    return true;
+}
+
+bool needresponsefile(char **cargs)
+{
+    long argmax = sysconf(_SC_ARG_MAX);
+    size_t size = 0;
+
+    if (argmax <= 0)
+        argmax = 128*1024;
+
+    for (char **arg = cargs; *arg; ++arg)
+    {
+        size_t len = std::strlen(*arg) + 1;
+
+#ifdef __linux__
+        if (len > MAXARGSTRLEN)
+            return true;
+#endif
+
+        size += len + sizeof(char*);
+    }
+
+    std::vector<char*> env;
+
+    for (char *const *var = getenvironment(env); *var; ++var)
+        size += std::strlen(*var) + 1 + sizeof(char*);
+
+    return size + ARGHEADROOM > (size_t)argmax;
+}
+
+static void quoteargument(const char *arg, std::string &out)
+{
+    if (!*arg)
+    {
+        out += "\"\"";
+        return;
+    }
+
+    for (; *arg; ++arg)
+    {
+        if (std::isspace(static_cast<unsigned char>(*arg)) ||
+            *arg == '\\' || *arg == '\'' || *arg == '"')
+        {
+            out += '\\';
+        }
+
+        out += *arg;
+    }
+}
+
+static int opentempfile()
+{
+    const char *tmpdir = getenvvar("TMPDIR");
+    std::string dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+    int fd;
+
+#ifdef O_TMPFILE
+    if ((fd = open(dir.c_str(), O_TMPFILE | O_RDWR, 0600)) != -1)
+        return fd;
+#endif
+
+    std::string file = dir + "/wclang-rsp-XXXXXX";
+
+    if ((fd = mkstemp(&file[0])) == -1)
+        return -1;
+
+    unlink(file.c_str());
+    return fd;
+}
+
+int writeresponsefile(char **cargs)
+{
+    std::string data;
+    char arg[32];
+    int fd;
+
+    if (!cargs[0] || !cargs[1])
+        return -1;
+
+    for (char **p = cargs+1; *p; ++p)
+    {
+        if (p != cargs+1) data += ' ';
+        quoteargument(*p, data);
+    }
+
+    data += '\n';
+
+    if ((fd = opentempfile()) == -1)
+        return -1;
+
+    for (size_t written = 0; written < data.size();)
+    {
+        ssize_t len = write(fd, data.data() + written, data.size() - written);
+
+        if (len == -1 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        written += len;
+    }
+
+    /* /dev/fd/N may share the file offset with 'fd' */
+    lseek(fd, 0, SEEK_SET);
+
+    for (char **p = cargs+1; *p; ++p)
+        std::free(*p);
+
+    snprintf(arg, sizeof(arg), "@/dev/fd/%d", fd);
+
+    cargs[1] = strdup(arg);
+    cargs[2] = nullptr;
+
+    return fd;
+}
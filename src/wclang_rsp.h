@@ -0,0 +1,39 @@
+/*
+ * Response files (@file)
+ *
+ * Arguments are read and written with the GCC quoting rules:
+ * whitespace separates arguments, single and double quotes group
+ * them and a backslash escapes the following character.
+ */
+
+struct responsefileargs {
+    string_vector args;
+    std::vector<char*> argv;
+};
+
+/*
+ * Replaces @file arguments with the arguments read from 'file',
+ * nested response files are expanded as well. Unreadable files are
+ * passed on unchanged, like GCC does. Returns false if 'argv' does
+ * not contain any response file; otherwise 'argc' and 'argv' point
+ * to 'storage' afterwards.
+ */
+bool expandresponsefiles(int &argc, char **&argv, responsefileargs &storage);
+
+/*
+ * Splits [p, end) into arguments
+ */
+void splitarguments(const char *p, const char *end, string_vector &args);
+
+/*
+ * Returns true if 'cargs' and the environment get close
+ * to the system's limit for the arguments of execve()
+ */
+bool needresponsefile(char **cargs);
+
+/*
+ * Writes cargs[1..] to an unlinked temporary file, which is left
+ * open across exec and replaces them with @/dev/fd/N.
+ * Returns the descriptor or -1.
+ */
+int writeresponsefile(char **cargs);
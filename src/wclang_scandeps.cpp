@@ -0,0 +1,339 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_rsp.h"
+#include "wclang_process.h"
+#include "wclang_json.h"
+#include "wclang_scandeps.h"
+
+/*
+ * Compilation database entries
+ */
+
+static bool iscxxentry(const std::string &compiler, const std::string &file)
+{
+    static constexpr const char* CXXEXTENSIONS[] = {
+        "cpp", "cxx", "cc", "c++", "C", "cp", "CPP", "cppm", "ixx", "mpp", "cxxm", "c++m"
+    };
+
+    const char *name = getfileName(compiler.c_str());
+    size_t len = std::strlen(name);
+
+    if (len >= 2 && !std::strcmp(name + len - 2, "++"))
+        return true;
+
+    size_t dot = file.find_last_of('.');
+
+    if (dot == std::string::npos)
+        return false;
+
+    for (const char *ext : CXXEXTENSIONS)
+    {
+        if (!file.compare(dot+1, std::string::npos, ext))
+            return true;
+    }
+
+    return false;
+}
+
+static bool getentryargs(const jsonvalue &entry, string_vector &args)
+{
+    const jsonvalue *value;
+
+    if ((value = entry.get("arguments", jsonvalue::ARRAY)))
+    {
+        for (const auto &item : value->items)
+        {
+            if (item.type != jsonvalue::STRING)
+                return false;
+
+            args.push_back(item.str);
+        }
+    }
+    else if ((value = entry.get("command", jsonvalue::STRING)))
+    {
+        const std::string &command = value->str;
+        splitarguments(command.c_str(), command.c_str() + command.size(), args);
+    }
+
+    return !args.empty();
+}
+
+/*
+ * clang-scan-deps
+ */
+
+bool isscandepsformat(const char *format)
+{
+    return !std::strcmp(format, "make") || !std::strcmp(format, "p1689");
+}
+
+static bool findscandeps(const commandargs &cmdargs, std::string &tool)
+{
+    const char *p = getenvvar("WCLANG_SCAN_DEPS");
+
+    if (p && *p)
+    {
+        tool = p;
+        return true;
+    }
+
+    return findllvmtool(cmdargs.compilerbinpath, cmdargs.clangversion.major,
+                        "clang-scan-deps", tool);
+}
+
+static bool writedatabase(const std::string &data, std::string &file)
+{
+    const char *tmpdir = getenvvar("TMPDIR");
+    int fd;
+
+    file = tmpdir && *tmpdir ? tmpdir : "/tmp";
+    file += "/wclang-scan-deps-XXXXXX.json";
+
+    if ((fd = mkstemps(&file[0], STRLEN(".json"))) == -1)
+        return false;
+
+    for (size_t written = 0; written < data.size();)
+    {
+        ssize_t len = write(fd, data.data() + written, data.size() - written);
+
+        if (len == -1 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+        {
+            close(fd);
+            unlink(file.c_str());
+            return false;
+        }
+
+        written += len;
+    }
+
+    close(fd);
+    return true;
+}
+
+int runscandeps(const char *invocation, const commandargs &cmdargs)
+{
+    const char *format = cmdargs.scandepsformat ? cmdargs.scandepsformat : "make";
+    const compilerver &clangversion = cmdargs.clangversion;
+    bool knownversion = clangversion != compilerver();
+    std::string name = invocation;
+    std::string data;
+    std::string database;
+    std::string tool;
+    jsonvalue db;
+    string_vector environment;
+    size_t count = 0;
+
+    if (knownversion && clangversion < compilerver(9, 0))
+    {
+        errstream() << "clang-scan-deps requires clang>=9" << std::endl;
+        return 1;
+    }
+
+    if (knownversion && clangversion < compilerver(16, 0) && !std::strcmp(format, "p1689"))
+    {
+        errstream() << "-wc-scan-deps-format=p1689 requires clang>=16" << std::endl;
+        return 1;
+    }
+
+    if (!findscandeps(cmdargs, tool))
+    {
+        errstream() << "cannot find 'clang-scan-deps' executable" << std::endl;
+        return 1;
+    }
+
+    if (!readfile(cmdargs.scandeps, data))
+    {
+        errstream() << "cannot read compilation database: " << cmdargs.scandeps << std::endl;
+        return 1;
+    }
+
+    if (!parsejson(data, db) || db.type != jsonvalue::ARRAY)
+    {
+        errstream() << "invalid compilation database: " << cmdargs.scandeps << std::endl;
+        return 1;
+    }
+
+    if (name.size() >= 2 && !name.compare(name.size()-2, 2, "++"))
+        name.resize(name.size()-2);
+
+    /*
+     * Rewrite the entries, the compiler in the
+     * database is replaced with clang
+     */
+
+    /*
+     * Every entry is computed on a copy of the environment,
+     * so that PATH does not grow with each entry
+     */
+
+    std::vector<char*> env;
+
+    for (char *const *var = getenvironment(env); *var; ++var)
+        environment.push_back(*var);
+
+    database = "[\n";
+
+    for (size_t n = 0; n < db.items.size(); ++n)
+    {
+        const jsonvalue &entry = db.items[n];
+        const jsonvalue *directory = entry.get("directory", jsonvalue::STRING);
+        const jsonvalue *file = entry.get("file", jsonvalue::STRING);
+        const jsonvalue *output = entry.get("output", jsonvalue::STRING);
+        string_vector entryargs;
+        std::vector<char*> argv;
+        commandstate state;
+
+        if (!directory || !file || !getentryargs(entry, entryargs))
+        {
+            warn("skipping invalid compilation database entry #%", n+1);
+            continue;
+        }
+
+        std::string entryname = name + (iscxxentry(entryargs[0], file->str) ? "++" : "");
+
+        argv.push_back(&entryname[0]);
+
+        for (size_t i = 1; i < entryargs.size(); ++i)
+        {
+            /* response files are relative to the entry's directory */
+            if (entryargs[i].size() > 1 && entryargs[i][0] == '@' && entryargs[i][1] != PATHDIV)
+                entryargs[i].insert(1, directory->str + PATHDIV);
+
+            argv.push_back(&entryargs[i][0]);
+        }
+
+        argv.push_back(nullptr);
+
+        string_vector env = environment;
+        threadcontext context = { &env, &outstream(), &errstream() };
+
+        setthreadcontext(&context);
+        int status = computecommand((int)argv.size()-1, &argv[0], state);
+        setthreadcontext(nullptr);
+
+        if (status != COMMAND_READY)
+        {
+            errstream() << "cannot compute the command for " << file->str << std::endl;
+            return status ? status : 1;
+        }
+
+        if (count++) database += ",\n";
+
+        database += "{\"directory\":" + jsonstring(directory->str);
+        database += ",\"file\":" + jsonstring(file->str);
+
+        if (output)
+            database += ",\"output\":" + jsonstring(output->str);
+
+        database += ",\"arguments\":[";
+
+        for (size_t i = 0; i < state.args.size(); ++i)
+        {
+            if (i) database += ",";
+            database += jsonstring(state.args[i]);
+        }
+
+        database += "]}";
+    }
+
+    database += "\n]\n";
+
+    std::string databasefile;
+
+    if (!writedatabase(database, databasefile))
+    {
+        errstream() << "cannot write compilation database" << std::endl;
+        return 1;
+    }
+
+    /*
+     * clang>=14 renamed the minimized-source mode
+     */
+
+    std::string dbarg = "-compilation-database=" + databasefile;
+    std::string formatarg = std::string("-format=") + format;
+    std::string modearg = "-mode=";
+    std::string jobs = std::to_string(cmdargs.jobs);
+    std::vector<char*> scanargs;
+
+    if (!knownversion || clangversion >= compilerver(14, 0))
+        modearg += "preprocess-dependency-directives";
+    else
+        modearg += "preprocess-minimized-sources";
+
+    scanargs.push_back(&tool[0]);
+    scanargs.push_back(&dbarg[0]);
+    scanargs.push_back(&formatarg[0]);
+    scanargs.push_back(&modearg[0]);
+
+    if (cmdargs.jobs > 1)
+    {
+        scanargs.push_back(const_cast<char*>("-j"));
+        scanargs.push_back(&jobs[0]);
+    }
+
+    scanargs.push_back(nullptr);
+
+    if (cmdargs.verbose)
+        verbosemsg("scanning % entries with %", count, tool);
+
+    /*
+     * Ctrl+C terminates clang-scan-deps,
+     * remove the database afterwards
+     */
+
+    struct sigaction ignore, oldint, oldquit;
+    pid_t pid;
+    int status;
+
+    std::memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+
+    if ((pid = spawnprocess(&scanargs[0])) == -1)
+    {
+        errstream() << "invoking clang-scan-deps failed" << std::endl;
+        unlink(databasefile.c_str());
+        return 1;
+    }
+
+    sigaction(SIGINT, &ignore, &oldint);
+    sigaction(SIGQUIT, &ignore, &oldquit);
+
+    status = waitprocess(pid);
+
+    sigaction(SIGINT, &oldint, nullptr);
+    sigaction(SIGQUIT, &oldquit, nullptr);
+
+    unlink(databasefile.c_str());
+
+    return status == RUNCOMMAND_ERROR ? 1 : status;
+}
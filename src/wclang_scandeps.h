@@ -0,0 +1,17 @@
+/*
+ * Dependency scanning (-wc-scan-deps=compile_commands.json)
+ *
+ * Every entry of the compilation database is rewritten the way the
+ * compiler invocation would be (target, -nostdinc, -isystem dirs),
+ * then clang-scan-deps scans all of them in one process with its
+ * minimized-source mode. The dependencies (-wc-scan-deps-format=make
+ * or p1689) are written to stdout.
+ */
+
+bool isscandepsformat(const char *format);
+
+/*
+ * 'invocation' is the name the entries are computed with
+ * (<target>-clang, the ++ is added for C++ entries)
+ */
+int runscandeps(const char *invocation, const commandargs &cmdargs);
@@ -0,0 +1,324 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+/*
+ * wclang-stats
+ *
+ * Aggregates the metrics logs written with $WCLANG_METRICS_LOG:
+ * the slowest translation units and links, the ones with the highest
+ * peak memory and the percentiles of the wrapper overhead.
+ */
+
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include "wclang.h"
+#include "wclang_time.h"
+#include "wclang_json.h"
+#include "wclang_metrics.h"
+
+struct invocation {
+    std::string name;
+    std::string target;
+    std::string step;
+    ullong overhead;
+    ullong wall;
+    ullong cpu;
+    ullong maxrss;
+    int status;
+};
+
+struct unit {
+    std::string name;
+    std::string target;
+    std::string step;
+    ullong wall;
+    ullong maxrss;
+    int runs;
+};
+
+static ullong getnumber(const jsonvalue &entry, const char *key)
+{
+    const jsonvalue *value = entry.get(key, jsonvalue::NUMBER);
+    return value ? std::strtoull(value->str.c_str(), nullptr, 10) : 0;
+}
+
+static std::string getstring(const jsonvalue &entry, const char *key)
+{
+    const jsonvalue *value = entry.get(key, jsonvalue::STRING);
+    return value ? value->str : std::string();
+}
+
+static bool parseinvocation(const std::string &line, invocation &inv)
+{
+    jsonvalue entry;
+
+    if (!parsejson(line, entry) || entry.type != jsonvalue::OBJECT)
+        return false;
+
+    /* compile steps by source, links by output */
+    inv.name = getstring(entry, "source");
+
+    if (inv.name.empty())
+        inv.name = getstring(entry, "output");
+
+    if (inv.name.empty())
+        inv.name = "<" + getstring(entry, "command_hash") + ">";
+    else if (inv.name[0] != PATHDIV && !getstring(entry, "directory").empty())
+        inv.name = getstring(entry, "directory") + PATHDIV + inv.name;
+
+    inv.target = getstring(entry, "target");
+    inv.step = getstring(entry, "step");
+    inv.overhead = getnumber(entry, "overhead_us");
+    inv.wall = getnumber(entry, "wall_us");
+    inv.cpu = getnumber(entry, "user_us") + getnumber(entry, "sys_us");
+    inv.maxrss = getnumber(entry, "maxrss_kb");
+    inv.status = (int)getnumber(entry, "status");
+
+    return true;
+}
+
+static bool readlog(const char *file, std::vector<invocation> &invocations)
+{
+    std::ifstream stream(file);
+    std::string line;
+    size_t lineno = 0;
+
+    if (!stream)
+    {
+        std::cerr << "cannot open " << file << std::endl;
+        return false;
+    }
+
+    while (std::getline(stream, line))
+    {
+        invocation inv;
+        ++lineno;
+
+        if (line.empty())
+            continue;
+
+        /* a crashed writer may leave a partial line */
+        if (!parseinvocation(line, inv))
+        {
+            std::cerr << file << ":" << lineno << ": skipping invalid entry" << std::endl;
+            continue;
+        }
+
+        invocations.push_back(inv);
+    }
+
+    return true;
+}
+
+static std::string fmtduration(ullong us)
+{
+    char buf[32];
+
+    if (us < 1000)
+        snprintf(buf, sizeof(buf), "%lluus", us);
+    else if (us < 1000000)
+        snprintf(buf, sizeof(buf), "%.1fms", us / 1000.0);
+    else
+        snprintf(buf, sizeof(buf), "%.2fs", us / 1000000.0);
+
+    return buf;
+}
+
+static std::string fmtsize(ullong kb)
+{
+    char buf[32];
+
+    if (kb < 1024)
+        snprintf(buf, sizeof(buf), "%lluK", kb);
+    else if (kb < 1024 * 1024)
+        snprintf(buf, sizeof(buf), "%.1fM", kb / 1024.0);
+    else
+        snprintf(buf, sizeof(buf), "%.2fG", kb / (1024.0 * 1024.0));
+
+    return buf;
+}
+
+static void printunits(std::vector<unit> &units, size_t top, bool bymemory)
+{
+    std::sort(units.begin(), units.end(), [&](const unit &a, const unit &b)
+    {
+        return bymemory ? a.maxrss > b.maxrss : a.wall > b.wall;
+    });
+
+    for (size_t i = 0; i < units.size() && i < top; ++i)
+    {
+        const unit &u = units[i];
+        char buf[64];
+
+        snprintf(buf, sizeof(buf), "  %10s %10s  %-7s ",
+                 (bymemory ? fmtsize(u.maxrss) : fmtduration(u.wall)).c_str(),
+                 (bymemory ? fmtduration(u.wall) : fmtsize(u.maxrss)).c_str(),
+                 u.step.c_str());
+
+        std::cout << buf << u.name;
+
+        if (!u.target.empty())
+            std::cout << " [" << u.target << "]";
+
+        if (u.runs > 1)
+            std::cout << " (" << u.runs << " runs)";
+
+        std::cout << std::endl;
+    }
+}
+
+static ullong percentile(const std::vector<ullong> &sorted, int p)
+{
+    /* nearest rank */
+    size_t rank = (sorted.size() * p + 99) / 100;
+    return sorted[rank ? rank-1 : 0];
+}
+
+static void usage()
+{
+    std::cerr << "usage: wclang-stats [--top=N] [log...]  (default: $WCLANG_METRICS_LOG)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<const char*> files;
+    std::vector<invocation> invocations;
+    size_t top = 10;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+
+        if (!std::strncmp(arg, "--top=", 6) && std::atoi(arg + 6) > 0)
+        {
+            top = std::atoi(arg + 6);
+        }
+        else if (*arg == '-')
+        {
+            usage();
+            return 1;
+        }
+        else
+        {
+            files.push_back(arg);
+        }
+    }
+
+    if (files.empty())
+    {
+        const char *log = getmetricslog();
+
+        if (!log)
+        {
+            usage();
+            return 1;
+        }
+
+        files.push_back(log);
+    }
+
+    for (const char *file : files)
+    {
+        if (!readlog(file, invocations))
+            return 1;
+    }
+
+    if (invocations.empty())
+    {
+        std::cerr << "no invocations logged" << std::endl;
+        return 1;
+    }
+
+    /*
+     * Per unit: the slowest run and the highest peak,
+     * rebuilds of the same source are folded
+     */
+
+    std::map<std::string, unit> units;
+    std::map<std::string, int> steps;
+    std::vector<ullong> overheads;
+    ullong overhead = 0;
+    ullong wall = 0;
+    ullong cpu = 0;
+    int failed = 0;
+
+    for (const auto &inv : invocations)
+    {
+        unit &u = units[inv.step + ":" + inv.target + ":" + inv.name];
+
+        if (!u.runs++)
+        {
+            u.name = inv.name;
+            u.target = inv.target;
+            u.step = inv.step;
+            u.wall = u.maxrss = 0;
+        }
+
+        u.wall = std::max(u.wall, inv.wall);
+        u.maxrss = std::max(u.maxrss, inv.maxrss);
+
+        overheads.push_back(inv.overhead);
+        overhead += inv.overhead;
+        wall += inv.wall;
+        cpu += inv.cpu;
+        steps[inv.step]++;
+
+        if (inv.status)
+            ++failed;
+    }
+
+    std::vector<unit> sorted;
+
+    for (const auto &u : units)
+        sorted.push_back(u.second);
+
+    std::sort(overheads.begin(), overheads.end());
+
+    std::cout << "invocations: " << invocations.size() << " (";
+
+    for (auto it = steps.begin(); it != steps.end(); ++it)
+        std::cout << (it != steps.begin() ? ", " : "") << it->first << ": " << it->second;
+
+    std::cout << "), failed: " << failed << std::endl;
+    std::cout << "compiler time: " << fmtduration(wall) << " wall, "
+              << fmtduration(cpu) << " cpu" << std::endl;
+
+    std::cout << std::endl << "slowest (wall time, peak memory):" << std::endl;
+    printunits(sorted, top, false);
+
+    std::cout << std::endl << "peak memory (peak memory, wall time):" << std::endl;
+    printunits(sorted, top, true);
+
+    std::cout << std::endl << "wrapper overhead:" << std::endl;
+    std::cout << "  p50 " << fmtduration(percentile(overheads, 50))
+              << ", p90 " << fmtduration(percentile(overheads, 90))
+              << ", p99 " << fmtduration(percentile(overheads, 99))
+              << ", max " << fmtduration(overheads.back()) << std::endl;
+
+    char share[32];
+    snprintf(share, sizeof(share), "%.2f%%", overhead + wall ? 100.0 * overhead / (overhead + wall) : 0.0);
+    std::cout << "  " << fmtduration(overhead) << " total, " << share << " of the wall time" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_jobserver.h"
+#include "wclang_rsp.h"
+#include "wclang_targets.h"
+#include "wclang_process.h"
+
+static constexpr char TARGETSOPT[] = "-wc-targets=";
+
+static constexpr const char *OUTPUTOPTS[] = { "-o", "-MF", "-MT", "-MQ" };
+
+bool ismultitarget(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strncmp(argv[i], TARGETSOPT, STRLEN(TARGETSOPT)))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Maps an architecture to the invocation name prefix
+ * that resolves it, triples are used as they are
+ */
+static const char *getinvocationprefix(const std::string &target)
+{
+    static constexpr const char *ARCH32[] = { "i386", "i486", "i586", "i686", "x86", "32", "w32" };
+    static constexpr const char *ARCH64[] = { "x86_64", "amd64", "x64", "64", "w64" };
+
+    if (target.find('-') != std::string::npos)
+        return target.c_str();
+
+    for (const char *arch : ARCH32)
+        if (target == arch) return "w32";
+
+    for (const char *arch : ARCH64)
+        if (target == arch) return "w64";
+
+    return nullptr;
+}
+
+/*
+ * Returns the value of the output option 'arg[0]' or nullptr
+ */
+static const char *getoutputvalue(char **arg)
+{
+    for (const char *opt : OUTPUTOPTS)
+    {
+        size_t len = std::strlen(opt);
+
+        if (std::strncmp(*arg, opt, len))
+            continue;
+
+        return (*arg)[len] ? *arg + len : arg[1];
+    }
+
+    return nullptr;
+}
+
+static bool hastemplate(const char *value)
+{
+    for (const char *p = value; *p; ++p)
+    {
+        if (*p != '%') continue;
+        if (p[1] == 'a' || p[1] == 't') return true;
+        if (p[1] == '%') ++p;
+    }
+
+    return false;
+}
+
+static std::string expandtemplate(const std::string &value, const std::string &target)
+{
+    std::string result;
+
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] != '%' || i+1 == value.size())
+        {
+            result += value[i];
+            continue;
+        }
+
+        switch (value[++i])
+        {
+            case 'a': result += target.substr(0, target.find('-')); break;
+            case 't': result += target; break;
+            case '%': result += '%'; break;
+            default: result += '%'; result += value[i];
+        }
+    }
+
+    return result;
+}
+
+void expandoutputtemplates(string_vector &args, const std::string &target)
+{
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        for (const char *opt : OUTPUTOPTS)
+        {
+            size_t len = std::strlen(opt);
+
+            if (args[i].compare(0, len, opt))
+                continue;
+
+            if (args[i].size() == len)
+            {
+                if (i+1 < args.size())
+                {
+                    ++i;
+                    args[i] = expandtemplate(args[i], target);
+                }
+            }
+            else
+            {
+                args[i] = opt + expandtemplate(args[i].substr(len), target);
+            }
+
+            break;
+        }
+    }
+}
+
+int runtargets(int argc, char **argv, targetcallback run)
+{
+    responsefileargs rspargs;
+    string_vector targets;
+    std::vector<char*> args;
+    std::string list;
+    bool templated = false;
+
+    expandresponsefiles(argc, argv, rspargs);
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (i && !std::strncmp(argv[i], TARGETSOPT, STRLEN(TARGETSOPT)))
+        {
+            list = argv[i] + STRLEN(TARGETSOPT);
+            continue;
+        }
+
+        args.push_back(argv[i]);
+
+        const char *value;
+
+        if (i && (value = getoutputvalue(&argv[i])))
+            templated |= hastemplate(value);
+    }
+
+    args.push_back(nullptr);
+
+    std::string target;
+
+    for (char c : list + ",")
+    {
+        if (c != ',')
+        {
+            target += c;
+            continue;
+        }
+
+        if (!target.empty())
+            targets.push_back(target);
+
+        target.clear();
+    }
+
+    if (targets.empty())
+    {
+        errstream() << "no targets given: " << TARGETSOPT << "i686,x86_64" << std::endl;
+        return 1;
+    }
+
+    if (targets.size() > 1 && !templated)
+    {
+        errstream() << TARGETSOPT << " requires %a or %t in the output "
+                    << "file name, e.g. -o obj/%a/file.o" << std::endl;
+        return 1;
+    }
+
+    /*
+     * Invocation name: <dir>/<prefix>-clang[++]
+     */
+
+    const char *name = getfileName(argv[0]);
+    const char *suffix = std::strrchr(name, '-');
+    std::string dir(argv[0], name - argv[0]);
+    string_vector invocations;
+
+    if (!suffix)
+    {
+        errstream() << "cannot use " << TARGETSOPT << " with " << name << std::endl;
+        return 1;
+    }
+
+    for (const auto &target : targets)
+    {
+        const char *prefix = getinvocationprefix(target);
+
+        if (!prefix)
+        {
+            errstream() << "unknown target: " << target << std::endl;
+            return 1;
+        }
+
+        invocations.push_back(dir + prefix + suffix);
+    }
+
+    /*
+     * Run the targets concurrently, under make -jN
+     * only as many as we get jobserver tokens for
+     */
+
+    jobserver js;
+    size_t jobs = invocations.size();
+    size_t next = 0;
+    size_t running = 0;
+    int result = 0;
+    struct sigaction ignore, oldint, oldquit;
+
+    if (openjobserver(js))
+        jobs = acquiretokens(js, jobs);
+
+    std::fflush(stdout);
+    std::fflush(stderr);
+
+    std::memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ignore, &oldint);
+    sigaction(SIGQUIT, &ignore, &oldquit);
+
+    while (next < invocations.size() || running)
+    {
+        while (running < jobs && next < invocations.size())
+        {
+            pid_t pid = fork();
+
+            if (pid == -1)
+            {
+                result = result ? result : 1;
+                next = invocations.size();
+                break;
+            }
+
+            if (pid == 0)
+            {
+                sigaction(SIGINT, &oldint, nullptr);
+                sigaction(SIGQUIT, &oldquit, nullptr);
+
+                args[0] = &invocations[next][0];
+                std::exit(run(args.size()-1, args.data(), templated));
+            }
+
+            ++next;
+            ++running;
+        }
+
+        int status;
+
+        if (!running)
+            break;
+
+        if (wait(&status) == -1)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        --running;
+
+        int exitstatus = decodestatus(status);
+
+        if (!result)
+            result = exitstatus;
+    }
+
+    sigaction(SIGINT, &oldint, nullptr);
+    sigaction(SIGQUIT, &oldquit, nullptr);
+
+    releasetokens(js);
+
+    return result;
+}
@@ -0,0 +1,24 @@
+/*
+ * Multi-target builds (-wc-targets=i686,x86_64)
+ *
+ * The invocation is run once per target, concurrently and limited by
+ * the make jobserver if there is one. Targets are architectures
+ * (i686 or x86_64, resolved like w32-clang and w64-clang) or triples.
+ * The output file name (-o, -MF, -MT, -MQ) must contain %a (the
+ * architecture of the resolved triple) or %t (the triple), e.g.
+ * -o obj/%a/foo.o. The exit status is the first non-zero one.
+ */
+
+typedef int (*targetcallback)(int argc, char **argv, bool expandtemplates);
+
+/*
+ * Returns true if 'argv' contains -wc-targets=
+ */
+bool ismultitarget(int argc, char **argv);
+
+int runtargets(int argc, char **argv, targetcallback run);
+
+/*
+ * Expands %a, %t and %% in the output file names of 'args'
+ */
+void expandoutputtemplates(string_vector &args, const std::string &target);
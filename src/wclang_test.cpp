@@ -0,0 +1,583 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+/*
+ * wclang-test
+ *
+ * Smoke tests run by ctest (Linux only), against a synthetic mingw and
+ * clang tree in a temporary directory. "clang" is a copy of this binary,
+ * it copies the source for -E and writes a fake object for -c.
+ *
+ *  compute                        wclang_compute() with a caller supplied
+ *                                 environment, repeated and from threads
+ *  remote-cache <wclang> <server> a remote object cache miss is uploaded
+ *                                 and hit from an empty local cache
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include "libwclang.h"
+
+typedef std::vector<std::string> string_vector;
+
+static constexpr const char* TRIPLE = "x86_64-w64-mingw32";
+static constexpr const char* SOURCE = "int main() { return 0; }\n";
+
+static bool check(bool cond, const std::string &what)
+{
+    if (!cond)
+        std::cerr << "wclang-test: " << what << std::endl;
+
+    return cond;
+}
+
+/*
+ * Synthetic tree
+ */
+
+static bool makedirs(const std::string &dir)
+{
+    std::string path;
+    std::stringstream ss(dir);
+    std::string component;
+
+    while (std::getline(ss, component, '/'))
+    {
+        path += component + "/";
+
+        if (mkdir(path.c_str(), 0755) && errno != EEXIST)
+            return false;
+    }
+
+    return true;
+}
+
+static bool writefile(const std::string &file, const std::string &data)
+{
+    std::ofstream f(file.c_str(), std::ios::binary);
+    f << data;
+    return f.good();
+}
+
+static bool readfile(const std::string &file, std::string &data)
+{
+    std::ifstream f(file.c_str(), std::ios::binary);
+    std::stringstream ss;
+
+    if (!f)
+        return false;
+
+    ss << f.rdbuf();
+    data = ss.str();
+    return true;
+}
+
+static bool copyfile(const std::string &from, const std::string &to)
+{
+    std::string data;
+    return readfile(from, data) && writefile(to, data) && !chmod(to.c_str(), 0755);
+}
+
+static int removefile(const char *path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+static bool createtree(const std::string &root, const std::string &self, const std::string &wclang)
+{
+    std::string sys = root + "/sys";
+    std::string llvm = root + "/llvm";
+    std::string cxx = root + "/usr/lib/gcc/" + TRIPLE + "/10.0.0/include/c++";
+
+    if (!makedirs(sys + "/bin") || !makedirs(sys + "/" + TRIPLE + "/include") ||
+        !makedirs(cxx + "/" + TRIPLE + "/bits") || !makedirs(llvm + "/bin") ||
+        !makedirs(llvm + "/lib/clang/15.0.0/include") || !makedirs(root + "/work"))
+    {
+        return false;
+    }
+
+    for (const char *h : { "stdio.h", "stdlib.h", "windows.h" })
+        writefile(sys + "/" + TRIPLE + "/include/" + h, "");
+
+    writefile(cxx + "/iostream", "");
+    writefile(cxx + "/" + TRIPLE + "/bits/c++config.h", "");
+    writefile(llvm + "/lib/clang/15.0.0/include/xmmintrin.h", "");
+
+    for (const char *name : { "clang", "clang++" })
+    {
+        if (!copyfile(self, llvm + "/bin/" + name))
+            return false;
+    }
+
+    for (const char *suffix : { "-gcc", "-g++" })
+    {
+        if (!copyfile(self, sys + "/bin/" + TRIPLE + suffix))
+            return false;
+    }
+
+    if (!wclang.empty() && symlink(wclang.c_str(), (llvm + "/bin/" + TRIPLE + "-clang").c_str()))
+        return false;
+
+    return writefile(root + "/work/t.c", SOURCE);
+}
+
+static string_vector buildenv(const std::string &root, const std::string &cachedir)
+{
+    string_vector env;
+
+    env.push_back("PATH=" + root + "/llvm/bin:/usr/bin:/bin");
+    env.push_back("MINGW_PATH=" + root + "/sys/bin");
+    env.push_back("HOME=" + root);
+    env.push_back("WCLANG_CACHE_DIR=" + cachedir);
+    env.push_back("WCLANG_NO_DAEMON=1");
+
+    return env;
+}
+
+static std::vector<char*> tocstrings(string_vector &strings)
+{
+    std::vector<char*> result;
+
+    for (auto &str : strings)
+        result.push_back(&str[0]);
+
+    result.push_back(nullptr);
+    return result;
+}
+
+/*
+ * libwclang
+ */
+
+static std::string joinargs(char **argv)
+{
+    std::string result;
+
+    for (char **arg = argv; arg && *arg; ++arg)
+    {
+        if (!result.empty()) result += " ";
+        result += *arg;
+    }
+
+    return result;
+}
+
+static void compute(const char *const *argv, const char *const *envp,
+                    int &status, std::string &command, std::string &output)
+{
+    wclang_result result;
+    int argc = 0;
+
+    while (argv[argc])
+        ++argc;
+
+    status = wclang_compute(argc, argv, envp, &result);
+    command = joinargs(result.argv);
+    output = result.output ? result.output : "";
+
+    if (status != WCLANG_COMMAND && result.errors && *result.errors)
+        std::cerr << result.errors;
+
+    wclang_free_result(&result);
+}
+
+static bool testcompute(const std::string &root)
+{
+    static constexpr const char* COMPILE[] = {
+        "x86_64-w64-mingw32-clang", "-c", "t.c", "-o", "t.o", nullptr
+    };
+
+    static constexpr const char* QUERY[] = {
+        "x86_64-w64-mingw32-clang", "-wc-target", nullptr
+    };
+
+    string_vector env = buildenv(root, root + "/cache");
+    auto envp = tocstrings(env);
+    std::string command;
+    std::string output;
+    int status;
+
+    if (!check(!chdir((root + "/work").c_str()), "cannot change to " + root + "/work"))
+        return false;
+
+    /* clang is only found through the PATH of 'envp' */
+    compute(COMPILE, &envp[0], status, command, output);
+
+    if (!check(status == WCLANG_COMMAND, "compile: status " + std::to_string(status)) ||
+        !check(!command.compare(0, root.size(), root), "compile: clang not taken from envp: " + command) ||
+        !check(command.find(TRIPLE) != std::string::npos, "compile: no target: " + command) ||
+        !check(command.find(root + "/sys/" + TRIPLE + "/include") != std::string::npos,
+               "compile: no mingw include directory: " + command))
+    {
+        return false;
+    }
+
+    std::string query;
+    compute(QUERY, &envp[0], status, query, output);
+
+    if (!check(status == 0 && output == std::string(TRIPLE) + "\n",
+               "-wc-target: status " + std::to_string(status) + ", output '" + output + "'"))
+    {
+        return false;
+    }
+
+    /*
+     * Repeated and concurrent calls must give the same command
+     */
+
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            for (int i = 0; i < 25; ++i)
+            {
+                std::string other;
+                std::string unused;
+                int otherstatus;
+
+                compute(COMPILE, &envp[0], otherstatus, other, unused);
+
+                if (otherstatus != WCLANG_COMMAND || other != command)
+                    ++mismatches;
+            }
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    return check(!mismatches, std::to_string(mismatches) + " of 100 repeated computations differ");
+}
+
+/*
+ * Remote object cache
+ */
+
+static int findfreeport()
+{
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int port = -1;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd != -1 && !bind(fd, (struct sockaddr*)&addr, sizeof(addr)) &&
+        !getsockname(fd, (struct sockaddr*)&addr, &len))
+    {
+        port = ntohs(addr.sin_port);
+    }
+
+    if (fd != -1)
+        close(fd);
+
+    return port;
+}
+
+static bool waitforserver(int port)
+{
+    struct sockaddr_in addr = {};
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bool connected = fd != -1 && !connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+
+        if (fd != -1)
+            close(fd);
+
+        if (connected)
+            return true;
+
+        usleep(50000);
+    }
+
+    return false;
+}
+
+static size_t entries;
+
+static int countentry(const char *path, const struct stat *, int type, struct FTW *ftw)
+{
+    /* <key[0:2]>/<key[2:]>, not the temporary files */
+    if (type == FTW_F && std::strlen(path + ftw->base) == 62)
+        ++entries;
+
+    return 0;
+}
+
+static size_t countentries(const std::string &dir)
+{
+    entries = 0;
+    nftw(dir.c_str(), countentry, 16, FTW_PHYS);
+    return entries;
+}
+
+/*
+ * Runs the compile step, returns the exit status, 'errors' receives stderr
+ */
+static int runwclang(const std::string &root, string_vector env, std::string &errors)
+{
+    std::string wclang = root + "/llvm/bin/" + TRIPLE + "-clang";
+    string_vector args = { wclang, "-wc-verbose", "-c", "t.c", "-o", "t.o" };
+    int pipefd[2];
+    int status;
+    pid_t pid;
+
+    errors.clear();
+
+    if (pipe(pipefd) || (pid = fork()) == -1)
+        return -1;
+
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+
+        dup2(devnull, STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[0]);
+
+        if (chdir((root + "/work").c_str()))
+            _exit(127);
+
+        auto argv = tocstrings(args);
+        auto envp = tocstrings(env);
+
+        execve(argv[0], &argv[0], &envp[0]);
+        _exit(127);
+    }
+
+    char buf[4096];
+    ssize_t n;
+
+    close(pipefd[1]);
+
+    while ((n = read(pipefd[0], buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR))
+    {
+        if (n > 0) errors.append(buf, n);
+    }
+
+    close(pipefd[0]);
+
+    if (waitpid(pid, &status, 0) == -1)
+        return -1;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static bool testremotecache(const std::string &root, const std::string &server)
+{
+    std::string serverdir = root + "/server";
+    std::string object = root + "/work/t.o";
+    std::string first;
+    std::string second;
+    std::string errors;
+    int port = findfreeport();
+    pid_t pid;
+
+    if (!check(port != -1, "cannot find a free port") || (pid = fork()) == -1)
+        return false;
+
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        std::string listen = "--listen=127.0.0.1:" + std::to_string(port);
+        std::string dir = "--dir=" + serverdir;
+
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+
+        execl(server.c_str(), server.c_str(), listen.c_str(), dir.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+
+    bool ok = check(waitforserver(port), "wclang-cache-server does not listen on port " +
+                                         std::to_string(port));
+
+    auto run = [&](const char *cache, const char *expected, std::string &result)
+    {
+        if (!ok)
+            return;
+
+        string_vector env = buildenv(root, root + "/" + cache);
+
+        env.push_back("WCLANG_OBJECT_CACHE=1");
+        env.push_back("WCLANG_REMOTE_CACHE=http://127.0.0.1:" + std::to_string(port) + "/wclang");
+
+        unlink(object.c_str());
+
+        int status = runwclang(root, env, errors);
+
+        ok = check(status == 0, std::string(cache) + ": exit status " + std::to_string(status) +
+                                "\n" + errors) &&
+             check(errors.find(expected) != std::string::npos,
+                   std::string(cache) + ": no '" + expected + "' in\n" + errors) &&
+             check(readfile(object, result) && !result.empty(), std::string(cache) + ": no object");
+    };
+
+    run("cache1", "object cache: miss", first);
+
+    /* uploads run in the background */
+    for (int i = 0; ok && i < 200 && !countentries(serverdir); ++i)
+        usleep(50000);
+
+    ok = ok && check(countentries(serverdir) == 1, "the cache entry was not uploaded");
+
+    run("cache2", "object cache: remote hit", second);
+
+    ok = ok && check(first == second, "the remote hit restored a different object");
+
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+
+    return ok;
+}
+
+/*
+ * Stub compiler mode
+ */
+
+static int stubmain(int argc, char **argv)
+{
+    const char *input = nullptr;
+    const char *output = nullptr;
+    bool preprocess = false;
+    bool compile = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        size_t len = std::strlen(arg);
+
+        if (!std::strcmp(arg, "-o") && i+1 < argc) output = argv[++i];
+        else if (!std::strcmp(arg, "-E")) preprocess = true;
+        else if (!std::strcmp(arg, "-c")) compile = true;
+        else if (*arg != '-' && len > 2 && !std::strcmp(arg + len - 2, ".c")) input = arg;
+    }
+
+    std::string source;
+
+    if (!input || (!preprocess && !compile))
+        return 0;
+
+    if (!readfile(input, source))
+        return 1;
+
+    if (preprocess && !output)
+    {
+        std::cout << source;
+        return 0;
+    }
+
+    if (!output)
+        return 0;
+
+    return writefile(output, preprocess ? source : "object of " + source) ? 0 : 1;
+}
+
+static void usage()
+{
+    std::cerr << "usage: wclang-test compute\n"
+                 "       wclang-test remote-cache <wclang> <wclang-cache-server>" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = std::strrchr(argv[0], '/');
+    name = name ? name + 1 : argv[0];
+
+    if (std::strcmp(name, "wclang-test"))
+        return stubmain(argc, argv);
+
+    std::string test = argc > 1 ? argv[1] : "";
+    std::string wclang;
+    std::string server;
+    char self[PATH_MAX];
+    char path[PATH_MAX];
+
+    if (test == "remote-cache" && argc == 4)
+    {
+        if (!realpath(argv[2], path) || !(wclang = path, realpath(argv[3], path)))
+        {
+            std::cerr << "cannot find " << argv[2] << " or " << argv[3] << std::endl;
+            return 1;
+        }
+
+        server = path;
+    }
+    else if (test != "compute" || argc != 2)
+    {
+        usage();
+        return 1;
+    }
+
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+
+    if (len <= 0)
+        return 1;
+
+    self[len] = '\0';
+
+    const char *tmpdir = getenv("TMPDIR");
+    std::string root = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/wclang-test-XXXXXX";
+
+    if (!mkdtemp(&root[0]))
+    {
+        std::cerr << "cannot create temporary directory" << std::endl;
+        return 1;
+    }
+
+    bool ok = check(createtree(root, self, wclang), "cannot create synthetic tree in " + root);
+
+    if (ok)
+        ok = test == "compute" ? testcompute(root) : testremotecache(root, server);
+
+    nftw(root.c_str(), removefile, 64, FTW_DEPTH | FTW_PHYS);
+    return ok ? 0 : 1;
+}
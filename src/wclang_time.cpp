@@ -21,8 +21,16 @@
 
 #include <tuple>
 #include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "wclang.h"
 #include "wclang_time.h"
+#include "wclang_cache.h"
 
 #ifdef HAVE_STD_CHRONO
 time_point getticks()
@@ -35,6 +43,12 @@ ullong getmicrodiff(time_point &start, time_point time)
     using namespace std::chrono;
     return duration_cast<duration<ullong, micro>>(time-start).count();
 }
+ullong getmicrotime(time_point time)
+{
+    using namespace std;
+    using namespace std::chrono;
+    return duration_cast<duration<ullong, micro>>(time.time_since_epoch()).count();
+}
 #else
 /*
  * steady_clock and monotonic_clock are broken in
@@ -52,4 +66,301 @@ ullong getmicrodiff(time_point &start, time_point time)
 {
     return time-start;
 }
+ullong getmicrotime(time_point time)
+{
+    return time;
+}
 #endif
+
+/*
+ * Chrome trace events
+ */
+
+struct traceentry {
+    std::string name;
+    ullong ts;
+    ullong dur;
+    int tid;
+    std::string args;
+};
+
+static int tracestate = -1;
+static std::string tracename;
+static std::vector<traceentry> traceentries;
+static std::vector<std::tuple<const char*, time_point>> tracestack;
+static std::string foreignevents;
+static thread_local bool tracesuspended = false;
+
+void suspendtrace(bool suspend)
+{
+    tracesuspended = suspend;
+}
+
+bool usetrace()
+{
+    if (tracesuspended)
+        return false;
+
+    if (tracestate == -1)
+    {
+        const char *file = getenv("WCLANG_TRACE");
+        const char *dir = getenv("WCLANG_TRACE_DIR");
+
+        tracestate = (file && *file && std::strcmp(file, "0")) || (dir && *dir);
+
+        if (tracestate)
+            atexit(writetrace);
+    }
+
+    return tracestate == 1;
+}
+
+void settracename(const std::string &name)
+{
+    tracename = name;
+}
+
+void tracebegin(const char *name)
+{
+    if (!usetrace())
+        return;
+
+    tracestack.push_back(std::make_tuple(name, getticks()));
+}
+
+void traceend(const std::string &args)
+{
+    if (tracesuspended || tracestack.empty())
+        return;
+
+    auto &span = tracestack.back();
+    traceevent(std::get<0>(span), std::get<1>(span), getticks(), 0, args);
+    tracestack.pop_back();
+}
+
+void traceevent(const std::string &name, time_point start, time_point end,
+                int tid, const std::string &args)
+{
+    if (!usetrace())
+        return;
+
+    traceentry entry;
+
+    entry.name = name;
+    entry.ts = getmicrotime(start);
+    entry.dur = getmicrodiff(start, end);
+    entry.tid = tid;
+    entry.args = args;
+
+    traceentries.push_back(entry);
+}
+
+static bool replacenumber(std::string &event, const char *key, double offset, bool set)
+{
+    size_t pos = event.find(key);
+
+    if (pos == std::string::npos)
+        return false;
+
+    pos += std::strlen(key);
+
+    const char *start = event.c_str() + pos;
+    char *end;
+    double val = std::strtod(start, &end);
+
+    if (end == start)
+        return false;
+
+    val = set ? offset : val + offset;
+    event.replace(pos, end-start, std::to_string((long long)std::llround(val)));
+
+    return true;
+}
+
+bool mergeclangtrace(const std::string &file, time_point childstart)
+{
+    std::string data;
+    double offset;
+    size_t pos;
+
+    if (!usetrace() || !readfile(file.c_str(), data))
+        return false;
+
+    /*
+     * clang's timestamps are relative to beginningOfTime
+     * (microseconds since the unix epoch)
+     */
+
+    if ((pos = data.find("\"beginningOfTime\":")) != std::string::npos)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        double realtime = ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+        double begin = std::strtod(data.c_str() + pos + STRLEN("\"beginningOfTime\":"), nullptr);
+
+        offset = begin - realtime + getmicrotime(getticks());
+    }
+    else
+    {
+        offset = getmicrotime(childstart);
+    }
+
+    if ((pos = data.find("\"traceEvents\"")) == std::string::npos ||
+        (pos = data.find('[', pos)) == std::string::npos)
+    {
+        return false;
+    }
+
+    size_t objstart = 0;
+    int depth = 0;
+    bool instring = false;
+
+    for (size_t i = pos+1; i < data.size(); ++i)
+    {
+        char c = data[i];
+
+        if (instring)
+        {
+            if (c == '\\') ++i;
+            else if (c == '"') instring = false;
+            continue;
+        }
+
+        if (c == '"')
+        {
+            instring = true;
+        }
+        else if (c == '{')
+        {
+            if (depth++ == 0) objstart = i;
+        }
+        else if (c == '}')
+        {
+            if (--depth == 0)
+            {
+                std::string event(data, objstart, i-objstart+1);
+
+                /* keep our own process name */
+                if (event.find("\"process_name\"") != std::string::npos)
+                    continue;
+
+                replacenumber(event, "\"ts\":", offset, false);
+                replacenumber(event, "\"pid\":", getpid(), true);
+
+                foreignevents += event;
+                foreignevents += ",\n";
+            }
+        }
+        else if (c == ']' && depth == 0)
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+void discardtrace()
+{
+    traceentries.clear();
+    tracestack.clear();
+    foreignevents.clear();
+}
+
+static void appendtracefile(const std::string &file, const std::string &data)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    if (fd == -1 && errno == ENOENT)
+    {
+        /*
+         * Create the file with the opening bracket in place,
+         * the closing bracket is optional in the trace format
+         */
+
+        std::string tmp = file + ".tmp." + std::to_string(getpid());
+        int tmpfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (tmpfd != -1)
+        {
+            ssize_t n = write(tmpfd, "[\n", 2);
+            (void)n;
+            close(tmpfd);
+
+            /* fails if someone else was faster */
+            int r = link(tmp.c_str(), file.c_str());
+            (void)r;
+
+            unlink(tmp.c_str());
+        }
+
+        fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+
+    if (fd == -1)
+        return;
+
+    /* a single write, so that concurrent invocations do not interleave */
+    ssize_t n = write(fd, data.c_str(), data.size());
+    (void)n;
+
+    close(fd);
+}
+
+void writetrace()
+{
+    if (tracestate != 1)
+        return;
+
+    while (!tracestack.empty())
+        traceend();
+
+    if (traceentries.empty() && foreignevents.empty())
+        return;
+
+    std::string pid = std::to_string(getpid());
+    std::string data;
+
+    if (!tracename.empty())
+    {
+        data += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + pid +
+                ",\"args\":{\"name\":" + jsonstring(tracename) + "}},\n";
+    }
+
+    for (const auto &entry : traceentries)
+    {
+        data += "{\"name\":" + jsonstring(entry.name) + ",\"cat\":\"wclang\",\"ph\":\"X\"";
+        data += ",\"ts\":" + std::to_string(entry.ts);
+        data += ",\"dur\":" + std::to_string(entry.dur);
+        data += ",\"pid\":" + pid;
+        data += ",\"tid\":" + (entry.tid ? std::to_string(entry.tid) : pid);
+
+        if (!entry.args.empty())
+            data += ",\"args\":{" + entry.args + "}";
+
+        data += "},\n";
+    }
+
+    data += foreignevents;
+    discardtrace();
+
+    const char *file = getenv("WCLANG_TRACE");
+
+    if (file && *file && std::strcmp(file, "0") && std::strcmp(file, "1"))
+    {
+        appendtracefile(file, data);
+        return;
+    }
+
+    const char *dir = getenv("WCLANG_TRACE_DIR");
+    std::string path = dir && *dir ? dir : ".";
+
+    path += "/wclang-trace-" + pid + "-" + std::to_string(getmicrotime(getticks())) + ".json";
+
+    /* strip the last separator */
+    data.resize(data.size()-2);
+    data = "[\n" + data + "\n]\n";
+
+    writefileatomic(path, data);
+}
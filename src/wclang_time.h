@@ -12,3 +12,43 @@ time_point getticks();
 
 typedef std::tuple<const char*, time_point> time_tuple;
 typedef std::vector<time_tuple> time_vector;
+
+/*
+ * Chrome trace events (chrome://tracing, Perfetto)
+ *
+ * $WCLANG_TRACE=<file>: events of all invocations are appended
+ *                       to <file> (one pid lane per invocation)
+ * $WCLANG_TRACE=1 or $WCLANG_TRACE_DIR=<dir>: one file per
+ *                       invocation in <dir> (default: cwd)
+ *
+ * 'args' is the (unbraced) body of the JSON args object.
+ */
+
+ullong getmicrotime(time_point time);
+
+bool usetrace();
+void settracename(const std::string &name);
+void tracebegin(const char *name);
+void traceend(const std::string &args = std::string());
+void traceevent(const std::string &name, time_point start, time_point end,
+                int tid = 0, const std::string &args = std::string());
+
+/*
+ * Adds the events of a clang -ftime-trace file,
+ * shifted to our clock
+ */
+bool mergeclangtrace(const std::string &file, time_point childstart);
+
+void discardtrace();
+void writetrace();
+
+/*
+ * Tracing is process wide, the library suspends
+ * it for the threads it computes commands on
+ */
+void suspendtrace(bool suspend);
+
+struct tracescope {
+    tracescope(const char *name) { tracebegin(name); }
+    ~tracescope() { traceend(); }
+};
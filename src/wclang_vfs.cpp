@@ -0,0 +1,288 @@
+/***********************************************************************
+ *  wclang                                                             *
+ *  Copyright (C) 2013-2019 Thomas Poechtrager                         *
+ *  t.poechtrager@gmail.com                                            *
+ *                                                                     *
+ *  This program is free software; you can redistribute it and/or      *
+ *  modify it under the terms of the GNU General Public License        *
+ *  as published by the Free Software Foundation; either version 2     *
+ *  of the License, or (at your option) any later version.             *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the      *
+ *  GNU General Public License for more details.                       *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, write to the Free Software        *
+ *  Foundation, Inc.,                                                  *
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.      *
+ ***********************************************************************/
+
+#include <cstring>
+#include <set>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wclang.h"
+#include "wclang_cache.h"
+#include "wclang_vfs.h"
+
+static constexpr char VFSDIR[] = "/vfs";
+static constexpr char DEPSMAGIC[] = "wclang-vfs 1";
+
+/*
+ * Limits the recursion into (possibly cyclic) symlinked directories
+ */
+static constexpr int MAXDEPTH = 8;
+
+bool usecaseinsensitive()
+{
+    const char *p;
+    return (p = getenvvar("WCLANG_CASE_INSENSITIVE")) && *p == '1';
+}
+
+/*
+ * Removes . and .. lexically like clang does for overlay
+ * paths, symlinks are not resolved
+ */
+static std::string normalizepath(const std::string &path)
+{
+    string_vector components;
+    size_t pos = 0;
+
+    while (pos < path.size())
+    {
+        size_t end = path.find(PATHDIV, pos);
+        if (end == std::string::npos) end = path.size();
+
+        std::string component(path, pos, end-pos);
+        pos = end+1;
+
+        if (component.empty() || component == ".")
+            continue;
+
+        if (component == "..")
+        {
+            if (!components.empty())
+                components.pop_back();
+            continue;
+        }
+
+        components.push_back(component);
+    }
+
+    std::string result;
+
+    for (const auto &component : components)
+    {
+        result += PATHDIV;
+        result += component;
+    }
+
+    return result.empty() ? std::string(1, PATHDIV) : result;
+}
+
+static std::string tolowercase(const char *str)
+{
+    std::string result = str;
+
+    for (char &c : result)
+        c = tolower(c);
+
+    return result;
+}
+
+/*
+ * Appends the overlay entries of the files below 'dirfd' to 'json',
+ * 'dir' is the path as given, the kernel resolves its .. components
+ */
+static void scanfiles(int dirfd, const std::string &dir, int depth, std::string &json,
+                      size_t &files, cachedep_vector &deps, bool &stable)
+{
+    std::set<std::string> names;
+    bool first = true;
+
+    if (!adddirectorydep(dirfd, dir, deps))
+        stable = false;
+
+    scandirectory(dirfd, [&](const char *name)
+    {
+        struct stat st;
+
+        if (fstatat(dirfd, name, &st, 0))
+            return;
+
+        /* entries differing in case only would shadow each other */
+        if (!names.insert(tolowercase(name)).second)
+            return;
+
+        std::string path = dir + PATHDIV + name;
+        std::string indent((depth+3) * 2, ' ');
+
+        if (S_ISDIR(st.st_mode))
+        {
+            int subdirfd;
+
+            if (depth >= MAXDEPTH || (subdirfd = opendirectory(name, dirfd)) == -1)
+                return;
+
+            json += first ? "\n" : ",\n";
+            json += indent + "{ \"name\": " + jsonstring(name) +
+                    ", \"type\": \"directory\", \"contents\": [";
+
+            scanfiles(subdirfd, path, depth+1, json, files, deps, stable);
+            close(subdirfd);
+
+            json += " ] }";
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            json += first ? "\n" : ",\n";
+            json += indent + "{ \"name\": " + jsonstring(name) +
+                    ", \"type\": \"file\", \"external-contents\": " + jsonstring(path) + " }";
+            ++files;
+        }
+        else
+        {
+            return;
+        }
+
+        first = false;
+    });
+}
+
+std::string getvfsoverlay(const string_vector &dirs, bool verbose)
+{
+    std::string dir;
+    std::string key;
+    string_vector roots;    /* overlay names, clang removes . and .. lexically */
+    string_vector rootdirs;
+    cachedep_vector deps;
+
+    if (dirs.empty() || !getcachedir(dir))
+        return std::string();
+
+    for (const auto &d : dirs)
+    {
+        key += d;
+        key += '\n';
+    }
+
+    dir += VFSDIR;
+
+    std::string base = dir + PATHDIV + hashtostring(fnv1a64(key));
+    std::string overlay = base + ".yaml";
+    std::string depsfile = base + ".deps";
+
+    /*
+     * The overlay is written before its dependencies,
+     * valid dependencies imply a complete overlay
+     */
+
+    if (loaddeps(depsfile, DEPSMAGIC, deps) && checkdeps(deps))
+        return overlay;
+
+    /*
+     * Directories below another one are covered by its entries
+     * already (e.g. c++/<target> below c++)
+     */
+
+    for (const auto &d : dirs)
+    {
+        std::string root = normalizepath(d);
+
+        if (std::find(roots.begin(), roots.end(), root) == roots.end())
+        {
+            roots.push_back(root);
+            rootdirs.push_back(d);
+        }
+    }
+
+    auto iscovered = [&](const std::string &root)
+    {
+        for (const auto &other : roots)
+        {
+            if (root.size() > other.size() && !root.compare(0, other.size(), other) &&
+                (other.size() == 1 || root[other.size()] == PATHDIV))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    /*
+     * JSON is valid YAML. 'fallthrough' cannot be limited to
+     * the roots, without it no other file could be opened
+     */
+
+    std::string json = "{\n  \"version\": 0,\n  \"case-sensitive\": \"false\",\n"
+                       "  \"fallthrough\": \"true\",\n  \"roots\": [";
+    size_t files = 0;
+    bool stable = true;
+    bool first = true;
+
+    for (size_t i = 0; i < roots.size(); ++i)
+    {
+        const std::string &root = roots[i];
+        int dirfd;
+
+        if (iscovered(root) || (dirfd = opendirectory(rootdirs[i].c_str())) == -1)
+            continue;
+
+        json += first ? "\n" : ",\n";
+        json += "    { \"name\": " + jsonstring(root) + ", \"type\": \"directory\", \"contents\": [";
+
+        scanfiles(dirfd, rootdirs[i], 0, json, files, deps, stable);
+        close(dirfd);
+
+        json += " ] }";
+        first = false;
+    }
+
+    json += "\n  ]\n}\n";
+
+    if (!makedirectories(dir))
+        return std::string();
+
+    unlink(depsfile.c_str());
+
+    if (!writefileatomic(overlay, json))
+        return std::string();
+
+    if (stable)
+        storedeps(depsfile, DEPSMAGIC, deps);
+
+    if (verbose)
+        verbosemsg("generated VFS overlay % (% files)", overlay, files);
+
+    return overlay;
+}
+
+size_t clearvfsoverlays()
+{
+    std::string dir;
+    string_vector files;
+    size_t n = 0;
+
+    if (!getcachedir(dir))
+        return 0;
+
+    dir += VFSDIR;
+
+    if (!listfiles(dir.c_str(), &files))
+        return 0;
+
+    for (const auto &file : files)
+    {
+        if (file.size() > 5 && !file.compare(file.size()-5, 5, ".yaml"))
+            ++n;
+
+        unlink((dir + PATHDIV + file).c_str());
+    }
+
+    return n;
+}
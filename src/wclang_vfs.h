@@ -0,0 +1,26 @@
+/*
+ * Case-insensitive includes (-wc-case-insensitive,
+ * $WCLANG_CASE_INSENSITIVE=1)
+ *
+ * Windows code often includes <Windows.h> or <WinSock2.h>, while the
+ * mingw headers are lowercase. A clang VFS overlay ('case-sensitive':
+ * 'false') listing every file below the C and C++ include directories
+ * is passed with -ivfsoverlay, so such includes resolve to the real
+ * files on the first lookup, without a symlink farm.
+ *
+ * The overlay is cached below <cachedir>/vfs per set of directories
+ * and regenerated once one of them changes.
+ *
+ * 'fallthrough' applies to the whole overlay in clang, so misses in
+ * the covered directories still reach the real file system.
+ */
+
+bool usecaseinsensitive();
+
+/*
+ * Returns the overlay for 'dirs' or an
+ * empty string if it cannot be created
+ */
+std::string getvfsoverlay(const string_vector &dirs, bool verbose);
+
+size_t clearvfsoverlays();